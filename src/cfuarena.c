@@ -0,0 +1,185 @@
+/*
+ * cfuarena.c - This file is part of the libcfu library
+ *
+ * Copyright (c) 2005 Don Owens. All rights reserved.
+ *
+ * This code is released under the BSD license:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   * Neither the name of the author nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "cfu.h"
+#include "cfuarena.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CFUARENA_DEFAULT_CHUNK_SIZE (64 * 1024)
+
+/* Chunks double in size up to this, so that large arenas are made of
+   few chunks.
+*/
+#define CFUARENA_MAX_CHUNK_SIZE (4 * 1024 * 1024)
+
+/* Alignment of every allocation */
+typedef union cfuarena_align {
+	void *p;
+	long l;
+	double d;
+	long double ld;
+} cfuarena_align;
+
+#define CFUARENA_ALIGN (sizeof(cfuarena_align))
+
+typedef struct cfuarena_chunk {
+	struct cfuarena_chunk *next;
+	cfuarena_align data[1];
+} cfuarena_chunk;
+
+struct cfuarena {
+	cfuarena_chunk *chunks;
+	char *ptr;
+	char *end;
+	size_t chunk_size;
+	size_t bytes_used;
+};
+
+cfuarena_t *
+cfuarena_new(size_t chunk_size) {
+	cfuarena_t *arena = calloc(1, sizeof(cfuarena_t));
+
+	if (!arena) return NULL;
+
+	arena->chunk_size = chunk_size ? chunk_size : CFUARENA_DEFAULT_CHUNK_SIZE;
+
+	return arena;
+}
+
+static cfuarena_chunk *
+_new_chunk(cfuarena_t *arena, size_t size) {
+	cfuarena_chunk *chunk = malloc(offsetof(cfuarena_chunk, data) + size);
+
+	if (!chunk) return NULL;
+
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+
+	return chunk;
+}
+
+void *
+cfuarena_alloc(cfuarena_t *arena, size_t size) {
+	cfuarena_chunk *chunk = NULL;
+	char *ptr = NULL;
+
+	size = (size + CFUARENA_ALIGN - 1) & ~(CFUARENA_ALIGN - 1);
+	if (size == 0) size = CFUARENA_ALIGN;
+
+	if ((size_t)(arena->end - arena->ptr) >= size) {
+		ptr = arena->ptr;
+		arena->ptr += size;
+		arena->bytes_used += size;
+		return ptr;
+	}
+
+	if (size > arena->chunk_size / 4) {
+		/* Large requests get a chunk of their own so that the rest
+		   of the current chunk is not wasted.
+		*/
+		if ( !(chunk = _new_chunk(arena, size)) ) return NULL;
+		arena->bytes_used += size;
+		return chunk->data;
+	}
+
+	if ( !(chunk = _new_chunk(arena, arena->chunk_size)) ) return NULL;
+	ptr = (char *)chunk->data;
+	arena->ptr = ptr + size;
+	arena->end = ptr + arena->chunk_size;
+	arena->bytes_used += size;
+	if (arena->chunk_size < CFUARENA_MAX_CHUNK_SIZE) arena->chunk_size *= 2;
+
+	return ptr;
+}
+
+void *
+cfuarena_calloc(cfuarena_t *arena, size_t nmemb, size_t size) {
+	void *ptr = NULL;
+
+	if (size && nmemb > (size_t)-1 / size) return NULL;
+	if ( (ptr = cfuarena_alloc(arena, nmemb * size)) ) memset(ptr, 0, nmemb * size);
+
+	return ptr;
+}
+
+char *
+cfuarena_strndup(cfuarena_t *arena, const char *str, size_t n) {
+	char *ns = cfuarena_alloc(arena, n + 1);
+
+	if (!ns) return NULL;
+	memcpy(ns, str, n);
+	ns[n] = '\000';
+
+	return ns;
+}
+
+size_t
+cfuarena_bytes_used(cfuarena_t *arena) {
+	return arena->bytes_used;
+}
+
+void
+cfuarena_merge(cfuarena_t *arena, cfuarena_t *other) {
+	cfuarena_chunk **tail = &arena->chunks;
+
+	/* chunks are never moved, so they can simply be relinked */
+	while (*tail) tail = &(*tail)->next;
+	*tail = other->chunks;
+	arena->bytes_used += other->bytes_used;
+
+	free(other);
+}
+
+void
+cfuarena_destroy(cfuarena_t *arena) {
+	cfuarena_chunk *chunk = NULL;
+
+	if (!arena) return;
+
+	while ( (chunk = arena->chunks) ) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+}
@@ -0,0 +1,94 @@
+/*
+ * cfuarena.h - This file is part of the libcfu library
+ *
+ * Copyright (c) 2005 Don Owens. All rights reserved.
+ *
+ * This code is released under the BSD license:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   * Neither the name of the author nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Internal header, not installed.  A simple region allocator: memory
+ * is carved sequentially out of large chunks and is only released, all
+ * at once, when the arena is destroyed.  Hashes and lists created with
+ * an arena take all of their memory from it, so destroying them is
+ * free and destroying the arena releases everything.
+ */
+
+#ifndef CFU_ARENA_H_
+#define CFU_ARENA_H_
+
+#include <cfu.h>
+#include <cfuhash.h>
+#include <cfulist.h>
+
+CFU_BEGIN_DECLS
+
+typedef struct cfuarena cfuarena_t;
+
+/* Returns a new, empty arena.  Memory is requested from the system
+ * in chunks of at least chunk_size bytes; zero selects a default.
+ */
+cfuarena_t * cfuarena_new(size_t chunk_size);
+
+/* Returns size bytes of suitably aligned, uninitialized memory */
+void * cfuarena_alloc(cfuarena_t *arena, size_t size);
+
+/* Same as cfuarena_alloc(), but zero-filled */
+void * cfuarena_calloc(cfuarena_t *arena, size_t nmemb, size_t size);
+
+/* Returns a NUL-terminated copy of the first n bytes of str */
+char * cfuarena_strndup(cfuarena_t *arena, const char *str, size_t n);
+
+/* Returns the number of bytes handed out so far */
+size_t cfuarena_bytes_used(cfuarena_t *arena);
+
+/* Hands all memory allocated from other over to arena, which then
+ * releases it along with its own, and frees other.
+ */
+void cfuarena_merge(cfuarena_t *arena, cfuarena_t *other);
+
+/* Releases all memory allocated from the arena */
+void cfuarena_destroy(cfuarena_t *arena);
+
+/* Same as cfuhash_new_with_flags(), except that the table, its buckets,
+ * entries and key copies are allocated from arena.  Destroying the
+ * table only runs the free functions, if any.
+ */
+cfuhash_table_t * cfuhash_new_in_arena(cfuarena_t *arena, unsigned int flags);
+
+/* Same as cfulist_new(), except that the list and its entries are
+ * allocated from arena.
+ */
+cfulist_t * cfulist_new_in_arena(cfuarena_t *arena);
+
+CFU_END_DECLS
+
+#endif /* CFU_ARENA_H_ */
@@ -0,0 +1,72 @@
+/*
+ * cfuatomic.h - This file is part of the libcfu library
+ *
+ * Copyright (c) 2005 Don Owens. All rights reserved.
+ *
+ * This code is released under the BSD license:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   * Neither the name of the author nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Internal header, not installed.  Thin wrappers around the compiler
+ * __atomic builtins, available when HAVE_ATOMIC_BUILTINS is defined.
+ * The unqualified forms are sequentially consistent.
+ */
+
+#ifndef CFU_ATOMIC_H_
+#define CFU_ATOMIC_H_
+
+#ifdef HAVE_ATOMIC_BUILTINS
+
+# define CFU_ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+# define CFU_ATOMIC_LOAD_RELAXED(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+# define CFU_ATOMIC_LOAD_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+
+# define CFU_ATOMIC_STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_SEQ_CST)
+# define CFU_ATOMIC_STORE_RELAXED(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+# define CFU_ATOMIC_STORE_RELEASE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+
+# define CFU_ATOMIC_EXCHANGE(ptr, val) __atomic_exchange_n((ptr), (val), __ATOMIC_SEQ_CST)
+# define CFU_ATOMIC_FETCH_ADD(ptr, val) __atomic_fetch_add((ptr), (val), __ATOMIC_SEQ_CST)
+# define CFU_ATOMIC_FETCH_SUB(ptr, val) __atomic_fetch_sub((ptr), (val), __ATOMIC_SEQ_CST)
+
+/* Returns true if *ptr was *expected and has been replaced by val.
+ * Otherwise the current value is stored in *expected, with acquire
+ * ordering so callers may act on it.
+ */
+# define CFU_ATOMIC_CAS(ptr, expected, val) \
+	__atomic_compare_exchange_n((ptr), (expected), (val), 0, \
+		__ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)
+
+# define CFU_ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#endif /* HAVE_ATOMIC_BUILTINS */
+
+#endif /* CFU_ATOMIC_H_ */
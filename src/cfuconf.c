@@ -41,12 +41,33 @@
 
 #include "cfu.h"
 #include "cfuconf.h"
+#include "cfuarena.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
 #include <assert.h>
+#include <errno.h>
+#include <ctype.h>
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#include "cfuatomic.h"
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+# define CFUCONF_USE_MMAP
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+#endif
 
 #if defined(HAVE_STRCASECMP) && defined(HAVE_STRINGS_H)
 # include <strings.h>
@@ -69,6 +90,7 @@ struct cfuconf {
 	cfuhash_table_t *directives;
 	char *container_type;
 	char *container_name;
+	cfuarena_t *arena; /* set on the top level only, when it owns one */
 };
 
 typedef struct cfuconf_stack_entry {
@@ -78,11 +100,19 @@ typedef struct cfuconf_stack_entry {
 } cfuconf_stack_entry_t;
 
 static cfuconf_t *
-cfuconf_new(void) {
-	cfuconf_t *conf = calloc(1, sizeof(cfuconf_t));
+cfuconf_new(cfuarena_t *arena) {
+	cfuconf_t *conf = NULL;
+
+	if (arena) {
+		conf = cfuarena_calloc(arena, 1, sizeof(cfuconf_t));
+		conf->containers = cfuhash_new_in_arena(arena, CFUHASH_IGNORE_CASE);
+		conf->directives = cfuhash_new_in_arena(arena, CFUHASH_IGNORE_CASE);
+	} else {
+		conf = calloc(1, sizeof(cfuconf_t));
+		conf->containers = cfuhash_new_with_flags(CFUHASH_IGNORE_CASE);
+		conf->directives = cfuhash_new_with_flags(CFUHASH_IGNORE_CASE);
+	}
 	conf->type = libcfu_t_conf;
-	conf->containers = cfuhash_new_with_flags(CFUHASH_IGNORE_CASE);
-	conf->directives = cfuhash_new_with_flags(CFUHASH_IGNORE_CASE);
 
 	return conf;
 }
@@ -134,6 +164,12 @@ _directive_free_fn(void *data) {
 
 void
 cfuconf_destroy(cfuconf_t *conf) {
+	if (conf->arena) {
+		/* the whole tree, conf included, lives in the arena */
+		cfuarena_destroy(conf->arena);
+		return;
+	}
+
 	if (conf->containers) {
 		/* cfuhash_foreach(conf->containers, _container_free_foreach_fn, NULL); */
 		cfuhash_destroy_with_free_fn(conf->containers, _container_free_hashes_fn);
@@ -210,38 +246,51 @@ cfuconf_get_directive_two_args(cfuconf_t *conf, char *directive, char **rvalue,
 	return cfuconf_get_directive_n_args(conf, directive, 2, rvalue, rvalue2);
 }
 
+/* Stores the first n values in val_list through the char ** arguments in ap */
+static int
+_get_n_args(cfulist_t *val_list, size_t n, va_list ap) {
+	size_t i = 0;
+	void *val = NULL;
+	size_t size = 0;
+
+	for (i = 0; i < n; i++) {
+		char **ptr = va_arg(ap, char **);
+		if (!cfulist_nth_data(val_list, &val, &size, i)) return -1;
+		*ptr = (char *)val;
+	}
+
+	return 0;
+}
+
 int
 cfuconf_get_directive_n_args(cfuconf_t *conf, char *directive, size_t n, ...) {
 	va_list ap;
-	size_t i = 0;
-	char **ptr = NULL;
 	int rv = -1;
 	cfulist_t *val_list = NULL;
-	void *val = NULL;
-	size_t size = 0;
 
 	if (_get_directive_last_val_list(conf, directive, &val_list) >= 0) {
-
 		va_start(ap, n);
-		for (i = 0; i < n; i++) {
-			ptr = va_arg(ap, char **);
-			if (cfulist_nth_data(val_list, &val, &size, 1)) {
-				*ptr = (char *)val;
-			} else {
-				i--;
-				break;
-			}
-		}
+		rv = _get_n_args(val_list, n, ap);
 		va_end(ap);
-
-		if (i == n) rv = 0;
-
 	}
 
 	return rv;
 }
 
-/*
+cfuhash_table_t *
+cfuconf_get_containers_of_type(cfuconf_t *conf, char *type) {
+	if (!conf || !type) return NULL;
+	return cfuhash_get(conf->containers, type);
+}
+
+cfuconf_t *
+cfuconf_get_container(cfuconf_t *conf, char *type, char *name) {
+	cfuhash_table_t *containers = cfuconf_get_containers_of_type(conf, type);
+
+	if (!containers) return NULL;
+	return cfuhash_get(containers, name);
+}
+
 static cfuconf_stack_entry_t *
 new_stack_entry(cfuhash_table_t *ht, char *container_type, char *container_name) {
 	cfuconf_stack_entry_t *entry = calloc(1, sizeof(cfuconf_stack_entry_t));
@@ -250,38 +299,42 @@ new_stack_entry(cfuhash_table_t *ht, char *container_type, char *container_name)
 	entry->container_name = container_name;
 	return entry;
 }
-*/
-
-static char *
-cfuconf_get_line(FILE *fp) {
-	char buf[1024];
-	cfustring_t *str = cfustring_new_with_initial_size(16);
-	char *rv = NULL;
-
-	if (fgets(buf, 1024, fp)) {
-		cfustring_append(str, buf);
-		while (strlen(buf) == 1024 - 1 && buf[1024 - 2] != '\n') {
-			if (!fgets(buf, 1024, fp)) break;
-			cfustring_append(str, buf);
-		}
-		rv = cfustring_get_buffer_copy(str);
-	}
 
-	cfustring_destroy(str);
-	return rv;
+static void
+_free_stack_entry(void *data) {
+	cfuconf_stack_entry_t *entry = (cfuconf_stack_entry_t *)data;
+	free(entry->container_type);
+	free(entry->container_name);
+	free(entry);
 }
 
-static cfulist_t *
-_slurp_file_from_fp(FILE *fp) {
-	cfulist_t *lines = cfulist_new();
-	char *buf = NULL;
-
-	while ( (buf = cfuconf_get_line(fp)) ) {
-		cfulist_push(lines, buf);
-	}
-
-	return lines;
-}
+/* Parser state.  The input is consumed a line at a time straight out
+   of the caller's buffers; only the names and values that end up in
+   the tree are copied, plus any line that straddles two buffers.
+   Without a tree (conf is NULL), the stack holds a
+   cfuconf_stack_entry_t for each open container and each line is
+   reported to the callbacks instead.
+*/
+struct cfuconf_parser {
+	cfuconf_t *conf;
+	cfuconf_t *cur_conf;
+	cfulist_t *stack;
+	cfuarena_t *arena;
+	char *scratch;
+	size_t scratch_size;
+	char *partial;
+	size_t partial_len;
+	size_t partial_size;
+	char **values;
+	size_t values_size;
+	size_t cur_line;
+	char **error;
+	int done;
+	cfuconf_open_fn_t open_fn;
+	cfuconf_close_fn_t close_fn;
+	cfuconf_directive_fn_t directive_fn;
+	void *arg;
+};
 
 static CFU_INLINE int
 _is_whitespace(char c) {
@@ -291,55 +344,70 @@ _is_whitespace(char c) {
 	return 0;
 }
 
-static CFU_INLINE char *
-_eat_whitespace(char *buf) {
-	char *ptr = buf;
+static CFU_INLINE const char *
+_eat_whitespace(const char *ptr, const char *end) {
+	while (ptr < end && _is_whitespace(*ptr)) {
+		ptr++;
+	}
+
+	return ptr;
+}
 
-	while (_is_whitespace(*ptr)) {
+/* Returns a pointer just past the name or value starting at ptr */
+static CFU_INLINE const char *
+_token_end(const char *ptr, const char *end) {
+	while (ptr < end && *ptr != '>' && !_is_whitespace(*ptr)) {
 		ptr++;
 	}
 
 	return ptr;
 }
 
+/* Returns a buffer of at least size bytes that is reused from line
+   to line, for keys that are only needed for a hash lookup.
+*/
 static char *
-_get_name(char **buf) {
-	char *ptr = *buf;
-	char *name = *buf;
-	name = _eat_whitespace(*buf);
-	ptr = name;
-
-	if (!*ptr || *ptr == '>') {
-		*buf = ptr;
-		return NULL;
+_scratch_reserve(cfuconf_parser_t *p, size_t size) {
+	if (size > p->scratch_size) {
+		size_t new_size = p->scratch_size ? p->scratch_size : 64;
+		while (new_size < size) new_size *= 2;
+		p->scratch = realloc(p->scratch, new_size);
+		p->scratch_size = new_size;
 	}
-	while (*ptr && *ptr != '>' && !_is_whitespace(*ptr)) ptr++;
-	name = cfustring_dup_c_str_n(name, ptr - name);
-	*buf = ptr;
 
-	return name;
+	return p->scratch;
 }
 
 static char *
-_get_value(char **buf) {
-	char *ptr = *buf;
-	char *value = *buf;
-	value = _eat_whitespace(*buf);
-	ptr = value;
+_scratch_copy(cfuconf_parser_t *p, const char *str, size_t n) {
+	char *buf = _scratch_reserve(p, n + 1);
+	memcpy(buf, str, n);
+	buf[n] = '\000';
+	return buf;
+}
 
-	if (!*ptr || *ptr == '>') {
-		*buf = ptr;
-		return NULL;
-	}
-	while (*ptr && *ptr != '>' && !_is_whitespace(*ptr)) ptr++;
-	value = cfustring_dup_c_str_n(value, ptr - value);
-	*buf = ptr;
+/* Allocators for everything that ends up in the tree */
+static char *
+_dup_str_n(cfuconf_parser_t *p, const char *str, size_t n) {
+	if (n == 0) return NULL;
+	if (p->arena) return cfuarena_strndup(p->arena, str, n);
+	return cfustring_dup_c_str_n(str, n);
+}
 
-	return value;
+static cfulist_t *
+_new_list(cfuconf_parser_t *p) {
+	if (p->arena) return cfulist_new_in_arena(p->arena);
+	return cfulist_new();
+}
+
+static cfuhash_table_t *
+_new_hash(cfuconf_parser_t *p) {
+	if (p->arena) return cfuhash_new_in_arena(p->arena, CFUHASH_IGNORE_CASE);
+	return cfuhash_new_with_flags(CFUHASH_IGNORE_CASE);
 }
 
 static char *
-_dup_c_str_n_drop_escape(const char *str, size_t n, char escape) {
+_dup_c_str_n_drop_escape(cfuconf_parser_t *p, const char *str, size_t n, char escape) {
 	size_t len = n;
 	char *ns = NULL;
 	char *ptr = NULL;
@@ -350,7 +418,9 @@ _dup_c_str_n_drop_escape(const char *str, size_t n, char escape) {
 	if (n == 0) return NULL;
 
 	ptr = (char *)str; /* ? */
-	ns_ptr = ns = calloc(len + 1, 1);
+	if (p->arena) ns = cfuarena_calloc(p->arena, len + 1, 1);
+	else ns = calloc(len + 1, 1);
+	ns_ptr = ns;
 
 	last_char = *ptr;
 	for (ptr = (char *)str; ptr < end; ptr++) {
@@ -375,60 +445,50 @@ _dup_c_str_n_drop_escape(const char *str, size_t n, char escape) {
 }
 
 static char *
-_get_quoted_value(char **buf, char quote) {
-	char *ptr = NULL;
-	char *value = NULL;
+_get_quoted_value(cfuconf_parser_t *p, const char **buf, const char *end, char quote) {
+	const char *ptr = *buf;
+	const char *value = *buf;
 	char last_char = '\000';
-	int done = 0;
 	int found_escape = 0;
 
-	if (!buf) return NULL;
-	if (!*buf) return NULL;
-	ptr = value = *buf;
-	last_char = *ptr;
-	while (!done) {
-		while (*ptr && *ptr != quote) {
+	for (;;) {
+		while (ptr < end && *ptr != quote) {
 			if (*ptr == '\\') found_escape = 1;
 			last_char = *ptr;
 			ptr++;
 		}
-		if (last_char != '\\' || !*ptr) done = 1;
-		else {
-			if (last_char == '\\') {
-				ptr++;
-				found_escape = 1;
-			}
-		}
+		if (ptr == end) return NULL;
+		if (last_char != '\\') break;
+
+		/* escaped quote */
+		last_char = *ptr;
+		ptr++;
 	}
-	if (!*ptr) return NULL;
 	*buf = ptr;
 
 	if (found_escape) {
-		value = _dup_c_str_n_drop_escape(value, ptr - value, '\\');
-	} else {
-		value = cfustring_dup_c_str_n(value, ptr - value);
+		return _dup_c_str_n_drop_escape(p, value, ptr - value, '\\');
 	}
-	return value;
+	return _dup_str_n(p, value, ptr - value);
 }
 
 static char *
-_get_next_value(char **buf) {
-	char *ptr = *buf;
-	char *value = *buf;
-	value = _eat_whitespace(*buf);
-	ptr = value;
+_get_next_value(cfuconf_parser_t *p, const char **buf, const char *end) {
+	const char *ptr = _eat_whitespace(*buf, end);
+	char *value = NULL;
 
-	if (!*ptr || *ptr == '>') {
+	if (ptr == end || *ptr == '>') {
 		*buf = ptr;
 		return NULL;
 	}
 	if (*ptr == '"' || *ptr == '\'') {
 		char quote = *ptr;
 		ptr++;
-		value = _get_quoted_value(&ptr, quote);
+		value = _get_quoted_value(p, &ptr, end, quote);
 	} else {
-		while (*ptr && *ptr != '>' && !_is_whitespace(*ptr)) ptr++;
-		value = cfustring_dup_c_str_n(value, ptr - value);
+		const char *value_end = _token_end(ptr, end);
+		value = _dup_str_n(p, ptr, value_end - ptr);
+		ptr = value_end;
 	}
 
 	*buf = ptr;
@@ -436,227 +496,2718 @@ _get_next_value(char **buf) {
 	return value;
 }
 
-#if 0
-static char *
-_get_long_value(char **buf) {
-	char *ptr = *buf;
-	char *value = *buf;
-	size_t len = strlen(*buf);
+static int
+_parse_error(cfuconf_parser_t *p, const char *expected) {
+	if (!p->error) return -1;
 
-	value = _eat_whitespace(*buf);
-	ptr = *buf + len;
-	while (ptr > value && _is_whitespace(*ptr)) {
-		ptr--;
+	if (expected) {
+		*p->error = cfustring_sprintf_c_str("Error: syntax error at line %u: "
+			"unmatched container should be %s\n", (unsigned)p->cur_line, expected);
+	} else {
+		*p->error = cfustring_sprintf_c_str("cfuconf: syntax error at line %u\n",
+			(unsigned)p->cur_line);
 	}
 
-	if (ptr == value) return NULL;
+	return -1;
+}
 
-	value = cfustring_dup_c_str_n(value, ptr - value - 1);
-	*buf = ptr;
+static int
+_callback_error(cfuconf_parser_t *p) {
+	if (!p->error) return -1;
 
-	return value;
+	*p->error = cfustring_sprintf_c_str("cfuconf: stopped by callback at line %u\n",
+		(unsigned)p->cur_line);
+
+	return -1;
 }
-#endif
 
-/* FIXME: implement these */
-/* get directives */
-/* get_containers */
-/* get_containers_of_type */
-/* xpath type access */
+static int
+_open_container(cfuconf_parser_t *p, const char *ptr, const char *end) {
+	const char *name = _eat_whitespace(ptr, end);
+	const char *name_end = _token_end(name, end);
+	const char *value = _eat_whitespace(name_end, end);
+	const char *value_end = _token_end(value, end);
+	size_t name_len = name_end - name;
+	size_t value_len = value_end - value;
+	char *name_key = NULL;
+	char *value_key = NULL;
+	cfuhash_table_t *this_hash = NULL;
+	cfuconf_t *new_conf = NULL;
+
+	if (name_len == 0) return _parse_error(p, NULL);
+
+	/* both lookup keys live in the scratch buffer */
+	name_key = _scratch_reserve(p, name_len + value_len + 2);
+	memcpy(name_key, name, name_len);
+	name_key[name_len] = '\000';
+	if (value_len) {
+		value_key = name_key + name_len + 1;
+		memcpy(value_key, value, value_len);
+		value_key[value_len] = '\000';
+	}
 
-static cfuconf_t *
-_cfuconf_parse_list(cfulist_t *lines, char **error) {
-	char *line = NULL;
-	char *ptr = NULL;
-	cfulist_t *stack = cfulist_new();
-	size_t cur_line = 0;
-	cfuconf_t *conf = cfuconf_new();
-	cfuconf_t *cur_conf = NULL;
+	if (!p->conf) {
+		if (p->open_fn && p->open_fn(name_key, value_key, p->arg)) return _callback_error(p);
+		cfulist_push(p->stack, (void *)new_stack_entry(NULL,
+			cfustring_dup_c_str_n(name, name_len), cfustring_dup_c_str_n(value, value_len)));
+		return 0;
+	}
+
+	if ( !(this_hash = cfuhash_get(p->cur_conf->containers, name_key)) ) {
+		this_hash = _new_hash(p);
+		cfuhash_put(p->cur_conf->containers, name_key, (void *)this_hash);
+	}
 
-	cur_conf = conf;
+	if ( !(new_conf = cfuhash_get(this_hash, value_key)) ) {
+		new_conf = cfuconf_new(p->arena);
+		new_conf->container_type = _dup_str_n(p, name, name_len);
+		new_conf->container_name = _dup_str_n(p, value, value_len);
+		cfuhash_put(this_hash, value_key, (void *)new_conf);
+	}
+
+	cfulist_push(p->stack, (void *)p->cur_conf);
+	p->cur_conf = new_conf;
+
+	return 0;
+}
 
-	while ( (line = (char *)cfulist_shift(lines)) ) {
-		cur_line++;
-		ptr = _eat_whitespace(line);
-		if (!*ptr || *ptr == '#')  {
-			/* blank line or comment */
-			free(line);
-			continue;
+static int
+_close_container(cfuconf_parser_t *p, const char *ptr, const char *end) {
+	const char *name = _eat_whitespace(ptr, end);
+	const char *name_end = _token_end(name, end);
+	cfuconf_stack_entry_t *entry = NULL;
+	int rv = 0;
+
+	if (!p->conf) {
+		if (name_end == name || !(entry = cfulist_pop(p->stack))) return _parse_error(p, NULL);
+		if (strcasecmp(_scratch_copy(p, name, name_end - name), entry->container_type)) {
+			/* put it back so that the error can name it */
+			cfulist_push(p->stack, (void *)entry);
+			return _parse_error(p, entry->container_type);
 		}
+		if (p->close_fn && p->close_fn(entry->container_type, entry->container_name, p->arg)) {
+			rv = _callback_error(p);
+		}
+		_free_stack_entry(entry);
+		return rv;
+	}
 
-		if (*ptr == '<') { /* opening or closing container tag */
-			ptr++;
-			if (*ptr == '/') {
-				/* closing tag */
-				char *name = NULL;
-
-				ptr++;
-				name = _get_name(&ptr);
-				if (!name) {
-					if (error) {
-						*error = cfustring_sprintf_c_str("cfuconf: syntax error at line %u\n",
-							cur_line);
-					}
-					free(line);
-					free(name);
-					return NULL;
-				}
+	if (name_end == name || p->cur_conf == p->conf) return _parse_error(p, NULL);
 
-				if (strcasecmp(name, cur_conf->container_type)) {
-					if (error) {
-						*error = cfustring_sprintf_c_str("Error: syntax error at line %u: "
-							"unmatched container should be %s\n", cur_line,
-							cur_conf->container_type);
-					}
-					/* FIXME: clean up memory here */
-					free(line);
-					free(name);
-					return NULL;
-				}
+	if (strcasecmp(_scratch_copy(p, name, name_end - name), p->cur_conf->container_type)) {
+		return _parse_error(p, p->cur_conf->container_type);
+	}
 
-				free(name); name = NULL;
+	p->cur_conf = cfulist_pop(p->stack);
 
-				cur_conf = cfulist_pop(stack);
-				if (!cur_conf) {
-					free(line);
-					return NULL;
-				}
+	return 0;
+}
 
-				/* fprintf(stderr, "====> got closing tag '%s'\n", name); */
-			} else {
-				/* opening tag */
-				char *name = NULL;
-				char *value = NULL;
-				cfuhash_table_t *this_hash = NULL;
-				cfuconf_t *new_conf = NULL;
-				name = _get_name(&ptr);
-				if (!name) {
-					if (error) {
-						*error = cfustring_sprintf_c_str("cfuconf: syntax error at line %u\n",
-							cur_line);
-					}
-					free(line);
-
-					/* FIXME: clean up memory here */
-					return NULL;
-				}
+/* Collects the values following name_end and hands them to the
+   directive callback.  The values are only valid during the call.
+*/
+static int
+_report_directive(cfuconf_parser_t *p, const char *name, const char *ptr, const char *end) {
+	char *value = NULL;
+	size_t num_values = 0;
+	size_t i = 0;
+	int rv = 0;
 
-				ptr = _eat_whitespace(ptr);
-				value = _get_value(&ptr);
+	while ( (value = _get_next_value(p, &ptr, end)) ) {
+		if (num_values == p->values_size) {
+			p->values_size = p->values_size ? p->values_size * 2 : 8;
+			p->values = realloc(p->values, p->values_size * sizeof(char *));
+		}
+		p->values[num_values++] = value;
+		if (ptr < end) ptr++;
+	}
 
-				assert(cur_conf);
+	if (p->directive_fn && p->directive_fn(name, num_values, p->values, p->arg)) {
+		rv = _callback_error(p);
+	}
 
-				if ( !(this_hash = cfuhash_get(cur_conf->containers, name)) ) {
-					this_hash = cfuhash_new_with_flags(CFUHASH_IGNORE_CASE);
-					cfuhash_put(cur_conf->containers, name, (void *)this_hash);
-				}
+	for (i = 0; i < num_values; i++) free(p->values[i]);
 
-				if ( !(new_conf = cfuhash_get(this_hash, value)) ) {
-					new_conf = cfuconf_new();
-					new_conf->container_type = name;
-					new_conf->container_name = value;
-					cfuhash_put(this_hash, value, (void *)new_conf);
-				} else {
-					free(name); name = NULL;
-					free(value); value = NULL;
-				}
+	return rv;
+}
 
-				cfulist_push(stack, (void *)cur_conf);
-				cur_conf = new_conf;
+static int
+_add_directive(cfuconf_parser_t *p, const char *ptr, const char *end) {
+	const char *name_end = _token_end(ptr, end);
+	char *name = NULL;
+	char *value = NULL;
+	cfulist_t *list = NULL;
+	cfulist_t *val_list = NULL;
 
-				/*
-				fprintf(stderr, "====> got opening tag '%s' with param '%s'\n", name, value);
-				*/
-			}
-		} else {
-			char *name = NULL;
-			char *value = NULL;
-			cfulist_t *list = NULL;
-			cfulist_t *val_list = NULL;
+	if (name_end == ptr) return _parse_error(p, NULL);
 
-			name = _get_name(&ptr);
-			ptr = _eat_whitespace(ptr);
+	name = _scratch_copy(p, ptr, name_end - ptr);
+	if (!p->conf) return _report_directive(p, name, name_end, end);
 
-			if ( !(list = cfuhash_get(cur_conf->directives, name)) ) {
-				list = cfulist_new();
-				cfuhash_put(cur_conf->directives, name, (void *)list);
-			}
-			free(name); name = NULL;
+	if ( !(list = cfuhash_get(p->cur_conf->directives, name)) ) {
+		list = _new_list(p);
+		cfuhash_put(p->cur_conf->directives, name, (void *)list);
+	}
 
-			val_list = cfulist_new();
-			cfulist_enqueue(list, (void *)val_list);
+	val_list = _new_list(p);
+	cfulist_enqueue(list, (void *)val_list);
 
-			/* fprintf(stderr, "====> got '%s' =>", name); */
-			while ( (value = _get_next_value(&ptr) ) ) {
-				/* fprintf(stderr, " '%s'", value); */
-				cfulist_enqueue(val_list, (void *)value);
-				if (*ptr) {
-					ptr++;
-					ptr = _eat_whitespace(ptr);
-				}
-			}
-			/* fprintf(stderr, "\n"); */
-		}
+	ptr = name_end;
+	while ( (value = _get_next_value(p, &ptr, end)) ) {
+		cfulist_enqueue(val_list, (void *)value);
+		if (ptr < end) ptr++;
+	}
+
+	return 0;
+}
 
-		free(line);
+/* Parses the line [ptr, end), which does not include the newline */
+static int
+_parse_line(cfuconf_parser_t *p, const char *ptr, const char *end) {
+	p->cur_line++;
+
+	ptr = _eat_whitespace(ptr, end);
+	if (ptr == end || *ptr == '#') {
+		/* blank line or comment */
+		return 0;
 	}
 
-	cfulist_destroy(stack);
-	return conf;
+	if (*ptr == '<') { /* opening or closing container tag */
+		ptr++;
+		if (ptr < end && *ptr == '/') return _close_container(p, ptr + 1, end);
+		return _open_container(p, ptr, end);
+	}
+
+	return _add_directive(p, ptr, end);
 }
 
-int
-cfuconf_parse_file(char *file_path, cfuconf_t **ret_conf, char **error) {
-	FILE *fp = NULL;
-	cfulist_t *lines = NULL;
-	cfuconf_t *conf = NULL;
+static cfuconf_parser_t *
+_parser_new(void) {
+	cfuconf_parser_t *p = calloc(1, sizeof(cfuconf_parser_t));
+	p->stack = cfulist_new();
+	return p;
+}
 
-	if (! (fp = fopen(file_path, "r")) ) {
-		*ret_conf = NULL;
-		if (error) {
-			*error = cfustring_sprintf_c_str("Couldn't open file");
+cfuconf_parser_t *
+cfuconf_parser_new(unsigned int flags) {
+	cfuconf_parser_t *p = _parser_new();
+
+	if (flags & CFUCONF_ARENA) p->arena = cfuarena_new(0);
+	p->conf = p->cur_conf = cfuconf_new(p->arena);
+	p->conf->arena = p->arena;
+
+	return p;
+}
+
+cfuconf_parser_t *
+cfuconf_parser_new_with_callbacks(cfuconf_open_fn_t open_fn, cfuconf_close_fn_t close_fn,
+	cfuconf_directive_fn_t directive_fn, void *arg) {
+	cfuconf_parser_t *p = _parser_new();
+
+	p->open_fn = open_fn;
+	p->close_fn = close_fn;
+	p->directive_fn = directive_fn;
+	p->arg = arg;
+
+	return p;
+}
+
+static void
+_partial_append(cfuconf_parser_t *p, const char *buf, size_t len) {
+	if (p->partial_len + len > p->partial_size) {
+		size_t new_size = p->partial_size ? p->partial_size : 256;
+		while (new_size < p->partial_len + len) new_size *= 2;
+		p->partial = realloc(p->partial, new_size);
+		p->partial_size = new_size;
+	}
+
+	memcpy(p->partial + p->partial_len, buf, len);
+	p->partial_len += len;
+}
+
+int
+cfuconf_parser_feed(cfuconf_parser_t *p, const char *buf, size_t len, char **error) {
+	const char *end = buf + len;
+	const char *line_end = NULL;
+	int rv = 0;
+
+	if (p->done) return -1;
+	p->error = error;
+
+	/* finish the line left over from the previous buffer first */
+	if (p->partial_len && len) {
+		if ( !(line_end = memchr(buf, '\n', len)) ) {
+			_partial_append(p, buf, len);
+			return 0;
 		}
-		return -1;
+		_partial_append(p, buf, line_end - buf);
+		rv = _parse_line(p, p->partial, p->partial + p->partial_len);
+		p->partial_len = 0;
+		buf = line_end + 1;
 	}
 
-	lines = _slurp_file_from_fp(fp);
-	fclose(fp); fp = NULL;
-	if (!lines) return -1;
+	while (buf < end && rv == 0) {
+		if ( !(line_end = memchr(buf, '\n', end - buf)) ) {
+			_partial_append(p, buf, end - buf);
+			break;
+		}
+		rv = _parse_line(p, buf, line_end);
+		buf = line_end + 1;
+	}
 
-	conf = _cfuconf_parse_list(lines, error);
-	cfulist_destroy(lines);
-	*ret_conf = conf;
-	if (conf) return 0;
-	return -1;
+	if (rv < 0) p->done = 1;
+	return rv;
 }
 
 int
-cfuconf_parse_buffer(char *buffer, cfuconf_t **ret_conf, char **error) {
-	cfulist_t *lines = cfulist_new();
-	char **strings = NULL;
-	size_t num_strings = 0;
+cfuconf_parser_finish(cfuconf_parser_t *p, cfuconf_t **conf, char **error) {
+	int rv = 0;
+
+	if (conf) *conf = NULL;
+	if (p->done) return -1;
+	p->error = error;
+	p->done = 1;
+
+	/* the last line need not end with a newline */
+	if (p->partial_len) {
+		rv = _parse_line(p, p->partial, p->partial + p->partial_len);
+		p->partial_len = 0;
+		if (rv < 0) return rv;
+	}
+
+	if (conf) {
+		*conf = p->conf;
+		p->conf = NULL;
+	}
+
+	return 0;
+}
+
+void
+cfuconf_parser_destroy(cfuconf_parser_t *p) {
+	/* only a callback parser has no current container */
+	if (p->cur_conf) {
+		if (p->conf) cfuconf_destroy(p->conf);
+		cfulist_destroy(p->stack);
+	} else {
+		cfulist_destroy_with_free_fn(p->stack, _free_stack_entry);
+	}
+
+	free(p->scratch);
+	free(p->partial);
+	free(p->values);
+	free(p);
+}
+
+#ifdef HAVE_PTHREAD_H
+static cfuconf_t *_cfuconf_parse_parallel(const char *buf, size_t len, unsigned int flags,
+	char **error);
+#endif
+
+static cfuconf_t *
+_cfuconf_parse_buf(const char *buf, size_t len, unsigned int flags, char **error) {
+	cfuconf_parser_t *p = NULL;
 	cfuconf_t *conf = NULL;
-	size_t i = 0;
 
-	if (!buffer) return -1;
+#ifdef HAVE_PTHREAD_H
+	if (flags & CFUCONF_PARALLEL) {
+		return _cfuconf_parse_parallel(buf, len, flags & ~CFUCONF_PARALLEL, error);
+	}
+#endif
+
+	p = cfuconf_parser_new(flags);
+	if (cfuconf_parser_feed(p, buf, len, error) == 0) cfuconf_parser_finish(p, &conf, error);
+	cfuconf_parser_destroy(p);
+
+	return conf;
+}
+
+#ifdef CFUCONF_USE_MMAP
+/* Maps a regular file read-only.  Returns zero on success, less than
+   zero if the file should be read instead.
+*/
+static int
+_map_file(int fd, char **buf, size_t *len) {
+	struct stat st;
+	void *addr = NULL;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) return -1;
+
+	addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) return -1;
+
+#ifdef MADV_SEQUENTIAL
+	madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+
+	*buf = (char *)addr;
+	*len = (size_t)st.st_size;
+
+	return 0;
+}
+#endif
+
+/* Merging of trees parsed separately.  Everything in the source tree
+   is moved into the destination, after what is already there, and the
+   emptied containers of the source are freed.
+*/
+typedef struct cfuconf_merge {
+	void *dst;
+	int in_arena;
+} cfuconf_merge_t;
+
+static void _merge_conf(cfuconf_t *dst, cfuconf_t *src, int in_arena);
 
-	strings = cfustring_c_str_split(buffer, &num_strings, 0, "\r\n", "\n", NULL);
-	if (!strings) return -1;
+static int
+_merge_directive_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	cfuconf_t *dst = (cfuconf_t *)arg;
+	cfulist_t *list = (cfulist_t *)data;
+	cfulist_t *dst_list = NULL;
+	void *val_list = NULL;
+
+	data_size = data_size;
 
-	for (i = 0; i < num_strings; i++) {
-		cfulist_push_string(lines, strings[i]);
+	if (!cfuhash_get_data(dst->directives, key, key_size, (void **)&dst_list, NULL)) {
+		cfuhash_put_data(dst->directives, key, key_size, (void *)list, 0, NULL);
+		return 0;
 	}
 
-	conf = _cfuconf_parse_list(lines, error);
-	cfulist_destroy(lines);
-	*ret_conf = conf;
+	while ( (val_list = cfulist_dequeue(list)) ) cfulist_enqueue(dst_list, val_list);
+	cfulist_destroy(list);
 
-	free(strings);
+	return 0;
+}
 
-	if (conf) return 0;
-	return -1;
+static int
+_merge_container_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	cfuconf_merge_t *m = (cfuconf_merge_t *)arg;
+	cfuconf_t *dst = NULL;
+
+	data_size = data_size;
+
+	if (!cfuhash_get_data((cfuhash_table_t *)m->dst, key, key_size, (void **)&dst, NULL)) {
+		cfuhash_put_data((cfuhash_table_t *)m->dst, key, key_size, data, 0, NULL);
+		return 0;
+	}
+
+	/* the same container was opened in both trees */
+	_merge_conf(dst, (cfuconf_t *)data, m->in_arena);
+
+	return 0;
+}
+
+static int
+_merge_container_type_fn(void *key, size_t key_size, void *data, size_t data_size,
+	void *arg) {
+	cfuconf_merge_t *m = (cfuconf_merge_t *)arg;
+	cfuconf_merge_t sub;
+
+	data_size = data_size;
+
+	sub.in_arena = m->in_arena;
+	if (!cfuhash_get_data(((cfuconf_t *)m->dst)->containers, key, key_size, &sub.dst,
+			NULL)) {
+		cfuhash_put_data(((cfuconf_t *)m->dst)->containers, key, key_size, data, 0, NULL);
+		return 0;
+	}
+
+	cfuhash_foreach((cfuhash_table_t *)data, _merge_container_fn, &sub);
+	cfuhash_destroy((cfuhash_table_t *)data);
+
+	return 0;
+}
+
+static void
+_merge_conf(cfuconf_t *dst, cfuconf_t *src, int in_arena) {
+	cfuconf_merge_t m;
+
+	m.dst = dst;
+	m.in_arena = in_arena;
+	cfuhash_foreach(src->directives, _merge_directive_fn, dst);
+	cfuhash_foreach(src->containers, _merge_container_type_fn, &m);
+
+	/* src is now empty; an arena tree is released with its arena */
+	cfuhash_destroy(src->directives);
+	cfuhash_destroy(src->containers);
+	if (in_arena) return;
+
+	free(src->container_type);
+	free(src->container_name);
+	free(src);
 }
 
+#ifdef HAVE_PTHREAD_H
+
+/* Never split the input into pieces smaller than this */
+#define CFUCONF_MIN_PIECE_SIZE (1024 * 1024)
+#define CFUCONF_MAX_PIECES 32
+
+typedef struct cfuconf_piece {
+	const char *start;
+	const char *end;
+	size_t first_line;
+	unsigned int flags;
+	cfuconf_t *conf;
+	char *error;
+	pthread_t thread;
+} cfuconf_piece_t;
+
+/* Splits [buf, buf + len) into at most max_pieces pieces of roughly
+   equal size, cutting only between top-level containers.  Only tags
+   are looked at, with the same rules as _parse_line(), so this is much
+   cheaper than parsing.  Returns the number of pieces.
+*/
+static size_t
+_split_top_level(const char *buf, size_t len, size_t max_pieces, cfuconf_piece_t *pieces) {
+	const char *ptr = buf;
+	const char *end = buf + len;
+	const char *line_end = NULL;
+	const char *tag = NULL;
+	size_t piece_size = len / max_pieces;
+	size_t num_pieces = 1;
+	size_t line = 0;
+	long depth = 0;
+
+	pieces[0].start = buf;
+	pieces[0].first_line = 0;
+
+	while (ptr < end && num_pieces < max_pieces) {
+		if (depth == 0 && (size_t)(ptr - buf) >= piece_size * num_pieces) {
+			pieces[num_pieces - 1].end = ptr;
+			pieces[num_pieces].start = ptr;
+			pieces[num_pieces].first_line = line;
+			num_pieces++;
+		}
+
+		if ( !(line_end = memchr(ptr, '\n', end - ptr)) ) line_end = end;
+		tag = _eat_whitespace(ptr, line_end);
+		if (tag < line_end && *tag == '<') {
+			if (tag + 1 < line_end && tag[1] == '/') depth--;
+			else depth++;
+		}
+
+		line++;
+		ptr = line_end + 1;
+	}
+	pieces[num_pieces - 1].end = end;
+
+	return num_pieces;
+}
+
+static void *
+_parse_piece(void *arg) {
+	cfuconf_piece_t *piece = (cfuconf_piece_t *)arg;
+	cfuconf_parser_t *p = cfuconf_parser_new(piece->flags);
+
+	/* so that errors report lines in the whole input */
+	p->cur_line = piece->first_line;
+
+	if (cfuconf_parser_feed(p, piece->start, piece->end - piece->start, &piece->error) == 0) {
+		cfuconf_parser_finish(p, &piece->conf, &piece->error);
+	}
+	cfuconf_parser_destroy(p);
+
+	return NULL;
+}
+
+static size_t
+_num_cpus(void) {
+#if defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0) return (size_t)n;
+#endif
+	return 1;
+}
+
+/* Parses the pieces on separate threads, then merges the trees in
+   order, so the result is the same as parsing the buffer in one go.
+*/
+static cfuconf_t *
+_cfuconf_parse_parallel(const char *buf, size_t len, unsigned int flags, char **error) {
+	cfuconf_piece_t pieces[CFUCONF_MAX_PIECES];
+	size_t max_pieces = _num_cpus();
+	size_t num_pieces = 0;
+	size_t started = 1;
+	size_t i = 0;
+	cfuconf_t *conf = NULL;
+	int failed = 0;
+
+	if (max_pieces > len / CFUCONF_MIN_PIECE_SIZE) max_pieces = len / CFUCONF_MIN_PIECE_SIZE;
+	if (max_pieces > CFUCONF_MAX_PIECES) max_pieces = CFUCONF_MAX_PIECES;
+	if (max_pieces < 2 ||
+		(num_pieces = _split_top_level(buf, len, max_pieces, pieces)) < 2) {
+		return _cfuconf_parse_buf(buf, len, flags, error);
+	}
+
+	for (i = 0; i < num_pieces; i++) {
+		pieces[i].flags = flags;
+		pieces[i].conf = NULL;
+		pieces[i].error = NULL;
+	}
+
+	/* the first piece is parsed on this thread */
+	for (i = 1; i < num_pieces; i++) {
+		if (pthread_create(&pieces[i].thread, NULL, _parse_piece, &pieces[i])) break;
+		started++;
+	}
+	_parse_piece(&pieces[0]);
+	for (i = started; i < num_pieces; i++) _parse_piece(&pieces[i]);
+	for (i = 1; i < started; i++) pthread_join(pieces[i].thread, NULL);
+
+	/* report the first error in the input */
+	for (i = 0; i < num_pieces; i++) {
+		if (!pieces[i].conf && !failed) {
+			failed = 1;
+			if (error) *error = pieces[i].error;
+			else free(pieces[i].error);
+		} else {
+			free(pieces[i].error);
+		}
+	}
+
+	if (failed) {
+		for (i = 0; i < num_pieces; i++) {
+			if (pieces[i].conf) cfuconf_destroy(pieces[i].conf);
+		}
+		return NULL;
+	}
+
+	conf = pieces[0].conf;
+	for (i = 1; i < num_pieces; i++) {
+		cfuarena_t *arena = pieces[i].conf->arena;
+		_merge_conf(conf, pieces[i].conf, arena != NULL);
+		if (arena) cfuarena_merge(conf->arena, arena);
+	}
+
+	return conf;
+}
+#endif
+
+#define CFUCONF_READ_SIZE 65536
+
+/* Feeds the rest of fp to a new parser in fixed size pieces */
+static cfuconf_t *
+_cfuconf_parse_stream(FILE *fp, unsigned int flags, char **error) {
+	cfuconf_parser_t *p = cfuconf_parser_new(flags);
+	cfuconf_t *conf = NULL;
+	char *buf = malloc(CFUCONF_READ_SIZE);
+	size_t n = 0;
+	int rv = 0;
+
+	while (rv == 0 && (n = fread(buf, 1, CFUCONF_READ_SIZE, fp)) > 0) {
+		rv = cfuconf_parser_feed(p, buf, n, error);
+	}
+	free(buf);
+
+	if (rv == 0) cfuconf_parser_finish(p, &conf, error);
+	cfuconf_parser_destroy(p);
+
+	return conf;
+}
+
+/* Reads the rest of fp into a single malloc()'d buffer */
+static char *
+_read_file(FILE *fp, size_t *len) {
+	size_t size = 8192;
+	size_t used = 0;
+	size_t n = 0;
+	char *buf = malloc(size);
+
+	while ( (n = fread(buf + used, 1, size - used, fp)) > 0 ) {
+		used += n;
+		if (used == size) {
+			size *= 2;
+			buf = realloc(buf, size);
+		}
+	}
+
+	*len = used;
+	return buf;
+}
+
+int
+cfuconf_parse_file(char *file_path, cfuconf_t **ret_conf, char **error) {
+	return cfuconf_parse_file_with_flags(file_path, 0, ret_conf, error);
+}
+
+int
+cfuconf_parse_file_with_flags(char *file_path, unsigned int flags, cfuconf_t **ret_conf,
+	char **error) {
+	FILE *fp = NULL;
+#ifdef CFUCONF_USE_MMAP
+	char *buf = NULL;
+	size_t len = 0;
+#endif
+
+	if (! (fp = fopen(file_path, "r")) ) {
+		*ret_conf = NULL;
+		if (error) {
+			*error = cfustring_sprintf_c_str("Couldn't open file");
+		}
+		return -1;
+	}
+
+#ifdef CFUCONF_USE_MMAP
+	if (_map_file(fileno(fp), &buf, &len) == 0) {
+		fclose(fp); fp = NULL;
+		*ret_conf = _cfuconf_parse_buf(buf, len, flags, error);
+		munmap(buf, len);
+		if (*ret_conf) return 0;
+		return -1;
+	}
+#endif
+
+	*ret_conf = _cfuconf_parse_stream(fp, flags, error);
+	fclose(fp); fp = NULL;
+
+	if (*ret_conf) return 0;
+	return -1;
+}
+
+#ifdef HAVE_UNISTD_H
+int
+cfuconf_parse_fd(int fd, unsigned int flags, cfuconf_t **ret_conf, char **error) {
+	cfuconf_parser_t *p = NULL;
+	char *buf = NULL;
+	size_t len = 0;
+	ssize_t n = 0;
+	int rv = 0;
+
+#ifdef CFUCONF_USE_MMAP
+	if (_map_file(fd, &buf, &len) == 0) {
+		*ret_conf = _cfuconf_parse_buf(buf, len, flags, error);
+		munmap(buf, len);
+		if (*ret_conf) return 0;
+		return -1;
+	}
+#endif
+
+	p = cfuconf_parser_new(flags);
+	buf = malloc(CFUCONF_READ_SIZE);
+
+	for (;;) {
+		n = read(fd, buf, CFUCONF_READ_SIZE);
+		if (n == 0) break;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (error) *error = cfustring_sprintf_c_str("cfuconf: read error: %s\n",
+				strerror(errno));
+			rv = -1;
+			break;
+		}
+		if ( (rv = cfuconf_parser_feed(p, buf, (size_t)n, error)) < 0 ) break;
+	}
+	free(buf);
+
+	if (rv == 0) rv = cfuconf_parser_finish(p, ret_conf, error);
+	else *ret_conf = NULL;
+	cfuconf_parser_destroy(p);
+
+	return rv;
+}
+#else
+/* Without read() there is no portable way to read a descriptor, but
+   the function is still defined so that programs link everywhere.
+*/
+int
+cfuconf_parse_fd(int fd, unsigned int flags, cfuconf_t **ret_conf, char **error) {
+	fd = fd;
+	flags = flags;
+	*ret_conf = NULL;
+	if (error) {
+		*error = cfustring_sprintf_c_str("cfuconf: reading from a file descriptor is not "
+			"supported on this platform\n");
+	}
+	return -1;
+}
+#endif
+
+int
+cfuconf_parse_buffer(char *buffer, cfuconf_t **ret_conf, char **error) {
+	if (!buffer) return -1;
+	return cfuconf_parse_buffer_n(buffer, strlen(buffer), ret_conf, error);
+}
+
+int
+cfuconf_parse_buffer_n(const char *buffer, size_t len, cfuconf_t **ret_conf, char **error) {
+	return cfuconf_parse_buffer_n_with_flags(buffer, len, 0, ret_conf, error);
+}
+
+int
+cfuconf_parse_buffer_n_with_flags(const char *buffer, size_t len, unsigned int flags,
+	cfuconf_t **ret_conf, char **error) {
+	if (!buffer) return -1;
+
+	*ret_conf = _cfuconf_parse_buf(buffer, len, flags, error);
+	if (*ret_conf) return 0;
+	return -1;
+}
+
+/* Binary caches.  A cache file holds a header, identifying the source
+   text by its size and checksum, followed by the tree in preorder.
+   Every string is stored with its length, so loading a tree is a
+   matter of copying strings into place, without any tokenizing.  The
+   format uses the byte order and sizes of the host, and is only
+   meant to be read back on the machine that wrote it.
+
+	node:      u32 num_directives, directive...,
+	           u32 num_types, (str type, u32 num_containers,
+	           (str name, node)...)...
+	directive: str name, u32 num_occurrences, (u32 num_values, str...)...
+	str:       u32 length, bytes; a length of zero is a NULL string
+*/
+
+#define CFUCONF_CACHE_MAGIC "CFUCONF\000"
+#define CFUCONF_CACHE_VERSION 1
+#define CFUCONF_CACHE_BYTE_ORDER 0x01020304
+
+typedef struct cfuconf_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t source_size;
+	uint64_t source_checksum;
+	uint64_t data_size;
+} cfuconf_cache_header;
+
+/* A checksum of the source, computed a word at a time.  len must be a
+   multiple of eight on all but the last call, so that the result does
+   not depend on how the source was split up.
+*/
+static uint64_t
+_checksum_update(uint64_t sum, const char *buf, size_t len) {
+	uint64_t word = 0;
+
+	for (; len >= 8; buf += 8, len -= 8) {
+		memcpy(&word, buf, 8);
+		sum = (sum ^ word) * 0x100000001b3ULL;
+		sum ^= sum >> 29;
+	}
+	if (len) {
+		word = 0;
+		memcpy(&word, buf, len);
+		sum = (sum ^ word) * 0x100000001b3ULL;
+		sum ^= sum >> 29;
+	}
+
+	return sum;
+}
+
+typedef struct cfuconf_cache_writer {
+	char *buf;
+	size_t len;
+	size_t size;
+} cfuconf_cache_writer;
+
+static void
+_cache_put(cfuconf_cache_writer *w, const void *data, size_t len) {
+	if (w->len + len > w->size) {
+		size_t new_size = w->size ? w->size : 65536;
+		while (new_size < w->len + len) new_size *= 2;
+		w->buf = realloc(w->buf, new_size);
+		w->size = new_size;
+	}
+
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+}
+
+static void
+_cache_put_u32(cfuconf_cache_writer *w, size_t n) {
+	uint32_t v = (uint32_t)n;
+	_cache_put(w, &v, sizeof(v));
+}
+
+static void
+_cache_put_str(cfuconf_cache_writer *w, const char *str) {
+	size_t len = str ? strlen(str) : 0;
+
+	_cache_put_u32(w, len);
+	if (len > 0) _cache_put(w, str, len);
+}
+
+static void _cache_put_node(cfuconf_cache_writer *w, cfuconf_t *conf);
+
+static int
+_cache_put_value_fn(void *data, size_t data_size, void *arg) {
+	data_size = data_size;
+	_cache_put_str((cfuconf_cache_writer *)arg, (char *)data);
+	return 0;
+}
+
+static int
+_cache_put_occurrence_fn(void *data, size_t data_size, void *arg) {
+	cfulist_t *val_list = (cfulist_t *)data;
+
+	data_size = data_size;
+
+	_cache_put_u32((cfuconf_cache_writer *)arg, cfulist_num_entries(val_list));
+	cfulist_foreach(val_list, _cache_put_value_fn, arg);
+
+	return 0;
+}
+
+static int
+_cache_put_directive_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	cfuconf_cache_writer *w = (cfuconf_cache_writer *)arg;
+	cfulist_t *list = (cfulist_t *)data;
+
+	key_size = key_size;
+	data_size = data_size;
+
+	_cache_put_str(w, (char *)key);
+	_cache_put_u32(w, cfulist_num_entries(list));
+	cfulist_foreach(list, _cache_put_occurrence_fn, w);
+
+	return 0;
+}
+
+static int
+_cache_put_container_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	cfuconf_cache_writer *w = (cfuconf_cache_writer *)arg;
+
+	key = key;
+	key_size = key_size;
+	data_size = data_size;
+
+	_cache_put_str(w, ((cfuconf_t *)data)->container_name);
+	_cache_put_node(w, (cfuconf_t *)data);
+
+	return 0;
+}
+
+static int
+_cache_put_type_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	cfuconf_cache_writer *w = (cfuconf_cache_writer *)arg;
+	cfuhash_table_t *containers = (cfuhash_table_t *)data;
+
+	key_size = key_size;
+	data_size = data_size;
+
+	_cache_put_str(w, (char *)key);
+	_cache_put_u32(w, cfuhash_num_entries(containers));
+	cfuhash_foreach(containers, _cache_put_container_fn, w);
+
+	return 0;
+}
+
+static void
+_cache_put_node(cfuconf_cache_writer *w, cfuconf_t *conf) {
+	_cache_put_u32(w, cfuhash_num_entries(conf->directives));
+	cfuhash_foreach(conf->directives, _cache_put_directive_fn, w);
+	_cache_put_u32(w, cfuhash_num_entries(conf->containers));
+	cfuhash_foreach(conf->containers, _cache_put_type_fn, w);
+}
+
+/* Writes the cache to a temporary file first and renames it into
+   place, so that readers never see a partial cache.
+*/
+static int
+_cache_write(cfuconf_t *conf, const char *cache_path, uint64_t source_size,
+	uint64_t source_checksum) {
+	cfuconf_cache_writer w;
+	cfuconf_cache_header header;
+	char *tmp_path = NULL;
+	size_t path_len = strlen(cache_path);
+	FILE *fp = NULL;
+	int rv = -1;
+#if defined(HAVE_MKSTEMP) && defined(HAVE_UNISTD_H)
+	int fd = -1;
+#endif
+
+	memset(&w, 0, sizeof(w));
+	_cache_put_node(&w, conf);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CFUCONF_CACHE_MAGIC, sizeof(header.magic));
+	header.version = CFUCONF_CACHE_VERSION;
+	header.byte_order = CFUCONF_CACHE_BYTE_ORDER;
+	header.source_size = source_size;
+	header.source_checksum = source_checksum;
+	header.data_size = w.len;
+
+	/* written next to the cache so that rename() stays on one file
+	   system, under a unique name so that processes starting at the
+	   same time do not write into each other's file
+	*/
+	tmp_path = malloc(path_len + sizeof(".XXXXXX"));
+	memcpy(tmp_path, cache_path, path_len);
+#if defined(HAVE_MKSTEMP) && defined(HAVE_UNISTD_H)
+	memcpy(tmp_path + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+	if ( (fd = mkstemp(tmp_path)) >= 0 && !(fp = fdopen(fd, "wb")) ) {
+		close(fd);
+		remove(tmp_path);
+	}
+#else
+	memcpy(tmp_path + path_len, ".tmp", sizeof(".tmp"));
+	fp = fopen(tmp_path, "wb");
+#endif
+	if (fp) {
+		if (fwrite(&header, sizeof(header), 1, fp) == 1
+			&& fwrite(w.buf, 1, w.len, fp) == w.len) {
+			rv = 0;
+		}
+		if (fclose(fp) != 0) rv = -1;
+		if (rv == 0) rv = rename(tmp_path, cache_path);
+		if (rv < 0) remove(tmp_path);
+	}
+
+	free(tmp_path);
+	free(w.buf);
+
+	return rv;
+}
+
+typedef struct cfuconf_cache_reader {
+	const char *ptr;
+	const char *end;
+	cfuconf_parser_t *p;
+} cfuconf_cache_reader;
+
+static int
+_cache_get_u32(cfuconf_cache_reader *r, size_t *n) {
+	uint32_t v = 0;
+
+	if ((size_t)(r->end - r->ptr) < sizeof(v)) return -1;
+	memcpy(&v, r->ptr, sizeof(v));
+	r->ptr += sizeof(v);
+	*n = v;
+
+	return 0;
+}
+
+static int
+_cache_get_str(cfuconf_cache_reader *r, char **str) {
+	size_t len = 0;
+
+	if (_cache_get_u32(r, &len) < 0 || (size_t)(r->end - r->ptr) < len) return -1;
+	*str = _dup_str_n(r->p, r->ptr, len);
+	r->ptr += len;
+
+	return 0;
+}
+
+/* Same as _cache_get_str(), but for a name that is only needed as a
+   hash key until the next call
+*/
+static int
+_cache_get_key(cfuconf_cache_reader *r, char **key) {
+	size_t len = 0;
+
+	if (_cache_get_u32(r, &len) < 0 || len == 0 || (size_t)(r->end - r->ptr) < len) {
+		return -1;
+	}
+	*key = _scratch_copy(r->p, r->ptr, len);
+	r->ptr += len;
+
+	return 0;
+}
+
+static int
+_cache_get_node(cfuconf_cache_reader *r, cfuconf_t *conf) {
+	size_t num_directives = 0;
+	size_t num_occurrences = 0;
+	size_t num_values = 0;
+	size_t num_types = 0;
+	size_t num_containers = 0;
+	size_t i, j, k;
+	char *name = NULL;
+	char *value = NULL;
+	cfulist_t *list = NULL;
+	cfulist_t *val_list = NULL;
+	cfuhash_table_t *containers = NULL;
+	cfuconf_t *child = NULL;
+	int rv = 0;
+
+	if (_cache_get_u32(r, &num_directives) < 0) return -1;
+	for (i = 0; i < num_directives; i++) {
+		if (_cache_get_key(r, &name) < 0) return -1;
+		list = _new_list(r->p);
+		cfuhash_put(conf->directives, name, (void *)list);
+
+		if (_cache_get_u32(r, &num_occurrences) < 0) return -1;
+		for (j = 0; j < num_occurrences; j++) {
+			val_list = _new_list(r->p);
+			cfulist_enqueue(list, (void *)val_list);
+			if (_cache_get_u32(r, &num_values) < 0) return -1;
+			for (k = 0; k < num_values; k++) {
+				if (_cache_get_str(r, &value) < 0 || !value) return -1;
+				cfulist_enqueue(val_list, (void *)value);
+			}
+		}
+	}
+
+	if (_cache_get_u32(r, &num_types) < 0) return -1;
+	for (i = 0; i < num_types; i++) {
+		if (_cache_get_str(r, &name) < 0 || !name) return -1;
+		containers = _new_hash(r->p);
+		cfuhash_put(conf->containers, name, (void *)containers);
+		if ( (rv = _cache_get_u32(r, &num_containers)) < 0 ) num_containers = 0;
+		for (j = 0; j < num_containers && rv == 0; j++) {
+			if ( (rv = _cache_get_str(r, &value)) < 0 ) break;
+			child = cfuconf_new(r->p->arena);
+			child->container_type = _dup_str_n(r->p, name, strlen(name));
+			child->container_name = value;
+			cfuhash_put(containers, value, (void *)child);
+			rv = _cache_get_node(r, child);
+		}
+		if (!r->p->arena) free(name);
+		if (rv < 0) return -1;
+	}
+
+	return 0;
+}
+
+/* Loads the tree from cache_path if it was written for the given
+   source, or returns NULL.
+*/
+static cfuconf_t *
+_cache_load(const char *cache_path, unsigned int flags, uint64_t source_size,
+	uint64_t source_checksum) {
+	FILE *fp = NULL;
+	char *buf = NULL;
+	size_t len = 0;
+	int mapped = 0;
+	cfuconf_cache_header header;
+	cfuconf_cache_reader r;
+	cfuconf_t *conf = NULL;
+
+	if ( !(fp = fopen(cache_path, "rb")) ) return NULL;
+
+#ifdef CFUCONF_USE_MMAP
+	if (_map_file(fileno(fp), &buf, &len) == 0) mapped = 1;
+#endif
+	if (!mapped) buf = _read_file(fp, &len);
+	fclose(fp);
+
+	if (len >= sizeof(header)) {
+		memcpy(&header, buf, sizeof(header));
+		if (!memcmp(header.magic, CFUCONF_CACHE_MAGIC, sizeof(header.magic))
+			&& header.version == CFUCONF_CACHE_VERSION
+			&& header.byte_order == CFUCONF_CACHE_BYTE_ORDER
+			&& header.source_size == source_size
+			&& header.source_checksum == source_checksum
+			&& header.data_size == len - sizeof(header)) {
+			r.ptr = buf + sizeof(header);
+			r.end = buf + len;
+			r.p = cfuconf_parser_new(flags);
+			if (_cache_get_node(&r, r.p->conf) == 0 && r.ptr == r.end) {
+				cfuconf_parser_finish(r.p, &conf, NULL);
+			}
+			cfuconf_parser_destroy(r.p);
+		}
+	}
+
+#ifdef CFUCONF_USE_MMAP
+	if (mapped) {
+		munmap(buf, len);
+		return conf;
+	}
+#endif
+	free(buf);
+
+	return conf;
+}
+
+int
+cfuconf_parse_file_cached(char *file_path, char *cache_path, unsigned int flags,
+	cfuconf_t **ret_conf, char **error) {
+	FILE *fp = NULL;
+	char *buf = NULL;
+	size_t len = 0;
+	uint64_t source_checksum = 0;
+	int read_error = 0;
+	int rv = 0;
+
+	if (! (fp = fopen(file_path, "r")) ) {
+		*ret_conf = NULL;
+		if (error) {
+			*error = cfustring_sprintf_c_str("Couldn't open file");
+		}
+		return -1;
+	}
+
+	/* The source is read once, and the same bytes are both checksummed
+	   and parsed, so the cache can never pair a checksum with a tree
+	   parsed from different contents.
+	*/
+	buf = _read_file(fp, &len);
+	read_error = ferror(fp);
+	fclose(fp); fp = NULL;
+
+	if (read_error) {
+		free(buf);
+		*ret_conf = NULL;
+		if (error) {
+			*error = cfustring_sprintf_c_str("Couldn't read file");
+		}
+		return -1;
+	}
+
+	source_checksum = _checksum_update(0xcbf29ce484222325ULL, buf, len);
+
+	if ( (*ret_conf = _cache_load(cache_path, flags, len, source_checksum)) ) {
+		free(buf);
+		return 0;
+	}
+
+	rv = cfuconf_parse_buffer_n_with_flags(buf, len, flags, ret_conf, error);
+	free(buf);
+	if (rv < 0) return -1;
+
+	/* failing to write the cache only costs the next start */
+	_cache_write(*ret_conf, cache_path, len, source_checksum);
+
+	return 0;
+}
+
+/* Compiled snapshots.  Containers are laid out breadth-first so that
+   the children of a node are contiguous, and both the children and
+   the directives of a node are sorted case-insensitively so that
+   they can be found with a binary search.  Strings are copied into
+   an arena owned by the snapshot.
+*/
+
+typedef struct cfuconf_snap_node {
+	char *type;
+	char *name;
+	size_t first_child;
+	size_t num_children;
+	size_t first_directive;
+	size_t num_directives;
+} cfuconf_snap_node;
+
+typedef struct cfuconf_snap_directive {
+	char *name;
+	size_t first_occurrence;
+	size_t num_occurrences;
+} cfuconf_snap_directive;
+
+typedef struct cfuconf_snap_args {
+	size_t first_arg;
+	size_t num_args;
+} cfuconf_snap_args;
+
+struct cfuconf_snapshot {
+	cfuarena_t *arena;
+	cfuconf_snap_node *nodes;
+	size_t num_nodes;
+	cfuconf_snap_directive *directives;
+	size_t num_directives;
+	cfuconf_snap_args *occurrences;
+	size_t num_occurrences;
+	char **args;
+	size_t num_args;
+};
+
+typedef struct cfuconf_snap_builder {
+	cfuconf_snapshot_t *snap;
+	cfuconf_t **src; /* parallel to snap->nodes */
+	size_t src_alloc;
+	size_t nodes_alloc;
+	size_t directives_alloc;
+	size_t occurrences_alloc;
+	size_t args_alloc;
+	cfuconf_t **children;
+	size_t num_children;
+	size_t children_alloc;
+} cfuconf_snap_builder;
+
+/* Makes room for one more element in a growable array */
+static void *
+_snap_grow(void *array, size_t *num_alloc, size_t num, size_t size) {
+	if (num < *num_alloc) return array;
+	*num_alloc = *num_alloc ? *num_alloc * 2 : 16;
+	return realloc(array, *num_alloc * size);
+}
+
+static char *
+_snap_strdup(cfuconf_snapshot_t *snap, const char *str) {
+	if (!str) return NULL;
+	return cfuarena_strndup(snap->arena, str, strlen(str));
+}
+
+static int
+_snap_str_cmp(const char *a, const char *b) {
+	return strcasecmp(a ? a : "", b ? b : "");
+}
+
+static int
+_snap_conf_cmp(const void *a, const void *b) {
+	const cfuconf_t *ca = *(cfuconf_t * const *)a;
+	const cfuconf_t *cb = *(cfuconf_t * const *)b;
+	int rv = _snap_str_cmp(ca->container_type, cb->container_type);
+
+	if (rv) return rv;
+	return _snap_str_cmp(ca->container_name, cb->container_name);
+}
+
+static int
+_snap_directive_cmp(const void *a, const void *b) {
+	return _snap_str_cmp(((const cfuconf_snap_directive *)a)->name,
+		((const cfuconf_snap_directive *)b)->name);
+}
+
+static int
+_snap_arg_fn(void *data, size_t data_size, void *arg) {
+	cfuconf_snap_builder *b = (cfuconf_snap_builder *)arg;
+	cfuconf_snapshot_t *snap = b->snap;
+
+	data_size = data_size;
+
+	snap->args = _snap_grow(snap->args, &b->args_alloc, snap->num_args, sizeof(char *));
+	snap->args[snap->num_args++] = _snap_strdup(snap, (char *)data);
+
+	return 0;
+}
+
+static int
+_snap_occurrence_fn(void *data, size_t data_size, void *arg) {
+	cfuconf_snap_builder *b = (cfuconf_snap_builder *)arg;
+	cfuconf_snapshot_t *snap = b->snap;
+	size_t i = snap->num_occurrences;
+
+	data_size = data_size;
+
+	snap->occurrences = _snap_grow(snap->occurrences, &b->occurrences_alloc,
+		snap->num_occurrences, sizeof(cfuconf_snap_args));
+	snap->num_occurrences++;
+	snap->occurrences[i].first_arg = snap->num_args;
+	cfulist_foreach((cfulist_t *)data, _snap_arg_fn, b);
+	snap->occurrences[i].num_args = snap->num_args - snap->occurrences[i].first_arg;
+
+	return 0;
+}
+
+static int
+_snap_directive_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	cfuconf_snap_builder *b = (cfuconf_snap_builder *)arg;
+	cfuconf_snapshot_t *snap = b->snap;
+	size_t i = snap->num_directives;
+
+	data_size = data_size;
+
+	snap->directives = _snap_grow(snap->directives, &b->directives_alloc,
+		snap->num_directives, sizeof(cfuconf_snap_directive));
+	snap->num_directives++;
+	snap->directives[i].name = cfuarena_strndup(snap->arena, (char *)key,
+		key_size ? key_size - 1 : 0);
+	snap->directives[i].first_occurrence = snap->num_occurrences;
+	cfulist_foreach((cfulist_t *)data, _snap_occurrence_fn, b);
+	snap->directives[i].num_occurrences = snap->num_occurrences
+		- snap->directives[i].first_occurrence;
+
+	return 0;
+}
+
+static int
+_snap_child_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	cfuconf_snap_builder *b = (cfuconf_snap_builder *)arg;
+
+	key = key;
+	key_size = key_size;
+	data_size = data_size;
+
+	b->children = _snap_grow(b->children, &b->children_alloc, b->num_children,
+		sizeof(cfuconf_t *));
+	b->children[b->num_children++] = (cfuconf_t *)data;
+
+	return 0;
+}
+
+static int
+_snap_container_type_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	key = key;
+	key_size = key_size;
+	data_size = data_size;
+
+	cfuhash_foreach((cfuhash_table_t *)data, _snap_child_fn, arg);
+
+	return 0;
+}
+
+static void
+_snap_add_node(cfuconf_snap_builder *b, cfuconf_t *conf) {
+	cfuconf_snapshot_t *snap = b->snap;
+	cfuconf_snap_node *node = NULL;
+
+	snap->nodes = _snap_grow(snap->nodes, &b->nodes_alloc, snap->num_nodes,
+		sizeof(cfuconf_snap_node));
+	b->src = _snap_grow(b->src, &b->src_alloc, snap->num_nodes, sizeof(cfuconf_t *));
+
+	node = &snap->nodes[snap->num_nodes];
+	memset(node, 0, sizeof(*node));
+	node->type = _snap_strdup(snap, conf->container_type);
+	node->name = _snap_strdup(snap, conf->container_name);
+	b->src[snap->num_nodes++] = conf;
+}
+
+cfuconf_snapshot_t *
+cfuconf_compile(cfuconf_t *conf) {
+	cfuconf_snap_builder b;
+	cfuconf_snapshot_t *snap = NULL;
+	size_t i = 0;
+	size_t j = 0;
+
+	if (!conf) return NULL;
+
+	memset(&b, 0, sizeof(b));
+	b.snap = snap = calloc(1, sizeof(cfuconf_snapshot_t));
+	snap->arena = cfuarena_new(0);
+
+	_snap_add_node(&b, conf);
+	for (i = 0; i < snap->num_nodes; i++) {
+		cfuconf_t *src = b.src[i];
+		size_t first = 0;
+
+		first = snap->num_directives;
+		cfuhash_foreach(src->directives, _snap_directive_fn, &b);
+		if (snap->num_directives > first) {
+			qsort(snap->directives + first, snap->num_directives - first,
+				sizeof(cfuconf_snap_directive), _snap_directive_cmp);
+		}
+		snap->nodes[i].first_directive = first;
+		snap->nodes[i].num_directives = snap->num_directives - first;
+
+		b.num_children = 0;
+		cfuhash_foreach(src->containers, _snap_container_type_fn, &b);
+		if (b.num_children) {
+			qsort(b.children, b.num_children, sizeof(cfuconf_t *), _snap_conf_cmp);
+		}
+		first = snap->num_nodes;
+		for (j = 0; j < b.num_children; j++) {
+			_snap_add_node(&b, b.children[j]);
+		}
+		snap->nodes[i].first_child = first;
+		snap->nodes[i].num_children = b.num_children;
+	}
+
+	free(b.src);
+	free(b.children);
+
+	return snap;
+}
+
+void
+cfuconf_snapshot_destroy(cfuconf_snapshot_t *snap) {
+	if (!snap) return;
+
+	free(snap->nodes);
+	free(snap->directives);
+	free(snap->occurrences);
+	free(snap->args);
+	cfuarena_destroy(snap->arena);
+	free(snap);
+}
+
+static CFU_INLINE int
+_snap_valid_node(cfuconf_snapshot_t *snap, long node) {
+	return snap && node >= 0 && (size_t)node < snap->num_nodes;
+}
+
+static CFU_INLINE int
+_snap_valid_directive(cfuconf_snapshot_t *snap, long directive) {
+	return snap && directive >= 0 && (size_t)directive < snap->num_directives;
+}
+
+long
+cfuconf_snapshot_container(cfuconf_snapshot_t *snap, long node, const char *type,
+	const char *name) {
+	size_t lo = 0;
+	size_t hi = 0;
+
+	if (!_snap_valid_node(snap, node)) return -1;
+
+	lo = snap->nodes[node].first_child;
+	hi = lo + snap->nodes[node].num_children;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int rv = _snap_str_cmp(type, snap->nodes[mid].type);
+
+		if (!rv) rv = _snap_str_cmp(name, snap->nodes[mid].name);
+		if (!rv) return (long)mid;
+		if (rv < 0) hi = mid;
+		else lo = mid + 1;
+	}
+
+	return -1;
+}
+
+size_t
+cfuconf_snapshot_num_containers(cfuconf_snapshot_t *snap, long node) {
+	if (!_snap_valid_node(snap, node)) return 0;
+	return snap->nodes[node].num_children;
+}
+
+long
+cfuconf_snapshot_nth_container(cfuconf_snapshot_t *snap, long node, size_t n) {
+	if (!_snap_valid_node(snap, node)) return -1;
+	if (n >= snap->nodes[node].num_children) return -1;
+	return (long)(snap->nodes[node].first_child + n);
+}
+
+const char *
+cfuconf_snapshot_container_type(cfuconf_snapshot_t *snap, long node) {
+	if (!_snap_valid_node(snap, node)) return NULL;
+	return snap->nodes[node].type;
+}
+
+const char *
+cfuconf_snapshot_container_name(cfuconf_snapshot_t *snap, long node) {
+	if (!_snap_valid_node(snap, node)) return NULL;
+	return snap->nodes[node].name;
+}
+
+long
+cfuconf_snapshot_directive(cfuconf_snapshot_t *snap, long node, const char *directive) {
+	size_t lo = 0;
+	size_t hi = 0;
+
+	if (!_snap_valid_node(snap, node) || !directive) return -1;
+
+	lo = snap->nodes[node].first_directive;
+	hi = lo + snap->nodes[node].num_directives;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int rv = _snap_str_cmp(directive, snap->directives[mid].name);
+
+		if (!rv) return (long)mid;
+		if (rv < 0) hi = mid;
+		else lo = mid + 1;
+	}
+
+	return -1;
+}
+
+size_t
+cfuconf_snapshot_num_directives(cfuconf_snapshot_t *snap, long node) {
+	if (!_snap_valid_node(snap, node)) return 0;
+	return snap->nodes[node].num_directives;
+}
+
+long
+cfuconf_snapshot_nth_directive(cfuconf_snapshot_t *snap, long node, size_t n) {
+	if (!_snap_valid_node(snap, node)) return -1;
+	if (n >= snap->nodes[node].num_directives) return -1;
+	return (long)(snap->nodes[node].first_directive + n);
+}
+
+const char *
+cfuconf_snapshot_directive_name(cfuconf_snapshot_t *snap, long directive) {
+	if (!_snap_valid_directive(snap, directive)) return NULL;
+	return snap->directives[directive].name;
+}
+
+size_t
+cfuconf_snapshot_num_occurrences(cfuconf_snapshot_t *snap, long directive) {
+	if (!_snap_valid_directive(snap, directive)) return 0;
+	return snap->directives[directive].num_occurrences;
+}
+
+static CFU_INLINE cfuconf_snap_args *
+_snap_occurrence(cfuconf_snapshot_t *snap, long directive, size_t n) {
+	cfuconf_snap_directive *d = NULL;
+
+	if (!_snap_valid_directive(snap, directive)) return NULL;
+	d = &snap->directives[directive];
+	if (n >= d->num_occurrences) return NULL;
+
+	return &snap->occurrences[d->first_occurrence + n];
+}
+
+size_t
+cfuconf_snapshot_num_args(cfuconf_snapshot_t *snap, long directive) {
+	return cfuconf_snapshot_nth_num_args(snap, directive,
+		cfuconf_snapshot_num_occurrences(snap, directive) - 1);
+}
+
+const char *
+cfuconf_snapshot_arg(cfuconf_snapshot_t *snap, long directive, size_t i) {
+	return cfuconf_snapshot_nth_arg(snap, directive,
+		cfuconf_snapshot_num_occurrences(snap, directive) - 1, i);
+}
+
+size_t
+cfuconf_snapshot_nth_num_args(cfuconf_snapshot_t *snap, long directive, size_t n) {
+	cfuconf_snap_args *occurrence = _snap_occurrence(snap, directive, n);
+
+	if (!occurrence) return 0;
+	return occurrence->num_args;
+}
+
+const char *
+cfuconf_snapshot_nth_arg(cfuconf_snapshot_t *snap, long directive, size_t n, size_t i) {
+	cfuconf_snap_args *occurrence = _snap_occurrence(snap, directive, n);
+
+	if (!occurrence || i >= occurrence->num_args) return NULL;
+	return snap->args[occurrence->first_arg + i];
+}
+
+/* Path index.  Every container is entered in one hash under its full
+   path, "type/name/type/name...", with the top level under the empty
+   path.  The keys are stored without a terminating NUL so that the
+   container part of a directive path can be looked up in place.
+   Directive paths that resolve are remembered in a second hash.
+*/
+
+struct cfuconf_index {
+	cfuconf_t *conf;
+	cfuhash_table_t *containers;
+	cfuhash_table_t *cache;
+};
+
+typedef struct cfuconf_index_builder {
+	cfuconf_index_t *index;
+	char *path;
+	size_t len;
+	size_t size;
+} cfuconf_index_builder;
+
+static void
+_index_append(cfuconf_index_builder *b, const char *str) {
+	size_t n = str ? strlen(str) : 0;
+
+	if (b->len + n > b->size) {
+		while (b->len + n > b->size) b->size = b->size ? b->size * 2 : 64;
+		b->path = realloc(b->path, b->size);
+	}
+	if (n) memcpy(b->path + b->len, str, n);
+	b->len += n;
+}
+
+static void _index_add(cfuconf_index_builder *b, cfuconf_t *conf);
+
+static int
+_index_container_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	cfuconf_index_builder *b = (cfuconf_index_builder *)arg;
+	cfuconf_t *conf = (cfuconf_t *)data;
+	size_t len = b->len;
+
+	key = key;
+	key_size = key_size;
+	data_size = data_size;
+
+	if (len) _index_append(b, "/");
+	_index_append(b, conf->container_type);
+	_index_append(b, "/");
+	_index_append(b, conf->container_name);
+	_index_add(b, conf);
+	b->len = len;
+
+	return 0;
+}
+
+static int
+_index_type_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	key = key;
+	key_size = key_size;
+	data_size = data_size;
+
+	cfuhash_foreach((cfuhash_table_t *)data, _index_container_fn, arg);
+
+	return 0;
+}
+
+static void
+_index_add(cfuconf_index_builder *b, cfuconf_t *conf) {
+	cfuhash_put_data(b->index->containers, b->path, b->len, (void *)conf, 0, NULL);
+	cfuhash_foreach(conf->containers, _index_type_fn, b);
+}
+
+cfuconf_index_t *
+cfuconf_index_new(cfuconf_t *conf) {
+	cfuconf_index_builder b;
+	cfuconf_index_t *index = NULL;
+
+	if (!conf) return NULL;
+
+	index = calloc(1, sizeof(cfuconf_index_t));
+	index->conf = conf;
+	index->containers = cfuhash_new_with_flags(CFUHASH_IGNORE_CASE);
+	index->cache = cfuhash_new_with_flags(CFUHASH_IGNORE_CASE);
+
+	memset(&b, 0, sizeof(b));
+	b.index = index;
+	b.size = 64;
+	b.path = malloc(b.size);
+	_index_add(&b, conf);
+	free(b.path);
+
+	return index;
+}
+
+void
+cfuconf_index_destroy(cfuconf_index_t *index) {
+	if (!index) return;
+
+	cfuhash_destroy(index->containers);
+	cfuhash_destroy(index->cache);
+	free(index);
+}
+
+cfuconf_t *
+cfuconf_index_get_container(cfuconf_index_t *index, const char *path) {
+	void *data = NULL;
+
+	if (!index || !path) return NULL;
+	if (cfuhash_get_data(index->containers, path, strlen(path), &data, NULL)) {
+		return (cfuconf_t *)data;
+	}
+
+	return NULL;
+}
+
+cfulist_t *
+cfuconf_index_get_values(cfuconf_index_t *index, const char *path) {
+	const char *directive = NULL;
+	size_t len = 0;
+	void *data = NULL;
+	cfulist_t *val_list = NULL;
+
+	if (!index || !path) return NULL;
+
+	if (cfuhash_get_data(index->cache, path, -1, &data, NULL)) return (cfulist_t *)data;
+
+	if ( (directive = strrchr(path, '/')) ) {
+		len = directive - path;
+		directive++;
+	} else {
+		directive = path;
+	}
+
+	if (!cfuhash_get_data(index->containers, path, len, &data, NULL)) return NULL;
+	if (_get_directive_last_val_list((cfuconf_t *)data, (char *)directive, &val_list) < 0) {
+		return NULL;
+	}
+
+	cfuhash_put(index->cache, path, (void *)val_list);
+
+	return val_list;
+}
+
+int
+cfuconf_index_get_one_arg(cfuconf_index_t *index, const char *path, char **rvalue) {
+	cfulist_t *val_list = cfuconf_index_get_values(index, path);
+	void *val = NULL;
+	size_t size = 0;
+
+	if (val_list && cfulist_first_data(val_list, &val, &size)) {
+		*rvalue = (char *)val;
+		return 0;
+	}
+
+	return -1;
+}
+
+int
+cfuconf_index_get_n_args(cfuconf_index_t *index, const char *path, size_t n, ...) {
+	cfulist_t *val_list = cfuconf_index_get_values(index, path);
+	va_list ap;
+	int rv = -1;
+
+	if (val_list) {
+		va_start(ap, n);
+		rv = _get_n_args(val_list, n, ap);
+		va_end(ap);
+	}
+
+	return rv;
+}
+
+/* Typed values.  A schema is a list of directive paths with their
+   types and defaults.  Applying it to a tree parses every value once
+   into a flat array indexed by the slot returned when the path was
+   added, so reading a value is an array access.  Lists and their
+   strings are copied into an arena owned by the result, which shares
+   nothing with the tree or the schema.
+*/
+
+typedef struct cfuconf_typed_value {
+	int is_set;
+	long i;
+	double f;
+	uint64_t u;
+	char **items;
+	size_t num_items;
+} cfuconf_typed_value;
+
+typedef struct cfuconf_schema_entry {
+	char *path;
+	unsigned int type;
+	int has_default;
+	cfuconf_typed_value default_value;
+} cfuconf_schema_entry;
+
+struct cfuconf_schema {
+	cfuarena_t *arena; /* paths and default lists */
+	cfuconf_schema_entry *entries;
+	size_t num_entries;
+	size_t entries_alloc;
+};
+
+struct cfuconf_typed {
+	cfuarena_t *arena;
+	cfuconf_typed_value *values;
+	size_t num_values;
+};
+
+#define CFUCONF_TYPE_MASK 0xff
+
+typedef struct cfuconf_unit {
+	const char *suffix;
+	double multiplier;
+} cfuconf_unit;
+
+static const cfuconf_unit _duration_units[] = {
+	{ "ns", 1.0 }, { "us", 1e3 }, { "ms", 1e6 }, { "s", 1e9 },
+	{ "m", 60e9 }, { "h", 3600e9 }, { "d", 86400e9 }, { NULL, 0 }
+};
+
+static const cfuconf_unit _size_units[] = {
+	{ "b", 1.0 },
+	{ "k", 1024.0 }, { "kb", 1024.0 }, { "kib", 1024.0 },
+	{ "m", 1048576.0 }, { "mb", 1048576.0 }, { "mib", 1048576.0 },
+	{ "g", 1073741824.0 }, { "gb", 1073741824.0 }, { "gib", 1073741824.0 },
+	{ "t", 1099511627776.0 }, { "tb", 1099511627776.0 }, { "tib", 1099511627776.0 },
+	{ NULL, 0 }
+};
+
+static const char *
+_parse_unit_number(const char *str, double *n) {
+	char *end = NULL;
+
+	if (!(isdigit((unsigned char)*str) || (*str == '.' && isdigit((unsigned char)str[1])))) {
+		return NULL;
+	}
+	*n = strtod(str, &end);
+	if (end == str) return NULL;
+
+	return end;
+}
+
+static int
+_unit_matches(const char *suffix, const char *ptr, const char *end) {
+	for (; *suffix && ptr < end; suffix++, ptr++) {
+		if (tolower((unsigned char)*ptr) != *suffix) return 0;
+	}
+	return !*suffix && ptr == end;
+}
+
+/* Parses a non-negative number followed by one of units, which ends
+   with a NULL suffix.  Suffixes are matched without regard to case, a
+   bare number is multiplied by bare, and with repeat several
+   number-unit pairs are added up.
+*/
+static int
+_parse_units(const char *str, const cfuconf_unit *units, double bare, int repeat,
+	uint64_t *rvalue) {
+	const char *ptr = str;
+	const char *unit_end = NULL;
+	const cfuconf_unit *unit = NULL;
+	double total = 0;
+	double n = 0;
+
+	if ( !(ptr = _parse_unit_number(ptr, &n)) ) return -1;
+	if (!*ptr) {
+		total = n * bare;
+	} else {
+		for (;;) {
+			for (unit_end = ptr; isalpha((unsigned char)*unit_end); unit_end++);
+			for (unit = units; unit->suffix; unit++) {
+				if (_unit_matches(unit->suffix, ptr, unit_end)) break;
+			}
+			if (!unit->suffix) return -1;
+			total += n * unit->multiplier;
+
+			ptr = unit_end;
+			if (!*ptr) break;
+			/* e.g. 1h30m */
+			if (!repeat || !(ptr = _parse_unit_number(ptr, &n)) || !*ptr) return -1;
+		}
+	}
+
+	if (total >= 18446744073709551615.0) return -1;
+	*rvalue = (uint64_t)(total + 0.5);
+
+	return 0;
+}
+
+int
+cfuconf_parse_bool(const char *str, long *rvalue) {
+	static const char *true_words[] = { "on", "yes", "true", "1", NULL };
+	static const char *false_words[] = { "off", "no", "false", "0", NULL };
+	size_t i = 0;
+
+	for (i = 0; true_words[i]; i++) {
+		if (!strcasecmp(str, true_words[i])) {
+			*rvalue = 1;
+			return 0;
+		}
+	}
+	for (i = 0; false_words[i]; i++) {
+		if (!strcasecmp(str, false_words[i])) {
+			*rvalue = 0;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Parses the values of one occurrence of a directive.  List items
+   are copied into arena.
+*/
+static int
+_typed_parse(unsigned int type, char **values, size_t num_values, cfuconf_typed_value *value,
+	cfuarena_t *arena) {
+	char *end = NULL;
+	size_t i = 0;
+
+	memset(value, 0, sizeof(*value));
+
+	if (type == CFUCONF_TYPE_LIST) {
+		value->items = cfuarena_alloc(arena, (num_values ? num_values : 1) * sizeof(char *));
+		for (i = 0; i < num_values; i++) {
+			value->items[i] = cfuarena_strndup(arena, values[i], strlen(values[i]));
+		}
+		value->num_items = num_values;
+		value->is_set = 1;
+		return 0;
+	}
+
+	if (num_values != 1) return -1;
+
+	switch (type) {
+	case CFUCONF_TYPE_INT:
+		errno = 0;
+		value->i = strtol(values[0], &end, 0);
+		if (end == values[0] || *end || errno == ERANGE) return -1;
+		break;
+	case CFUCONF_TYPE_FLOAT:
+		errno = 0;
+		value->f = strtod(values[0], &end);
+		if (end == values[0] || *end || errno == ERANGE) return -1;
+		break;
+	case CFUCONF_TYPE_BOOL:
+		if (cfuconf_parse_bool(values[0], &value->i) < 0) return -1;
+		break;
+	case CFUCONF_TYPE_DURATION:
+		if (_parse_units(values[0], _duration_units, 1e9, 1, &value->u) < 0) return -1;
+		break;
+	case CFUCONF_TYPE_SIZE:
+		if (_parse_units(values[0], _size_units, 1.0, 0, &value->u) < 0) return -1;
+		break;
+	default:
+		return -1;
+	}
+
+	value->is_set = 1;
+
+	return 0;
+}
+
+/* Splits a default value into words, in arena */
+static size_t
+_split_default(cfuarena_t *arena, const char *str, char ***words) {
+	const char *ptr = str;
+	const char *end = str + strlen(str);
+	const char *word_end = NULL;
+	size_t num_words = 0;
+
+	*words = cfuarena_alloc(arena, (end - str + 1) * sizeof(char *));
+	for (;;) {
+		ptr = _eat_whitespace(ptr, end);
+		if (ptr == end) break;
+		for (word_end = ptr; word_end < end && !_is_whitespace(*word_end); word_end++);
+		(*words)[num_words++] = cfuarena_strndup(arena, ptr, word_end - ptr);
+		ptr = word_end;
+	}
+
+	return num_words;
+}
+
+cfuconf_schema_t *
+cfuconf_schema_new(void) {
+	cfuconf_schema_t *schema = calloc(1, sizeof(cfuconf_schema_t));
+
+	schema->arena = cfuarena_new(0);
+
+	return schema;
+}
+
+void
+cfuconf_schema_destroy(cfuconf_schema_t *schema) {
+	if (!schema) return;
+
+	cfuarena_destroy(schema->arena);
+	free(schema->entries);
+	free(schema);
+}
+
+long
+cfuconf_schema_add(cfuconf_schema_t *schema, const char *path, unsigned int type,
+	const char *default_value) {
+	cfuconf_schema_entry *entry = NULL;
+	char **words = NULL;
+	size_t num_words = 0;
+
+	if (!schema || !path) return -1;
+	if ((type & CFUCONF_TYPE_MASK) < CFUCONF_TYPE_INT
+		|| (type & CFUCONF_TYPE_MASK) > CFUCONF_TYPE_LIST) {
+		return -1;
+	}
+
+	if (schema->num_entries == schema->entries_alloc) {
+		schema->entries_alloc = schema->entries_alloc ? schema->entries_alloc * 2 : 16;
+		schema->entries = realloc(schema->entries,
+			schema->entries_alloc * sizeof(cfuconf_schema_entry));
+	}
+	entry = &schema->entries[schema->num_entries];
+	memset(entry, 0, sizeof(*entry));
+
+	if (default_value) {
+		num_words = _split_default(schema->arena, default_value, &words);
+		if (_typed_parse(type & CFUCONF_TYPE_MASK, words, num_words, &entry->default_value,
+				schema->arena) < 0) {
+			return -1;
+		}
+		entry->has_default = 1;
+	}
+
+	entry->path = cfuarena_strndup(schema->arena, path, strlen(path));
+	entry->type = type;
+
+	return (long)schema->num_entries++;
+}
+
+typedef struct cfuconf_typed_gather {
+	char **values;
+	size_t num;
+	size_t size;
+} cfuconf_typed_gather;
+
+static int
+_typed_gather_fn(void *data, size_t data_size, void *arg) {
+	cfuconf_typed_gather *g = (cfuconf_typed_gather *)arg;
+
+	data_size = data_size;
+
+	if (g->num == g->size) {
+		g->size = g->size ? g->size * 2 : 16;
+		g->values = realloc(g->values, g->size * sizeof(char *));
+	}
+	g->values[g->num++] = (char *)data;
+
+	return 0;
+}
+
+cfuconf_typed_t *
+cfuconf_schema_apply(cfuconf_schema_t *schema, cfuconf_t *conf, char **error) {
+	cfuconf_index_t *index = NULL;
+	cfuconf_typed_t *typed = NULL;
+	cfuconf_typed_gather g;
+	cfuconf_schema_entry *entry = NULL;
+	cfuconf_typed_value *value = NULL;
+	cfulist_t *val_list = NULL;
+	size_t i = 0;
+	int rv = 0;
+
+	if (!schema || !conf) return NULL;
+
+	typed = calloc(1, sizeof(cfuconf_typed_t));
+	typed->arena = cfuarena_new(0);
+	typed->num_values = schema->num_entries;
+	typed->values = cfuarena_calloc(typed->arena, typed->num_values ? typed->num_values : 1,
+		sizeof(cfuconf_typed_value));
+
+	memset(&g, 0, sizeof(g));
+	index = cfuconf_index_new(conf);
+
+	for (i = 0; i < schema->num_entries && rv == 0; i++) {
+		entry = &schema->entries[i];
+		value = &typed->values[i];
+
+		if ( (val_list = cfuconf_index_get_values(index, entry->path)) ) {
+			g.num = 0;
+			cfulist_foreach(val_list, _typed_gather_fn, &g);
+			if ( (rv = _typed_parse(entry->type & CFUCONF_TYPE_MASK, g.values, g.num, value,
+					typed->arena)) < 0 && error ) {
+				*error = cfustring_sprintf_c_str("cfuconf: invalid value for %s\n", entry->path);
+			}
+		} else if (entry->has_default) {
+			*value = entry->default_value;
+			if (value->num_items) {
+				rv = _typed_parse(CFUCONF_TYPE_LIST, entry->default_value.items,
+					entry->default_value.num_items, value, typed->arena);
+			}
+		} else if (entry->type & CFUCONF_REQUIRED) {
+			rv = -1;
+			if (error) {
+				*error = cfustring_sprintf_c_str("cfuconf: missing directive %s\n",
+					entry->path);
+			}
+		}
+	}
+
+	free(g.values);
+	cfuconf_index_destroy(index);
+
+	if (rv < 0) {
+		cfuconf_typed_destroy(typed);
+		return NULL;
+	}
+
+	return typed;
+}
+
+void
+cfuconf_typed_destroy(cfuconf_typed_t *typed) {
+	if (!typed) return;
+
+	cfuarena_destroy(typed->arena);
+	free(typed);
+}
+
+static CFU_INLINE cfuconf_typed_value *
+_typed_value(cfuconf_typed_t *typed, long slot) {
+	if (!typed || slot < 0 || (size_t)slot >= typed->num_values) return NULL;
+	return &typed->values[slot];
+}
+
+int
+cfuconf_typed_is_set(cfuconf_typed_t *typed, long slot) {
+	cfuconf_typed_value *value = _typed_value(typed, slot);
+	return value ? value->is_set : 0;
+}
+
+long
+cfuconf_typed_int(cfuconf_typed_t *typed, long slot) {
+	cfuconf_typed_value *value = _typed_value(typed, slot);
+	return value ? value->i : 0;
+}
+
+double
+cfuconf_typed_float(cfuconf_typed_t *typed, long slot) {
+	cfuconf_typed_value *value = _typed_value(typed, slot);
+	return value ? value->f : 0;
+}
+
+int
+cfuconf_typed_bool(cfuconf_typed_t *typed, long slot) {
+	cfuconf_typed_value *value = _typed_value(typed, slot);
+	return value ? (int)value->i : 0;
+}
+
+uint64_t
+cfuconf_typed_duration(cfuconf_typed_t *typed, long slot) {
+	cfuconf_typed_value *value = _typed_value(typed, slot);
+	return value ? value->u : 0;
+}
+
+uint64_t
+cfuconf_typed_size(cfuconf_typed_t *typed, long slot) {
+	cfuconf_typed_value *value = _typed_value(typed, slot);
+	return value ? value->u : 0;
+}
+
+size_t
+cfuconf_typed_num_items(cfuconf_typed_t *typed, long slot) {
+	cfuconf_typed_value *value = _typed_value(typed, slot);
+	return value ? value->num_items : 0;
+}
+
+const char *
+cfuconf_typed_item(cfuconf_typed_t *typed, long slot, size_t n) {
+	cfuconf_typed_value *value = _typed_value(typed, slot);
+	if (!value || n >= value->num_items) return NULL;
+	return value->items[n];
+}
+
+/* Tree diffs.  Every container is given a hash of its whole subtree,
+   so containers that did not change are skipped without looking
+   inside them.  The hashes of the directives and children of a
+   container are summed, so they do not depend on hash table order,
+   while the occurrences and values of a directive are hashed in
+   order.  Names are hashed without regard to case, as they are
+   matched.
+*/
+
+typedef struct cfuconf_diff_values {
+	char **values;
+	size_t num;
+	size_t size;
+} cfuconf_diff_values;
+
+typedef struct cfuconf_diff_state {
+	cfuarena_t *arena;
+	cfuhash_table_t *hashes; /* cfuconf_t * -> uint64_t *, for both trees */
+	cfuconf_diff_values old_values;
+	cfuconf_diff_values new_values;
+	cfuconf_diff_fn_t fn;
+	void *arg;
+	size_t num_changes;
+	int stopped;
+	char *path;
+	size_t len;
+	size_t size;
+} cfuconf_diff_state;
+
+static CFU_INLINE uint64_t
+_diff_mix(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint64_t
+_diff_hash_str(uint64_t h, const char *str, int ignore_case) {
+	if (!str) return _diff_mix(h + 1);
+
+	for (; *str; str++) {
+		h ^= (unsigned char)(ignore_case ? tolower(*str) : *str);
+		h *= 0x100000001b3ULL;
+	}
+
+	return _diff_mix(h);
+}
+
+static uint64_t _diff_hash_conf(cfuconf_diff_state *s, cfuconf_t *conf);
+
+static int
+_diff_hash_value_fn(void *data, size_t data_size, void *arg) {
+	uint64_t *h = (uint64_t *)arg;
+	data_size = data_size;
+	*h = _diff_hash_str(*h, (char *)data, 0);
+	return 0;
+}
+
+static int
+_diff_hash_occurrence_fn(void *data, size_t data_size, void *arg) {
+	uint64_t *h = (uint64_t *)arg;
+	data_size = data_size;
+	/* keeps "A B" apart from "A" followed by "B" */
+	*h = _diff_mix(*h + cfulist_num_entries((cfulist_t *)data));
+	cfulist_foreach((cfulist_t *)data, _diff_hash_value_fn, h);
+	return 0;
+}
+
+static int
+_diff_hash_directive_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	uint64_t *sum = (uint64_t *)arg;
+	uint64_t h = _diff_hash_str(0, (char *)key, 1);
+
+	key_size = key_size;
+	data_size = data_size;
+
+	cfulist_foreach((cfulist_t *)data, _diff_hash_occurrence_fn, &h);
+	*sum += _diff_mix(h);
+
+	return 0;
+}
+
+typedef struct cfuconf_diff_hash_arg {
+	cfuconf_diff_state *s;
+	uint64_t sum;
+} cfuconf_diff_hash_arg;
+
+static int
+_diff_hash_container_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	cfuconf_diff_hash_arg *a = (cfuconf_diff_hash_arg *)arg;
+	cfuconf_t *conf = (cfuconf_t *)data;
+	uint64_t h = 0;
+
+	key = key;
+	key_size = key_size;
+	data_size = data_size;
+
+	h = _diff_hash_str(h, conf->container_type, 1);
+	h = _diff_hash_str(h, conf->container_name, 1);
+	a->sum += _diff_mix(h ^ _diff_hash_conf(a->s, conf));
+
+	return 0;
+}
+
+static int
+_diff_hash_type_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	key = key;
+	key_size = key_size;
+	data_size = data_size;
+
+	cfuhash_foreach((cfuhash_table_t *)data, _diff_hash_container_fn, arg);
+
+	return 0;
+}
+
+/* Returns the hash of the subtree at conf, computing the hashes of
+   conf and all of its descendants the first time.
+*/
+static uint64_t
+_diff_hash_conf(cfuconf_diff_state *s, cfuconf_t *conf) {
+	cfuconf_diff_hash_arg a;
+	uint64_t directives = 0;
+	uint64_t *h = NULL;
+
+	if (cfuhash_get_data(s->hashes, &conf, sizeof(conf), (void **)&h, NULL)) return *h;
+
+	cfuhash_foreach(conf->directives, _diff_hash_directive_fn, &directives);
+	a.s = s;
+	a.sum = 0;
+	cfuhash_foreach(conf->containers, _diff_hash_type_fn, &a);
+
+	h = cfuarena_alloc(s->arena, sizeof(uint64_t));
+	*h = _diff_mix(directives) ^ _diff_mix(a.sum + 1);
+	cfuhash_put_data(s->hashes, &conf, sizeof(conf), (void *)h, 0, NULL);
+
+	return *h;
+}
+
+
+static void
+_diff_values_add(cfuconf_diff_values *v, char *value) {
+	if (v->num == v->size) {
+		v->size = v->size ? v->size * 2 : 16;
+		v->values = realloc(v->values, v->size * sizeof(char *));
+	}
+	v->values[v->num++] = value;
+}
+
+static int
+_diff_flatten_value_fn(void *data, size_t data_size, void *arg) {
+	data_size = data_size;
+	_diff_values_add((cfuconf_diff_values *)arg, (char *)data);
+	return 0;
+}
+
+static int
+_diff_flatten_occurrence_fn(void *data, size_t data_size, void *arg) {
+	data_size = data_size;
+	/* values are never NULL, so NULL separates the occurrences */
+	_diff_values_add((cfuconf_diff_values *)arg, NULL);
+	cfulist_foreach((cfulist_t *)data, _diff_flatten_value_fn, arg);
+	return 0;
+}
+
+/* Compares all occurrences of a directive in both trees.  The lists
+   are walked with cfulist_foreach() so that trees shared with readers
+   are not disturbed.
+*/
+static int
+_diff_directive_equal(cfuconf_diff_state *s, cfulist_t *a, cfulist_t *b) {
+	size_t i = 0;
+
+	if (cfulist_num_entries(a) != cfulist_num_entries(b)) return 0;
+
+	s->old_values.num = 0;
+	s->new_values.num = 0;
+	cfulist_foreach(a, _diff_flatten_occurrence_fn, &s->old_values);
+	cfulist_foreach(b, _diff_flatten_occurrence_fn, &s->new_values);
+
+	if (s->old_values.num != s->new_values.num) return 0;
+	for (i = 0; i < s->old_values.num; i++) {
+		char *va = s->old_values.values[i];
+		char *vb = s->new_values.values[i];
+		if (va != vb && (!va || !vb || strcmp(va, vb))) return 0;
+	}
+
+	return 1;
+}
+
+static void
+_diff_append(cfuconf_diff_state *s, const char *str) {
+	size_t n = str ? strlen(str) : 0;
+
+	if (s->len + n + 2 > s->size) {
+		while (s->len + n + 2 > s->size) s->size = s->size ? s->size * 2 : 64;
+		s->path = realloc(s->path, s->size);
+	}
+	if (s->len) s->path[s->len++] = '/';
+	if (n) memcpy(s->path + s->len, str, n);
+	s->len += n;
+	s->path[s->len] = '\000';
+}
+
+static void
+_diff_truncate(cfuconf_diff_state *s, size_t len) {
+	s->len = len;
+	s->path[len] = '\000';
+}
+
+static void
+_diff_report(cfuconf_diff_state *s, unsigned int change, void *old_data, void *new_data) {
+	s->num_changes++;
+	if (s->fn && s->fn(change, s->path, old_data, new_data, s->arg)) s->stopped = 1;
+}
+
+/* One side of a walk over a container: the hash or container matching
+   the one being walked in the other tree, if any, and whether the
+   walk is over the new tree, looking only for additions.
+*/
+typedef struct cfuconf_diff_walk {
+	cfuconf_diff_state *s;
+	void *other;
+	int added;
+} cfuconf_diff_walk;
+
+static void _diff_conf(cfuconf_diff_state *s, cfuconf_t *old_conf, cfuconf_t *new_conf);
+
+static int
+_diff_directive_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	cfuconf_diff_walk *w = (cfuconf_diff_walk *)arg;
+	cfuconf_diff_state *s = w->s;
+	void *other = NULL;
+	size_t len = s->len;
+
+	data_size = data_size;
+
+	_diff_append(s, (char *)key);
+	if (!cfuhash_get_data(((cfuconf_t *)w->other)->directives, key, key_size, &other, NULL)) {
+		if (w->added) _diff_report(s, CFUCONF_DIFF_ADDED, NULL, data);
+		else _diff_report(s, CFUCONF_DIFF_REMOVED, data, NULL);
+	} else if (!w->added && !_diff_directive_equal(s, (cfulist_t *)data, (cfulist_t *)other)) {
+		_diff_report(s, CFUCONF_DIFF_CHANGED, data, other);
+	}
+	_diff_truncate(s, len);
+
+	return s->stopped;
+}
+
+static int
+_diff_container_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	cfuconf_diff_walk *w = (cfuconf_diff_walk *)arg;
+	cfuconf_diff_state *s = w->s;
+	cfuconf_t *conf = (cfuconf_t *)data;
+	void *other = NULL;
+	size_t len = s->len;
+
+	data_size = data_size;
+
+	_diff_append(s, conf->container_type);
+	_diff_append(s, conf->container_name);
+	if (!w->other ||
+		!cfuhash_get_data((cfuhash_table_t *)w->other, key, key_size, &other, NULL)) {
+		if (w->added) _diff_report(s, CFUCONF_DIFF_ADDED | CFUCONF_DIFF_CONTAINER, NULL, data);
+		else _diff_report(s, CFUCONF_DIFF_REMOVED | CFUCONF_DIFF_CONTAINER, data, NULL);
+	} else if (!w->added &&
+		_diff_hash_conf(s, conf) != _diff_hash_conf(s, (cfuconf_t *)other)) {
+		_diff_report(s, CFUCONF_DIFF_CHANGED | CFUCONF_DIFF_CONTAINER, data, other);
+		if (!s->stopped) _diff_conf(s, conf, (cfuconf_t *)other);
+	}
+	_diff_truncate(s, len);
+
+	return s->stopped;
+}
+
+static int
+_diff_type_fn(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+	cfuconf_diff_walk *w = (cfuconf_diff_walk *)arg;
+	cfuconf_diff_walk sub;
+
+	data_size = data_size;
+
+	sub.s = w->s;
+	sub.added = w->added;
+	sub.other = NULL;
+	cfuhash_get_data(((cfuconf_t *)w->other)->containers, key, key_size, &sub.other, NULL);
+	cfuhash_foreach((cfuhash_table_t *)data, _diff_container_fn, &sub);
+
+	return w->s->stopped;
+}
+
+static void
+_diff_conf(cfuconf_diff_state *s, cfuconf_t *old_conf, cfuconf_t *new_conf) {
+	cfuconf_diff_walk w;
+
+	if (old_conf == new_conf) return;
+	if (_diff_hash_conf(s, old_conf) == _diff_hash_conf(s, new_conf)) return;
+
+	w.s = s;
+	w.added = 0;
+	w.other = new_conf;
+	cfuhash_foreach(old_conf->directives, _diff_directive_fn, &w);
+	if (!s->stopped) cfuhash_foreach(old_conf->containers, _diff_type_fn, &w);
+
+	w.added = 1;
+	w.other = old_conf;
+	if (!s->stopped) cfuhash_foreach(new_conf->directives, _diff_directive_fn, &w);
+	if (!s->stopped) cfuhash_foreach(new_conf->containers, _diff_type_fn, &w);
+}
+
+size_t
+cfuconf_diff(cfuconf_t *old_conf, cfuconf_t *new_conf, cfuconf_diff_fn_t fn, void *arg) {
+	cfuconf_diff_state s;
+
+	if (!old_conf || !new_conf) return 0;
+
+	memset(&s, 0, sizeof(s));
+	s.arena = cfuarena_new(0);
+	s.hashes = cfuhash_new_in_arena(s.arena, 0);
+	s.fn = fn;
+	s.arg = arg;
+	s.size = 64;
+	s.path = calloc(1, s.size);
+
+	_diff_conf(&s, old_conf, new_conf);
+
+	free(s.path);
+	free(s.old_values.values);
+	free(s.new_values.values);
+	cfuhash_destroy(s.hashes);
+	cfuarena_destroy(s.arena);
+
+	return s.num_changes;
+}
+
+/* Managed configurations.  Readers announce themselves by bumping a
+   counter chosen by the parity of the generation they observed and by
+   a hash of their thread, so that readers on different threads rarely
+   share a cache line.  A reader that finds the generation changed
+   under it backs out and tries again, so once a writer has bumped the
+   generation no new reader can get at the old tree, and the writer
+   only has to wait for the old parity's counters to drain to zero
+   before destroying it.
+*/
+
+#define CFUCONF_READER_SLOTS 32
+
+typedef struct cfuconf_reader_slot {
+	unsigned long count;
+	char pad[64 - sizeof(unsigned long)];
+} cfuconf_reader_slot;
+
+struct cfuconf_managed {
+	char *file_path;
+	unsigned int flags;
+	cfuconf_t *confs[2];
+	unsigned long generation;
+	cfuconf_reader_slot readers[2][CFUCONF_READER_SLOTS];
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t write_mutex;
+# ifndef HAVE_ATOMIC_BUILTINS
+	pthread_mutex_t read_mutex;
+# endif
+#endif
+};
+
+static CFU_INLINE size_t
+_reader_slot(void) {
+#ifdef HAVE_PTHREAD_H
+	pthread_t self = pthread_self();
+	return cfuhash_one_at_a_time_hash(&self, sizeof(self)) % CFUCONF_READER_SLOTS;
+#else
+	return 0;
+#endif
+}
+
+cfuconf_managed_t *
+cfuconf_managed_new_with_conf(cfuconf_t *conf) {
+	cfuconf_managed_t *mc = NULL;
+
+	if (!conf) return NULL;
+
+	mc = calloc(1, sizeof(cfuconf_managed_t));
+	mc->confs[0] = conf;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&mc->write_mutex, NULL);
+# ifndef HAVE_ATOMIC_BUILTINS
+	pthread_mutex_init(&mc->read_mutex, NULL);
+# endif
+#endif
+
+	return mc;
+}
+
+cfuconf_managed_t *
+cfuconf_managed_new(char *file_path, unsigned int flags, char **error) {
+	cfuconf_managed_t *mc = NULL;
+	cfuconf_t *conf = NULL;
+
+	if (cfuconf_parse_file_with_flags(file_path, flags, &conf, error) < 0) return NULL;
+
+	mc = cfuconf_managed_new_with_conf(conf);
+	mc->file_path = cfustring_dup_c_str(file_path);
+	mc->flags = flags;
+
+	return mc;
+}
+
+cfuconf_t *
+cfuconf_managed_acquire(cfuconf_managed_t *mc) {
+	size_t slot = _reader_slot();
+	unsigned long gen = 0;
+	cfuconf_t *conf = NULL;
+
+#ifdef HAVE_ATOMIC_BUILTINS
+	for (;;) {
+		unsigned long *count = NULL;
+
+		gen = CFU_ATOMIC_LOAD(&mc->generation);
+		count = &mc->readers[gen & 1][slot].count;
+		CFU_ATOMIC_FETCH_ADD(count, 1);
+		if (CFU_ATOMIC_LOAD(&mc->generation) == gen) break;
+
+		/* a writer got in between; the tree for gen may be going away */
+		CFU_ATOMIC_FETCH_SUB(count, 1);
+	}
+	conf = CFU_ATOMIC_LOAD_ACQUIRE(&mc->confs[gen & 1]);
+#else
+# ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&mc->read_mutex);
+# endif
+	gen = mc->generation;
+	mc->readers[gen & 1][slot].count++;
+	conf = mc->confs[gen & 1];
+# ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&mc->read_mutex);
+# endif
+#endif
+
+	return conf;
+}
+
+void
+cfuconf_managed_release(cfuconf_managed_t *mc, cfuconf_t *conf) {
+	size_t slot = _reader_slot();
+
+#ifdef HAVE_ATOMIC_BUILTINS
+	/* conf cannot be replaced while it is held, so this finds its parity */
+	size_t parity = CFU_ATOMIC_LOAD_ACQUIRE(&mc->confs[0]) == conf ? 0 : 1;
+	CFU_ATOMIC_FETCH_SUB(&mc->readers[parity][slot].count, 1);
+#else
+	size_t parity = 0;
+# ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&mc->read_mutex);
+# endif
+	parity = mc->confs[0] == conf ? 0 : 1;
+	mc->readers[parity][slot].count--;
+# ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&mc->read_mutex);
+# endif
+#endif
+}
+
+static unsigned long
+_num_readers(cfuconf_managed_t *mc, size_t parity) {
+	unsigned long num = 0;
+	size_t i = 0;
+
+#if !defined(HAVE_ATOMIC_BUILTINS) && defined(HAVE_PTHREAD_H)
+	pthread_mutex_lock(&mc->read_mutex);
+#endif
+	for (i = 0; i < CFUCONF_READER_SLOTS; i++) {
+#ifdef HAVE_ATOMIC_BUILTINS
+		num += CFU_ATOMIC_LOAD(&mc->readers[parity][i].count);
+#else
+		num += mc->readers[parity][i].count;
+#endif
+	}
+#if !defined(HAVE_ATOMIC_BUILTINS) && defined(HAVE_PTHREAD_H)
+	pthread_mutex_unlock(&mc->read_mutex);
+#endif
+
+	return num;
+}
+
+int
+cfuconf_managed_publish(cfuconf_managed_t *mc, cfuconf_t *conf) {
+	struct timespec ts = { 0, 50000 };
+	unsigned long gen = 0;
+	size_t old = 0;
+	cfuconf_t *old_conf = NULL;
+
+	if (!conf) return -1;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&mc->write_mutex);
+#endif
+	/* only writers change the generation, and they are serialized */
+	gen = mc->generation;
+	old = gen & 1;
+	old_conf = mc->confs[old];
+
+#ifdef HAVE_ATOMIC_BUILTINS
+	CFU_ATOMIC_STORE_RELEASE(&mc->confs[old ^ 1], conf);
+	CFU_ATOMIC_STORE(&mc->generation, gen + 1);
+#else
+# ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&mc->read_mutex);
+# endif
+	mc->confs[old ^ 1] = conf;
+	mc->generation = gen + 1;
+# ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&mc->read_mutex);
+# endif
+#endif
+
+	/* grace period: wait for readers still holding the old tree */
+	while (_num_readers(mc, old)) {
+		nanosleep(&ts, NULL);
+	}
+
+#ifdef HAVE_ATOMIC_BUILTINS
+	CFU_ATOMIC_STORE(&mc->confs[old], NULL);
+#else
+# ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&mc->read_mutex);
+# endif
+	mc->confs[old] = NULL;
+# ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&mc->read_mutex);
+# endif
+#endif
+	cfuconf_destroy(old_conf);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&mc->write_mutex);
+#endif
+
+	return 0;
+}
+
+int
+cfuconf_managed_reload(cfuconf_managed_t *mc, char **error) {
+	cfuconf_t *conf = NULL;
+
+	if (!mc->file_path) return -1;
+	if (cfuconf_parse_file_with_flags(mc->file_path, mc->flags, &conf, error) < 0) return -1;
+
+	return cfuconf_managed_publish(mc, conf);
+}
+
+unsigned long
+cfuconf_managed_generation(cfuconf_managed_t *mc) {
+#ifdef HAVE_ATOMIC_BUILTINS
+	return CFU_ATOMIC_LOAD(&mc->generation);
+#else
+	unsigned long gen = 0;
+# ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&mc->read_mutex);
+# endif
+	gen = mc->generation;
+# ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&mc->read_mutex);
+# endif
+	return gen;
+#endif
+}
+
+void
+cfuconf_managed_destroy(cfuconf_managed_t *mc) {
+	if (!mc) return;
+
+	if (mc->confs[0]) cfuconf_destroy(mc->confs[0]);
+	if (mc->confs[1]) cfuconf_destroy(mc->confs[1]);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&mc->write_mutex);
+# ifndef HAVE_ATOMIC_BUILTINS
+	pthread_mutex_destroy(&mc->read_mutex);
+# endif
+#endif
+	free(mc->file_path);
+	free(mc);
+}
 
 
 static void
@@ -89,6 +89,108 @@ int cfuconf_parse_file(char *file_path, cfuconf_t **conf, char **error);
 */
 int cfuconf_parse_buffer(char *buffer, cfuconf_t **conf, char **error);
 
+/* Same as cfuconf_parse_buffer(), except buffer holds len bytes and
+ * need not be NUL-terminated.  The buffer is not modified.
+ */
+int cfuconf_parse_buffer_n(const char *buffer, size_t len, cfuconf_t **conf,
+	char **error);
+
+/* Valid flags for cfuconf_parse_file_with_flags() and
+ * cfuconf_parse_buffer_n_with_flags()
+ */
+#define CFUCONF_ARENA 1 /* allocate the whole tree from a single arena */
+#define CFUCONF_PARALLEL 2 /* parse large inputs on several threads */
+
+/* Same as cfuconf_parse_file(), but with flags.  With CFUCONF_ARENA,
+ * every name, value, list and hash in the resulting tree is carved out
+ * of one arena, and cfuconf_destroy() releases it with a handful of
+ * free()s regardless of the size of the tree.  Such a tree must be
+ * treated as read-only: its values must not be free()'d, and its lists
+ * and hashes must not be destroyed or modified by the caller.
+ *
+ * With CFUCONF_PARALLEL, a large file is split between top-level
+ * containers into one piece per CPU, the pieces are parsed on separate
+ * threads, and the resulting trees are merged.  The result is the same
+ * as without the flag.  It has no effect on input that is not mapped
+ * or held in a buffer, or when threads are not available.
+ */
+int cfuconf_parse_file_with_flags(char *file_path, unsigned int flags, cfuconf_t **conf,
+	char **error);
+
+/* Same as cfuconf_parse_buffer_n(), but with flags as for
+ * cfuconf_parse_file_with_flags().
+ */
+int cfuconf_parse_buffer_n_with_flags(const char *buffer, size_t len, unsigned int flags,
+	cfuconf_t **conf, char **error);
+
+/* Same as cfuconf_parse_file_with_flags(), but keep a binary copy of
+ * the tree in cache_path.  If the cache was written for the current
+ * contents of file_path, as identified by their size and checksum,
+ * the tree is loaded from it without parsing the text.  Otherwise the
+ * file is parsed and the cache rewritten.  The cache is only meant to
+ * be read on the machine that wrote it.
+ */
+int cfuconf_parse_file_cached(char *file_path, char *cache_path, unsigned int flags,
+	cfuconf_t **conf, char **error);
+
+/* Same as cfuconf_parse_file_with_flags(), but read from the open
+ * file descriptor fd, which may be a pipe or socket, until end of file.
+ * The descriptor is not closed.  Returns -1 with an error on platforms
+ * without read().
+ */
+int cfuconf_parse_fd(int fd, unsigned int flags, cfuconf_t **conf, char **error);
+
+/* An incremental parser, for input that arrives in pieces.  Buffers of
+ * any size are pushed into the parser as they become available, and
+ * only the line that straddles two buffers is copied, so the input
+ * never has to be held in memory all at once.  A parser either builds
+ * a tree, or reports each container and directive to callbacks as soon
+ * as its line is complete, without building anything.
+ */
+typedef struct cfuconf_parser cfuconf_parser_t;
+
+/* Callbacks for a parser created with
+ * cfuconf_parser_new_with_callbacks().  name is NULL for a container
+ * without one.  The strings, and the values array, are only valid for
+ * the duration of the call.  Returning non-zero stops the parse with an
+ * error.
+ */
+typedef int (*cfuconf_open_fn_t)(const char *type, const char *name, void *arg);
+typedef int (*cfuconf_close_fn_t)(const char *type, const char *name, void *arg);
+typedef int (*cfuconf_directive_fn_t)(const char *name, size_t num_values, char **values,
+	void *arg);
+
+/* Return a new parser that builds a tree.  flags are as for
+ * cfuconf_parse_file_with_flags().
+ */
+cfuconf_parser_t * cfuconf_parser_new(unsigned int flags);
+
+/* Return a new parser that calls open_fn at each opening container
+ * tag, close_fn at each closing tag, and directive_fn for each
+ * directive, each with arg.  Any of them may be NULL.
+ */
+cfuconf_parser_t * cfuconf_parser_new_with_callbacks(cfuconf_open_fn_t open_fn,
+	cfuconf_close_fn_t close_fn, cfuconf_directive_fn_t directive_fn, void *arg);
+
+/* Parse the next len bytes of input.  Returns zero on success, less
+ * than zero on error, with error set as for cfuconf_parse_file().
+ * Once an error has been returned, the parser accepts no more input.
+ */
+int cfuconf_parser_feed(cfuconf_parser_t *parser, const char *buf, size_t len,
+	char **error);
+
+/* Signal the end of the input.  For a parser that builds a tree, the
+ * tree is returned in conf and now belongs to the caller; conf may be
+ * NULL for a callback parser.  Returns zero on success, less than zero
+ * on error.
+ */
+int cfuconf_parser_finish(cfuconf_parser_t *parser, cfuconf_t **conf, char **error);
+
+/* Free all resources used by the parser, including any tree that has
+ * not been returned by cfuconf_parser_finish().
+ */
+void cfuconf_parser_destroy(cfuconf_parser_t *parser);
+
 /* Free all resources used by the cfuconf_t structure */
 void cfuconf_destroy(cfuconf_t *conf);
 
@@ -108,6 +210,301 @@ int cfuconf_get_directive_two_args(cfuconf_t *conf, char *directive, char **rval
 /* Get the value of the given directives, with n arguments */
 int cfuconf_get_directive_n_args(cfuconf_t *conf, char *directive, size_t n, ...);
 
+/* Get the hash of containers of the given type at the top level of
+ * conf, keyed by container name, or NULL if there are none.
+ */
+cfuhash_table_t * cfuconf_get_containers_of_type(cfuconf_t *conf, char *type);
+
+/* Get the container of the given type and name at the top level of
+ * conf, or NULL if there is none.
+ */
+cfuconf_t * cfuconf_get_container(cfuconf_t *conf, char *type, char *name);
+
+/* An index for looking up containers and directives by path.  A path
+ * names each enclosing container by its type and name, followed by
+ * the directive, all separated by '/', e.g.,
+ *
+ *     VirtualHost/example.com/Port
+ *
+ * refers to the Port directive in <VirtualHost example.com>.  A
+ * container without a name is given an empty name, as in "Global//Port".
+ * Container paths leave out the directive, and the empty path is the
+ * top level.  Matching is case-insensitive.  Names containing '/'
+ * cannot be expressed.
+ *
+ * The index is built once over the whole tree, and directive paths are
+ * cached as they are resolved.  The tree must not be modified or
+ * destroyed while the index is in use.  The index may be used from
+ * several threads at once.
+ */
+typedef struct cfuconf_index cfuconf_index_t;
+
+/* Build an index over conf */
+cfuconf_index_t * cfuconf_index_new(cfuconf_t *conf);
+
+/* Free all resources used by the index, but not the tree */
+void cfuconf_index_destroy(cfuconf_index_t *index);
+
+/* Get the container at the given container path, or NULL */
+cfuconf_t * cfuconf_index_get_container(cfuconf_index_t *index, const char *path);
+
+/* Get the list of values of the last occurrence of the directive at
+ * path, or NULL if there is none.
+ */
+cfulist_t * cfuconf_index_get_values(cfuconf_index_t *index, const char *path);
+
+/* Same as cfuconf_get_directive_one_arg(), but for the directive at path */
+int cfuconf_index_get_one_arg(cfuconf_index_t *index, const char *path, char **rvalue);
+
+/* Same as cfuconf_get_directive_n_args(), but for the directive at path */
+int cfuconf_index_get_n_args(cfuconf_index_t *index, const char *path, size_t n, ...);
+
+/* A compiled, immutable copy of a cfuconf_t.  Containers and
+ * directives are referred to by handles, which are plain indexes that
+ * stay valid for the life of the snapshot.  Resolve the handles once
+ * with cfuconf_snapshot_container() and cfuconf_snapshot_directive(),
+ * then read arguments through them without any hashing or allocation.
+ * A snapshot shares nothing with the cfuconf_t it was compiled from,
+ * and may be read from any number of threads without locking.
+ */
+typedef struct cfuconf_snapshot cfuconf_snapshot_t;
+
+/* The handle of the top level container of every snapshot */
+#define CFUCONF_SNAPSHOT_ROOT 0
+
+/* Compile conf into a new snapshot.  Returns NULL if conf is NULL. */
+cfuconf_snapshot_t * cfuconf_compile(cfuconf_t *conf);
+
+/* Free all resources used by the snapshot */
+void cfuconf_snapshot_destroy(cfuconf_snapshot_t *snap);
+
+/* Returns the handle of the container of the given type and name
+ * directly inside container node, or -1 if there is none.  Matching is
+ * case-insensitive, and a NULL name matches a container without one.
+ */
+long cfuconf_snapshot_container(cfuconf_snapshot_t *snap, long node, const char *type,
+	const char *name);
+
+/* Returns the number of containers directly inside node */
+size_t cfuconf_snapshot_num_containers(cfuconf_snapshot_t *snap, long node);
+
+/* Returns the handle of the nth container directly inside node, or -1 */
+long cfuconf_snapshot_nth_container(cfuconf_snapshot_t *snap, long node, size_t n);
+
+/* Returns the type of container node, or NULL for the top level */
+const char * cfuconf_snapshot_container_type(cfuconf_snapshot_t *snap, long node);
+
+/* Returns the name of container node, or NULL if it has none */
+const char * cfuconf_snapshot_container_name(cfuconf_snapshot_t *snap, long node);
+
+/* Returns the handle of the given directive in container node, or -1
+ * if it does not appear there.  Matching is case-insensitive.
+ */
+long cfuconf_snapshot_directive(cfuconf_snapshot_t *snap, long node, const char *directive);
+
+/* Returns the number of distinct directives in node */
+size_t cfuconf_snapshot_num_directives(cfuconf_snapshot_t *snap, long node);
+
+/* Returns the handle of the nth directive in node, or -1 */
+long cfuconf_snapshot_nth_directive(cfuconf_snapshot_t *snap, long node, size_t n);
+
+/* Returns the name of the directive */
+const char * cfuconf_snapshot_directive_name(cfuconf_snapshot_t *snap, long directive);
+
+/* Returns the number of times the directive appears in its container */
+size_t cfuconf_snapshot_num_occurrences(cfuconf_snapshot_t *snap, long directive);
+
+/* Returns the number of arguments to the last occurrence of the
+ * directive, which is the one cfuconf_get_directive_one_arg() uses.
+ */
+size_t cfuconf_snapshot_num_args(cfuconf_snapshot_t *snap, long directive);
+
+/* Returns argument i of the last occurrence of the directive, or NULL */
+const char * cfuconf_snapshot_arg(cfuconf_snapshot_t *snap, long directive, size_t i);
+
+/* Same as cfuconf_snapshot_num_args(), but for occurrence n */
+size_t cfuconf_snapshot_nth_num_args(cfuconf_snapshot_t *snap, long directive, size_t n);
+
+/* Same as cfuconf_snapshot_arg(), but for occurrence n */
+const char * cfuconf_snapshot_nth_arg(cfuconf_snapshot_t *snap, long directive, size_t n,
+	size_t i);
+
+/* A schema declares the types of directives, so that their values can
+ * be parsed once, when a tree is loaded, instead of on every read.
+ * Each directive is added under its path, as for cfuconf_index_t, and
+ * is given a slot.  Applying the schema to a tree returns the parsed
+ * values, which are read by slot without any lookup or conversion.
+ * Where a directive appears more than once, its last occurrence is
+ * used.
+ */
+typedef struct cfuconf_schema cfuconf_schema_t;
+typedef struct cfuconf_typed cfuconf_typed_t;
+
+/* Types for cfuconf_schema_add().  An int is a long in C syntax, e.g.
+ * 42 or 0x2a, and a float a double.  A bool is on/off, yes/no,
+ * true/false or 1/0.  A duration, e.g. 250ms or 1h30m, is kept in
+ * nanoseconds; its units are ns, us, ms, s, m, h and d, and a bare
+ * number is in seconds.  A size, e.g. 64k or 1.5GB, is kept in bytes,
+ * with units that are powers of 1024.  A list holds all the values of
+ * the directive.
+ */
+#define CFUCONF_TYPE_INT 1
+#define CFUCONF_TYPE_FLOAT 2
+#define CFUCONF_TYPE_BOOL 3
+#define CFUCONF_TYPE_DURATION 4
+#define CFUCONF_TYPE_SIZE 5
+#define CFUCONF_TYPE_LIST 6
+
+/* Or'ed into the type: the directive must be present when there is
+ * no default.
+ */
+#define CFUCONF_REQUIRED 0x100
+
+/* Parse str as a bool, in any case, the same way as CFUCONF_TYPE_BOOL
+ * directives.  Returns 0 and sets *rvalue to 1 or 0, or returns -1 if
+ * str is not a bool.
+ */
+int cfuconf_parse_bool(const char *str, long *rvalue);
+
+/* Return a new, empty schema */
+cfuconf_schema_t * cfuconf_schema_new(void);
+
+/* Free all resources used by the schema */
+void cfuconf_schema_destroy(cfuconf_schema_t *schema);
+
+/* Declare the directive at path to be of the given type.  If
+ * default_value is not NULL, it is used when the directive is missing;
+ * for a list, it is split into words.  Returns the slot of the
+ * directive, or -1 if the type or the default is invalid.
+ */
+long cfuconf_schema_add(cfuconf_schema_t *schema, const char *path, unsigned int type,
+	const char *default_value);
+
+/* Parse the values of every directive in the schema from conf.
+ * Returns NULL if a value is invalid or a required directive is
+ * missing, in which case error is set as for cfuconf_parse_file().
+ * The result does not refer to conf or the schema, and may be read
+ * from several threads at once.
+ */
+cfuconf_typed_t * cfuconf_schema_apply(cfuconf_schema_t *schema, cfuconf_t *conf,
+	char **error);
+
+/* Free the parsed values */
+void cfuconf_typed_destroy(cfuconf_typed_t *typed);
+
+/* Returns 1 if the directive in slot was present or has a default, 0
+ * otherwise.  The getters below return zero for a directive that is
+ * not set.
+ */
+int cfuconf_typed_is_set(cfuconf_typed_t *typed, long slot);
+
+/* Get the value of a CFUCONF_TYPE_INT directive */
+long cfuconf_typed_int(cfuconf_typed_t *typed, long slot);
+
+/* Get the value of a CFUCONF_TYPE_FLOAT directive */
+double cfuconf_typed_float(cfuconf_typed_t *typed, long slot);
+
+/* Get the value of a CFUCONF_TYPE_BOOL directive, as 1 or 0 */
+int cfuconf_typed_bool(cfuconf_typed_t *typed, long slot);
+
+/* Get the value of a CFUCONF_TYPE_DURATION directive, in nanoseconds */
+uint64_t cfuconf_typed_duration(cfuconf_typed_t *typed, long slot);
+
+/* Get the value of a CFUCONF_TYPE_SIZE directive, in bytes */
+uint64_t cfuconf_typed_size(cfuconf_typed_t *typed, long slot);
+
+/* Get the number of values of a CFUCONF_TYPE_LIST directive */
+size_t cfuconf_typed_num_items(cfuconf_typed_t *typed, long slot);
+
+/* Get value n of a CFUCONF_TYPE_LIST directive, or NULL */
+const char * cfuconf_typed_item(cfuconf_typed_t *typed, long slot, size_t n);
+
+/* Kinds of change reported by cfuconf_diff().  CFUCONF_DIFF_CONTAINER
+ * is or'ed in when the change is to a container rather than a
+ * directive.
+ */
+#define CFUCONF_DIFF_ADDED 1
+#define CFUCONF_DIFF_REMOVED 2
+#define CFUCONF_DIFF_CHANGED 4
+#define CFUCONF_DIFF_CONTAINER 8
+
+/* Prototype for a function called by cfuconf_diff() for each change.
+ * path names the directive or container as for cfuconf_index_t.  For a
+ * directive, old_data and new_data are its lists of occurrences, each
+ * a list of values, as found in cfuconf_get_directives(); for a
+ * container, they are the cfuconf_t.  Either is NULL when the item is
+ * missing from that tree.  A non-zero return value stops the diff.
+ */
+typedef int (*cfuconf_diff_fn_t)(unsigned int change, const char *path, void *old_data,
+	void *new_data, void *arg);
+
+/* Compare two trees and call fn for each directive and container that
+ * was added, removed or changed between old_conf and new_conf.  A
+ * directive has changed if any of its occurrences or values differ.
+ * A changed container is reported before the changes inside it; an
+ * added or removed one is reported without its contents.  Containers
+ * are compared by a hash of their whole subtree, so unchanged parts of
+ * the trees cost one hash computation each.  Returns the number of
+ * changes reported.
+ */
+size_t cfuconf_diff(cfuconf_t *old_conf, cfuconf_t *new_conf, cfuconf_diff_fn_t fn,
+	void *arg);
+
+/* A managed configuration holds the current cfuconf_t for a file and
+ * replaces it on reload without ever blocking readers.  Readers bracket
+ * their use of the tree with cfuconf_managed_acquire() and
+ * cfuconf_managed_release(), which take no locks.  A reload parses the
+ * new tree first, publishes it atomically, and then waits until no
+ * reader holds the old tree before destroying it, so reloading should
+ * be done from a background thread.
+ */
+typedef struct cfuconf_managed cfuconf_managed_t;
+
+/* Parse file_path with cfuconf_parse_file_with_flags() and return a
+ * managed configuration holding the result.  Returns NULL on error, in
+ * which case error is set as for cfuconf_parse_file().
+ */
+cfuconf_managed_t * cfuconf_managed_new(char *file_path, unsigned int flags, char **error);
+
+/* Return a managed configuration holding conf, which it takes over.
+ * Such a configuration can only be updated with
+ * cfuconf_managed_publish().
+ */
+cfuconf_managed_t * cfuconf_managed_new_with_conf(cfuconf_t *conf);
+
+/* Return the current tree.  It stays valid, and unchanged, until it is
+ * passed to cfuconf_managed_release() by the same thread.  The tree must
+ * not be modified or destroyed by the caller.
+ */
+cfuconf_t * cfuconf_managed_acquire(cfuconf_managed_t *mc);
+
+/* Release a tree returned by cfuconf_managed_acquire() */
+void cfuconf_managed_release(cfuconf_managed_t *mc, cfuconf_t *conf);
+
+/* Make conf, which the managed configuration takes over, the current
+ * tree.  Blocks until readers of the previous tree have released it,
+ * then destroys the previous tree, so it must not be called by a thread
+ * that holds a tree.  Returns zero on success, less than zero on error.
+ */
+int cfuconf_managed_publish(cfuconf_managed_t *mc, cfuconf_t *conf);
+
+/* Re-parse the file the managed configuration was created from and
+ * publish the result.  On a parse error the current tree is kept,
+ * error is set as for cfuconf_parse_file(), and less than zero is
+ * returned.
+ */
+int cfuconf_managed_reload(cfuconf_managed_t *mc, char **error);
+
+/* Returns the number of trees published so far.  Callers can compare
+ * it against a saved value to tell whether derived state is stale.
+ */
+unsigned long cfuconf_managed_generation(cfuconf_managed_t *mc);
+
+/* Free the managed configuration and its current tree.  There must be
+ * no readers.
+ */
+void cfuconf_managed_destroy(cfuconf_managed_t *mc);
+
 /* Print out a representation of the parsed configuration */
 void cfuconf_pretty_print_conf(cfuconf_t *conf, FILE *fp, size_t indent_level);
 
@@ -42,6 +42,7 @@
 #include "cfu.h"
 #include "cfuhash.h"
 #include "cfustring.h"
+#include "cfuarena.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -110,6 +111,7 @@ struct cfuhash_table {
 	cfuhash_free_fn_t free_fn;
 	unsigned int resized_count;
 	cfuhash_event_flags event_flags;
+	cfuarena_t *arena;
 };
 
 /* One-at-a-Time Hash Function, from [1]. Used by perl. See [2] for more
@@ -142,19 +144,34 @@ hash_size(unsigned int s) {
 	return i;
 }
 
+/* All memory owned by the table goes through these so that tables
+ * created with an arena take it from there instead.
+ */
 static CFU_INLINE void *
-hash_key_dup(const void *key, size_t key_size) {
-	void *new_key = malloc(key_size);
-	memcpy(new_key, key, key_size);
-	return new_key;
+hash_alloc(cfuhash_table_t *ht, size_t size) {
+	if (ht->arena) return cfuarena_alloc(ht->arena, size);
+	return malloc(size);
 }
 
 static CFU_INLINE void *
-hash_key_dup_lower_case(const void *key, size_t key_size) {
-	char *new_key = (char *)hash_key_dup(key, key_size);
+hash_calloc(cfuhash_table_t *ht, size_t nmemb, size_t size) {
+	if (ht->arena) return cfuarena_calloc(ht->arena, nmemb, size);
+	return calloc(nmemb, size);
+}
+
+static CFU_INLINE void
+hash_free(cfuhash_table_t *ht, void *ptr) {
+	if (!ht->arena) free(ptr);
+}
+
+/* Lower-cases key into buf if it fits, otherwise into a malloc()'d copy */
+static CFU_INLINE char *
+hash_key_lower_case(const void *key, size_t key_size, char *buf, size_t buf_size) {
+	const char *src = (const char *)key;
+	char *new_key = key_size <= buf_size ? buf : malloc(key_size);
 	size_t i = 0;
-	for (i = 0; i < key_size; i++) new_key[i] = tolower(new_key[i]);
-	return (void *)new_key;
+	for (i = 0; i < key_size; i++) new_key[i] = tolower(src[i]);
+	return new_key;
 }
 
 /* returns the index into the buckets array */
@@ -164,9 +181,10 @@ hash_value(cfuhash_table_t *ht, const void *key, size_t key_size, size_t num_buc
 
 	if (key) {
 		if (ht->flags & CFUHASH_IGNORE_CASE) {
-			char *lc_key = (char *)hash_key_dup_lower_case(key, key_size);
+			char buf[128];
+			char *lc_key = hash_key_lower_case(key, key_size, buf, sizeof(buf));
 			hv = ht->hash_func(lc_key, key_size);
-			free(lc_key);
+			if (lc_key != buf) free(lc_key);
 		} else {
 			hv = ht->hash_func(key, key_size);
 		}
@@ -181,18 +199,20 @@ hash_value(cfuhash_table_t *ht, const void *key, size_t key_size, size_t num_buc
 }
 
 static cfuhash_table_t *
-_cfuhash_new(size_t size, unsigned int flags) {
+_cfuhash_new(size_t size, unsigned int flags, cfuarena_t *arena) {
 	cfuhash_table_t *ht;
 
 	size = hash_size(size);
-	ht = malloc(sizeof(cfuhash_table_t));
+	if (arena) ht = cfuarena_alloc(arena, sizeof(cfuhash_table_t));
+	else ht = malloc(sizeof(cfuhash_table_t));
 	memset(ht, '\000', sizeof(cfuhash_table_t));
 
 	ht->type = libcfu_t_hash_table;
 	ht->num_buckets = size;
 	ht->entries = 0;
 	ht->flags = flags;
-	ht->buckets = calloc(size, sizeof(cfuhash_entry *));
+	ht->arena = arena;
+	ht->buckets = hash_calloc(ht, size, sizeof(cfuhash_entry *));
 
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_init(&ht->mutex, NULL);
@@ -205,24 +225,29 @@ _cfuhash_new(size_t size, unsigned int flags) {
 	return ht;
 }
 
+cfuhash_table_t *
+cfuhash_new_in_arena(cfuarena_t *arena, unsigned int flags) {
+	return _cfuhash_new(8, CFUHASH_FROZEN_UNTIL_GROWS|flags, arena);
+}
+
 cfuhash_table_t *
 cfuhash_new(void) {
-	return _cfuhash_new(8, CFUHASH_FROZEN_UNTIL_GROWS);
+	return _cfuhash_new(8, CFUHASH_FROZEN_UNTIL_GROWS, NULL);
 }
 
 cfuhash_table_t *
 cfuhash_new_with_initial_size(size_t size) {
 	if (size == 0) size = 8;
-	return _cfuhash_new(size, CFUHASH_FROZEN_UNTIL_GROWS);
+	return _cfuhash_new(size, CFUHASH_FROZEN_UNTIL_GROWS, NULL);
 }
 
 cfuhash_table_t *
 cfuhash_new_with_flags(unsigned int flags) {
-	return _cfuhash_new(8, CFUHASH_FROZEN_UNTIL_GROWS|flags);
+	return _cfuhash_new(8, CFUHASH_FROZEN_UNTIL_GROWS|flags, NULL);
 }
 
 cfuhash_table_t * cfuhash_new_with_free_fn(cfuhash_free_fn_t ff) {
-	cfuhash_table_t *ht = _cfuhash_new(8, CFUHASH_FROZEN_UNTIL_GROWS);
+	cfuhash_table_t *ht = _cfuhash_new(8, CFUHASH_FROZEN_UNTIL_GROWS, NULL);
 	cfuhash_set_free_function(ht, ff);
 	return ht;
 }
@@ -256,7 +281,7 @@ cfuhash_merge(cfuhash_table_t *ht1, cfuhash_table_t *ht2, unsigned int flags) {
 	cfuhash_table_t *new_ht = NULL;
 
 	flags |= CFUHASH_FROZEN_UNTIL_GROWS;
-	new_ht = _cfuhash_new(cfuhash_num_entries(ht1) + cfuhash_num_entries(ht2), flags);
+	new_ht = _cfuhash_new(cfuhash_num_entries(ht1) + cfuhash_num_entries(ht2), flags, NULL);
 	if (ht1) cfuhash_copy(ht1, new_ht);
 	if (ht2) cfuhash_copy(ht2, new_ht);
 
@@ -363,14 +388,16 @@ hash_cmp(const void *key, size_t key_size, cfuhash_entry *he, unsigned int case_
 static CFU_INLINE cfuhash_entry *
 hash_add_entry(cfuhash_table_t *ht, unsigned int hv, const void *key, size_t key_size,
 	void *data, size_t data_size) {
-	cfuhash_entry *he = calloc(1, sizeof(cfuhash_entry));
+	cfuhash_entry *he = hash_calloc(ht, 1, sizeof(cfuhash_entry));
 
 	assert(hv < ht->num_buckets);
 
-	if (ht->flags & CFUHASH_NOCOPY_KEYS)
+	if (ht->flags & CFUHASH_NOCOPY_KEYS) {
 		he->key = (void *)key;
-	else
-		he->key = hash_key_dup(key, key_size);
+	} else {
+		he->key = hash_alloc(ht, key_size);
+		memcpy(he->key, key, key_size);
+	}
 	he->key_size = key_size;
 	he->data = data;
 	he->data_size = data_size;
@@ -524,9 +551,9 @@ cfuhash_clear(cfuhash_table_t *ht) {
 			while (he) {
 				hep = he;
 				he = he->next;
-				if (! (ht->flags & CFUHASH_NOCOPY_KEYS) ) free(hep->key);
+				if (! (ht->flags & CFUHASH_NOCOPY_KEYS) ) hash_free(ht, hep->key);
 				if (ht->free_fn) ht->free_fn(hep->data);
-				free(hep);
+				hash_free(ht, hep);
 			}
 			ht->buckets[i] = NULL;
 		}
@@ -564,12 +591,12 @@ cfuhash_delete_data(cfuhash_table_t *ht, const void *key, size_t key_size) {
 		else ht->buckets[hv] = he->next;
 
 		ht->entries--;
-		if (! (ht->flags & CFUHASH_NOCOPY_KEYS) ) free(he->key);
+		if (! (ht->flags & CFUHASH_NOCOPY_KEYS) ) hash_free(ht, he->key);
 		if (ht->free_fn) {
 			ht->free_fn(he->data);
 			r = NULL; /* don't return a pointer to a free()'d location */
 		}
-		free(he);
+		hash_free(ht, he);
 	}
 
 	unlock_hash(ht);
@@ -698,8 +725,8 @@ _cfuhash_destroy_entry(cfuhash_table_t *ht, cfuhash_entry *he, cfuhash_free_fn_t
 			if (ht->flags & CFUHASH_FREE_DATA) free(he->data);
 		}
 	}
-	if ( !(ht->flags & CFUHASH_NOCOPY_KEYS) ) free(he->key);
-	free(he);
+	if ( !(ht->flags & CFUHASH_NOCOPY_KEYS) ) hash_free(ht, he->key);
+	hash_free(ht, he);
 }
 
 size_t
@@ -793,6 +820,14 @@ cfuhash_destroy_with_free_fn(cfuhash_table_t *ht, cfuhash_free_fn_t ff) {
 	size_t i;
 	if (!ht) return 0;
 
+	if (ht->arena && !ff && !ht->free_fn && !(ht->flags & CFUHASH_FREE_DATA)) {
+		/* nothing to visit; the memory goes away with the arena */
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&ht->mutex);
+#endif
+		return 1;
+	}
+
 	lock_hash(ht);
 	for (i = 0; i < ht->num_buckets; i++) {
 		if (ht->buckets[i]) {
@@ -804,12 +839,12 @@ cfuhash_destroy_with_free_fn(cfuhash_table_t *ht, cfuhash_free_fn_t ff) {
 			}
 		}
 	}
-	free(ht->buckets);
+	hash_free(ht, ht->buckets);
 	unlock_hash(ht);
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_destroy(&ht->mutex);
 #endif
-	free(ht);
+	hash_free(ht, ht);
 
 	return 1;
 }
@@ -862,7 +897,7 @@ cfuhash_rehash(cfuhash_table_t *ht) {
 		unlock_hash(ht);
 		return 0;
 	}
-	new_buckets = calloc(new_size, sizeof(cfuhash_entry *));
+	new_buckets = hash_calloc(ht, new_size, sizeof(cfuhash_entry *));
 
 	for (i = 0; i < ht->num_buckets; i++) {
 		cfuhash_entry *he = ht->buckets[i];
@@ -876,7 +911,7 @@ cfuhash_rehash(cfuhash_table_t *ht) {
 	}
 
 	ht->num_buckets = new_size;
-	free(ht->buckets);
+	hash_free(ht, ht->buckets);
 	ht->buckets = new_buckets;
 	ht->resized_count++;
 
@@ -51,6 +51,7 @@
 
 #include "cfulist.h"
 #include "cfustring.h"
+#include "cfuarena.h"
 
 typedef struct cfulist_entry {
 	void *data;
@@ -69,20 +70,42 @@ struct cfulist {
 #endif
 	cfulist_entry *each_ptr;
 	cfulist_free_fn_t free_fn;
+	cfuarena_t *arena;
 };
 
-cfulist_t *
-cfulist_new(void) {
+static cfulist_t *
+_cfulist_new(cfuarena_t *arena) {
 	cfulist_t *list;
-	if (!(list = malloc(sizeof(*list))))
+	if (arena)
+		list = cfuarena_alloc(arena, sizeof(*list));
+	else
+		list = malloc(sizeof(*list));
+	if (!list)
 		return list;
-	*list = (cfulist_t){.type=libcfu_t_list};
+	*list = (cfulist_t){.type=libcfu_t_list, .arena=arena};
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_init(&list->mutex, NULL);
 #endif
 	return list;
 }
 
+cfulist_t *
+cfulist_new(void) {
+	return _cfulist_new(NULL);
+}
+
+cfulist_t *
+cfulist_new_in_arena(cfuarena_t *arena) {
+	return _cfulist_new(arena);
+}
+
+/* Lists created with an arena never free their own memory */
+static CFU_INLINE void
+list_free(cfulist_t *list, void *ptr) {
+	if (!list->arena)
+		free(ptr);
+}
+
 cfulist_t *
 cfulist_new_with_free_fn(cfulist_free_fn_t free_fn) {
 	cfulist_t *list = cfulist_new();
@@ -91,12 +114,12 @@ cfulist_new_with_free_fn(cfulist_free_fn_t free_fn) {
 }
 
 static CFU_INLINE void
-_cfulist_free_entry(cfulist_entry *entry, cfulist_free_fn_t list_ff,
+_cfulist_free_entry(cfulist_t *list, cfulist_entry *entry,
 		cfulist_free_fn_t override_ff, void **data, size_t *data_size) {
 	cfulist_free_fn_t ff;
 	if (!entry)
 		return;
-	ff = override_ff ? override_ff : list_ff;
+	ff = override_ff ? override_ff : list->free_fn;
 	if (ff) {
 		ff(entry->data);
 		entry->data = NULL;
@@ -106,7 +129,7 @@ _cfulist_free_entry(cfulist_entry *entry, cfulist_free_fn_t list_ff,
 		*data = entry->data;
 	if (data_size)
 		*data_size = entry->data_size;
-	free(entry);
+	list_free(list, entry);
 }
 
 size_t
@@ -129,9 +152,13 @@ unlock_list(cfulist_t *list) {
 }
 
 static CFU_INLINE cfulist_entry *
-new_list_entry(void) {
+new_list_entry(cfulist_t *list) {
 	cfulist_entry *entry;
-	if (!(entry = malloc(sizeof(*entry))))
+	if (list->arena)
+		entry = cfuarena_alloc(list->arena, sizeof(*entry));
+	else
+		entry = malloc(sizeof(*entry));
+	if (!entry)
 		return entry;
 	*entry = (struct cfulist_entry){0};
 	return entry;
@@ -139,7 +166,7 @@ new_list_entry(void) {
 
 int
 cfulist_push_data(cfulist_t *list, void *data, size_t data_size) {
-	cfulist_entry *entry = new_list_entry();
+	cfulist_entry *entry = new_list_entry(list);
 	if (!entry) return 0;
 
 	if (data_size == (size_t)-1) data_size = strlen((char *)data) + 1;
@@ -179,14 +206,14 @@ cfulist_pop_data(cfulist_t *list, void **data, size_t *data_size) {
 			new_tail->next = NULL;
 			*data = list->tail->data;
 			if (data_size) *data_size = list->tail->data_size;
-			free(list->tail);
+			list_free(list, list->tail);
 			list->tail = new_tail;
 		} else {
 			/* there is only one entry in the list */
 			assert(list->num_entries == 1);
 			*data = list->tail->data;
 			if (data_size) *data_size = list->tail->data_size;
-			free(list->tail);
+			list_free(list, list->tail);
 			list->tail = NULL;
 			list->entries = NULL;
 		}
@@ -203,7 +230,7 @@ cfulist_pop_data(cfulist_t *list, void **data, size_t *data_size) {
 
 int
 cfulist_unshift_data(cfulist_t *list, void *data, size_t data_size) {
-	cfulist_entry *entry = new_list_entry();
+	cfulist_entry *entry = new_list_entry(list);
 	if (!entry) return 0;
 
 	if (data_size == (size_t)-1) data_size = strlen((char *)data) + 1;
@@ -253,7 +280,7 @@ cfulist_shift_data(cfulist_t *list, void **data, size_t *data_size) {
 			list->tail = NULL;
 			list->entries = NULL;
 		}
-		free(entry);
+		list_free(list, entry);
 		list->num_entries--;
 	} else {
 		assert(list->num_entries == 0);
@@ -394,7 +421,7 @@ _cfulist_remove_entry(cfulist_t *list, cfulist_entry *entry,
 		return 0;
 	if (!_cfulist_unlink_entry(list, entry))
 		return 0;
-	_cfulist_free_entry(entry, list->free_fn, ff, data, data_size);
+	_cfulist_free_entry(list, entry, ff, data, data_size);
 	return 1;
 }
 
@@ -692,16 +719,24 @@ cfulist_destroy_with_free_fn(cfulist_t *list, cfulist_free_fn_t free_fn) {
 	if (!list)
 		return;
 
+	if (list->arena && !free_fn && !list->free_fn) {
+		/* nothing to visit; the memory goes away with the arena */
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&list->mutex);
+#endif
+		return;
+	}
+
 	lock_list(list);
 	entry = list->entries;
 	while (entry) {
 		next = entry->next;
-		_cfulist_free_entry(entry, list->free_fn, free_fn, NULL, NULL);
+		_cfulist_free_entry(list, entry, free_fn, NULL, NULL);
 		entry = next;
 	}
 	unlock_list(list);
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_destroy(&list->mutex);
 #endif
-	free(list);
+	list_free(list, list);
 }
@@ -40,7 +40,9 @@
 #include "cfuhash.h"
 #include "cfulist.h"
 #include "cfustring.h"
+#include "cfuarena.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -49,8 +51,13 @@ struct cfuopt_struct {
 	libcfu_type type;
 	cfulist_t *option_list;
 	cfuhash_table_t *option_map;
-	cfulist_t *extra;
 	char *progname;
+	char *name_buf; /* option name being looked up */
+	size_t name_size;
+	char **args; /* arguments left over by cfuopt_parse_with_flags() */
+	size_t num_args;
+	size_t args_alloc;
+	cfuarena_t *arena;
 };
 
 typedef enum {
@@ -76,7 +83,6 @@ cfuopt_new(void) {
 	cfuopt_t *context = calloc(1, sizeof(cfuopt_t));
 	context->option_list = cfulist_new();
 	context->option_map = cfuhash_new();
-	context->extra = cfulist_new();
 	return context;
 }
 
@@ -220,56 +226,6 @@ cfuopt_add_entry(cfuopt_t *context, const char *opt_str, void *arg_data,
 	cfulist_foreach(param_list, _add_to_option_map, &entry_struct);
 }
 
-static void
-check_arg(const char *arg, int *is_long, int *is_short, int *is_data, int *is_end_of_options,
-	char **parsed_arg, const char **value) {
-	const char *ptr = NULL;
-
-	ptr = arg;
-	*is_long = 0;
-	*is_short = 0;
-	*is_data = 0;
-	*is_end_of_options = 0;
-	*parsed_arg = NULL;
-	*value = NULL;
-
-	if (!ptr || !*ptr) return;
-
-	if (*ptr != '-') {
-		*is_data = 1;
-		*parsed_arg = cfustring_dup_c_str(ptr);
-		return;
-	}
-	ptr++;
-	if (!*ptr) {
-		*is_data = 1;
-		*parsed_arg = cfustring_dup_c_str(ptr - 1);
-		return;
-	}
-	if (*ptr == '-') {
-		const char *val_ptr = NULL;
-		ptr++;
-		if (!*ptr) {
-			*is_end_of_options = 1;
-			return;
-		}
-		*is_long = 1;
-		*parsed_arg = cfustring_dup_c_str(ptr);
-		val_ptr = ptr;
-		for (val_ptr = ptr; *val_ptr && *val_ptr != '='; val_ptr++);
-		if (*val_ptr == '=') {
-			(*parsed_arg)[val_ptr - ptr] = '\000';
-			val_ptr++;
-			*value = val_ptr;
-		}
-		return;
-	} else {
-		*is_short = 1;
-		*parsed_arg = cfustring_dup_c_str(ptr);
-		return;
-	}
-}
-
 static void
 _set_entry_val(cfuopt_list_entry_t *entry, const char *value) {
 	switch (entry->arg_type) {
@@ -292,75 +248,198 @@ _set_entry_val(cfuopt_list_entry_t *entry, const char *value) {
 	}
 }
 
-typedef struct {
-	int count;
-	char **argv;
-} _update_extra_ds;
+/* Arguments are read one at a time from a source, with at most one
+   argument read ahead to see whether it is the value of an option.
+   Response files named by @file arguments are expanded in place,
+   reading the file a token at a time, so that neither the file nor
+   the arguments in it are ever held in memory all at once.
+*/
 
-static int
-_update_extra(void *data, size_t data_size, void *arg) {
-	_update_extra_ds *ds = (_update_extra_ds *)arg;
-	data_size = data_size;
-	ds->argv[ds->count] = (char *)data;
-	ds->count++;
+#define CFUOPT_MAX_RESPONSE_DEPTH 16
+
+typedef struct cfuopt_response_file {
+	FILE *fp;
+	char *buf;
+	size_t size;
+} cfuopt_response_file;
+
+typedef struct cfuopt_reader {
+	cfuopt_source_fn_t next_fn;
+	void *next_arg;
+	int stable; /* whether strings from next_fn outlive the parse */
+	unsigned int flags;
+	cfuopt_response_file files[CFUOPT_MAX_RESPONSE_DEPTH];
+	size_t depth;
+	const char *pending;
+	int pending_stable;
+	int end_of_options;
+	char **error;
+} cfuopt_reader;
 
-	return 0;
+static void
+_token_add(cfuopt_response_file *rf, size_t len, int c) {
+	if (len + 1 >= rf->size) {
+		rf->size = rf->size ? rf->size * 2 : 256;
+		rf->buf = realloc(rf->buf, rf->size);
+	}
+	rf->buf[len] = (char)c;
 }
 
-void
-cfuopt_parse(cfuopt_t *context, int *argc, char ***argv, char **error) {
-	int i = 0;
-	char **args = *argv;
-	int is_long_opt = 0;
-	int is_short_opt = 0;
-	int is_data = 0;
-	int is_end_of_opt = 0;
-	char *parsed_arg = NULL;
-	const char *value = NULL;
-	cfuopt_list_entry_t *entry = NULL;
-	size_t extra_count = 0;
-
-	error = error;
+/* Returns the next whitespace separated token, or NULL at the end of
+   the file.  Quotes group words, and a backslash escapes the next
+   character, except inside single quotes.
+*/
+static const char *
+_response_file_next(cfuopt_response_file *rf) {
+	int c = 0;
+	int quote = 0;
+	size_t len = 0;
 
-	if (!context) return;
-	if (*argc < 1) return;
+	do {
+		c = getc(rf->fp);
+	} while (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+	if (c == EOF) return NULL;
 
-	context->progname = cfustring_dup_c_str(args[0]);
+	for (; c != EOF; c = getc(rf->fp)) {
+		if (quote) {
+			if (c == quote) {
+				quote = 0;
+				continue;
+			}
+			if (c == '\\' && quote == '"') {
+				if ( (c = getc(rf->fp)) == EOF ) break;
+			}
+		} else if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+			break;
+		} else if (c == '"' || c == '\'') {
+			quote = c;
+			continue;
+		} else if (c == '\\') {
+			if ( (c = getc(rf->fp)) == EOF ) break;
+		}
+		_token_add(rf, len++, c);
+	}
+	_token_add(rf, len, '\000');
 
-	if (*argc < 2) return;
+	return rf->buf;
+}
 
-	for (i = 1; i < *argc; i++) {
-		char *cur_arg = args[i];
-		entry = NULL;
-		value = NULL;
+/* Returns the next argument, expanding response files.  *stable is
+   set if the string stays valid after the parse; otherwise it is only
+   valid until the next call.
+*/
+static const char *
+_next_arg(cfuopt_reader *r, int *stable, int *failed) {
+	const char *arg = NULL;
+	cfuopt_response_file *rf = NULL;
+	FILE *fp = NULL;
+
+	if ( (arg = r->pending) ) {
+		r->pending = NULL;
+		*stable = r->pending_stable;
+		return arg;
+	}
 
-		if (parsed_arg) free(parsed_arg);
-		parsed_arg = NULL;
+	for (;;) {
+		if (r->depth) {
+			rf = &r->files[r->depth - 1];
+			if ( !(arg = _response_file_next(rf)) ) {
+				fclose(rf->fp);
+				free(rf->buf);
+				r->depth--;
+				continue;
+			}
+			*stable = 0;
+		} else {
+			if ( !(arg = r->next_fn(r->next_arg)) ) return NULL;
+			*stable = r->stable;
+		}
 
-		check_arg(cur_arg, &is_long_opt, &is_short_opt, &is_data, &is_end_of_opt, &parsed_arg,
-				  &value);
-		if (is_long_opt || is_short_opt) {
-			entry = (cfuopt_list_entry_t *)cfuhash_get(context->option_map, parsed_arg);
-			if (parsed_arg) free(parsed_arg);
-			parsed_arg = NULL;
+		if (!(r->flags & CFUOPT_RESPONSE_FILES) || r->end_of_options || arg[0] != '@'
+			|| !arg[1]) {
+			return arg;
 		}
-		else if (is_end_of_opt) {
-			if (parsed_arg) free(parsed_arg);
-			parsed_arg = NULL;
-			i++;
-			for (; i < *argc; i++) {
-				cfulist_push(context->extra, args[i]);
+
+		/* like most compilers, an @file that cannot be read is kept as is */
+		if ( !(fp = fopen(arg + 1, "r")) ) return arg;
+		if (r->depth == CFUOPT_MAX_RESPONSE_DEPTH) {
+			fclose(fp);
+			if (r->error) {
+				*r->error = cfustring_sprintf_c_str("cfuopt: response files nested too "
+					"deeply at %s\n", arg);
 			}
-			break;
+			*failed = 1;
+			return NULL;
 		}
-		else if (is_data) {
-			if (parsed_arg) free(parsed_arg);
-			parsed_arg = NULL;
-			cfulist_push(context->extra, args[i]);
+		rf = &r->files[r->depth++];
+		rf->fp = fp;
+		rf->buf = NULL;
+		rf->size = 0;
+	}
+}
+
+static void
+_close_reader(cfuopt_reader *r) {
+	while (r->depth) {
+		r->depth--;
+		fclose(r->files[r->depth].fp);
+		free(r->files[r->depth].buf);
+	}
+}
+
+/* Sink for arguments that are not options */
+typedef int (*cfuopt_extra_sink_t)(const char *arg, int stable, void *arg2);
+
+/* Looks name up without copying the argument: the name is copied into
+   a buffer that is reused for the whole parse.
+*/
+static cfuopt_list_entry_t *
+_lookup_option(cfuopt_t *context, const char *name, size_t len) {
+	if (len + 1 > context->name_size) {
+		context->name_size = len + 1 > 64 ? len + 1 : 64;
+		context->name_buf = realloc(context->name_buf, context->name_size);
+	}
+	memcpy(context->name_buf, name, len);
+	context->name_buf[len] = '\000';
+
+	return (cfuopt_list_entry_t *)cfuhash_get(context->option_map, context->name_buf);
+}
+
+static int
+_parse_args(cfuopt_t *context, cfuopt_reader *r, cfuopt_extra_sink_t sink, void *sink_arg) {
+	const char *arg = NULL;
+	const char *name = NULL;
+	const char *value = NULL;
+	const char *next = NULL;
+	cfuopt_list_entry_t *entry = NULL;
+	size_t len = 0;
+	int stable = 0;
+	int next_stable = 0;
+	int failed = 0;
+
+	/* an error while looking ahead for a value also ends the parse */
+	while (!failed && (arg = _next_arg(r, &stable, &failed)) ) {
+		/* data, including "-" on its own */
+		if (r->end_of_options || arg[0] != '-' || arg[1] == '\000') {
+			if (sink(arg, stable, sink_arg)) break;
+			continue;
+		}
+		if (arg[1] == '-' && arg[2] == '\000') {
+			r->end_of_options = 1;
 			continue;
 		}
 
-		if (!entry) {
+		value = NULL;
+		if (arg[1] == '-') {
+			name = arg + 2;
+			for (len = 0; name[len] && name[len] != '='; len++);
+			if (name[len] == '=') value = name + len + 1;
+		} else {
+			name = arg + 1;
+			len = strlen(name);
+		}
+
+		if ( !(entry = _lookup_option(context, name, len)) ) {
 			/* FIXME: return error here if need be */
 			continue;
 		}
@@ -373,44 +452,379 @@ cfuopt_parse(cfuopt_t *context, int *argc, char ***argv, char **error) {
 		  case cfuopt_arg_int:
 		  case cfuopt_arg_float:
 			  if (value) {
-				  if (entry->arg_data) {
-					  _set_entry_val(entry, value);
-				  }
+				  _set_entry_val(entry, value);
+				  break;
+			  }
+			  if ( !(next = _next_arg(r, &next_stable, &failed)) ) break;
+			  if (next[0] != '-' || next[1] == '\000') {
+				  _set_entry_val(entry, next);
 			  } else {
-				  i++;
-				  if (i >= *argc) break; /* FIXME: set up error msg here */
-				  check_arg(args[i], &is_long_opt, &is_short_opt, &is_data, &is_end_of_opt,
-					  &parsed_arg, &value);
-				  if (!is_data) {
-					  i--;
-					  break; /* FIXME: set up error msg here */
-				  }
-				  _set_entry_val(entry, parsed_arg);
-				  free(parsed_arg);
-				  parsed_arg = NULL;
+				  /* not a value, so it is parsed on its own next */
+				  r->pending = next;
+				  r->pending_stable = next_stable;
 			  }
 			  break;
 		  case cfuopt_arg_string_array:
-			  break;
 		  case cfuopt_arg_invalid:
-			  /* FIXME: really should produce an error msg here */
-			  break;
 		  default:
 			  break;
 		}
+	}
+
+	_close_reader(r);
+
+	return failed ? -1 : 0;
+}
+
+typedef struct cfuopt_argv_source {
+	char **args;
+	int argc;
+	int i;
+	int num_left;
+} cfuopt_argv_source;
+
+static const char *
+_argv_next(void *arg) {
+	cfuopt_argv_source *src = (cfuopt_argv_source *)arg;
+	if (src->i >= src->argc) return NULL;
+	return src->args[src->i++];
+}
+
+/* Without response files, there are never more leftover arguments
+   than were read, so they are moved down argv in place.
+*/
+static int
+_argv_sink(const char *arg, int stable, void *arg2) {
+	cfuopt_argv_source *src = (cfuopt_argv_source *)arg2;
+	stable = stable;
+	src->args[src->num_left++] = (char *)arg;
+	return 0;
+}
+
+/* With response files, the leftover arguments go into an array owned
+   by the context, and those read from files are copied into its arena.
+*/
+static int
+_context_sink(const char *arg, int stable, void *arg2) {
+	cfuopt_t *context = (cfuopt_t *)arg2;
+
+	if (context->num_args + 1 >= context->args_alloc) {
+		context->args_alloc = context->args_alloc ? context->args_alloc * 2 : 64;
+		context->args = realloc(context->args, context->args_alloc * sizeof(char *));
+	}
+	if (!stable) arg = cfuarena_strndup(context->arena, arg, strlen(arg));
+	context->args[context->num_args++] = (char *)arg;
+
+	return 0;
+}
+
+int
+cfuopt_parse_with_flags(cfuopt_t *context, unsigned int flags, int *argc, char ***argv,
+	char **error) {
+	cfuopt_argv_source src;
+	cfuopt_reader r;
+	char **args = *argv;
+	int rv = 0;
+
+	if (!context) return 0;
+	if (*argc < 1) return 0;
+
+	free(context->progname);
+	context->progname = cfustring_dup_c_str(args[0]);
+
+	memset(&r, 0, sizeof(r));
+	r.next_fn = _argv_next;
+	r.next_arg = &src;
+	r.stable = 1;
+	r.flags = flags;
+	r.error = error;
+
+	src.args = args;
+	src.argc = *argc;
+	src.i = 1;
+	src.num_left = 1;
+
+	if (!(flags & CFUOPT_RESPONSE_FILES)) {
+		rv = _parse_args(context, &r, _argv_sink, &src);
+		*argc = src.num_left;
+		return rv;
+	}
+
+	if (!context->arena) context->arena = cfuarena_new(0);
+	context->num_args = 0;
+	_context_sink(args[0], 1, context);
+	rv = _parse_args(context, &r, _context_sink, context);
+	context->args[context->num_args] = NULL;
+
+	*argc = (int)context->num_args;
+	*argv = context->args;
+
+	return rv;
+}
+
+void
+cfuopt_parse(cfuopt_t *context, int *argc, char ***argv, char **error) {
+	cfuopt_parse_with_flags(context, 0, argc, argv, error);
+}
+
+typedef struct cfuopt_callback_sink {
+	cfuopt_extra_fn_t fn;
+	void *arg;
+} cfuopt_callback_sink;
+
+static int
+_callback_sink(const char *arg, int stable, void *arg2) {
+	cfuopt_callback_sink *sink = (cfuopt_callback_sink *)arg2;
+	stable = stable;
+	return sink->fn(arg, sink->arg);
+}
+
+int
+cfuopt_parse_source(cfuopt_t *context, unsigned int flags, cfuopt_source_fn_t next_fn,
+	void *next_arg, cfuopt_extra_fn_t extra_fn, void *extra_arg, char **error) {
+	cfuopt_callback_sink sink;
+	cfuopt_reader r;
+
+	if (!context || !next_fn || !extra_fn) return -1;
+
+	memset(&r, 0, sizeof(r));
+	r.next_fn = next_fn;
+	r.next_arg = next_arg;
+	r.flags = flags;
+	r.error = error;
+
+	sink.fn = extra_fn;
+	sink.arg = extra_arg;
+
+	return _parse_args(context, &r, _callback_sink, &sink);
+}
+
+/* Static option tables.  Each spec is scanned in place, and the names
+   are entered in a small open-addressing table on the stack, so
+   parsing allocates nothing.  Tables with more names than fit fall
+   back to scanning the specs.
+*/
+
+#define CFUOPT_STATIC_SLOTS 256
+
+typedef struct cfuopt_static_spec {
+	size_t names_len; /* length of the "name|name" part */
+	cfuopt_arg_t arg_type;
+	int required;
+} cfuopt_static_spec;
+
+typedef struct cfuopt_static_slot {
+	const char *name;
+	size_t len;
+	const cfuopt_static_entry_t *entry;
+} cfuopt_static_slot;
+
+/* Same rules as parse_opt_str(), without modifying opt_str */
+static void
+_parse_static_spec(const char *opt_str, cfuopt_static_spec *spec) {
+	const char *last = strrchr(opt_str, '|');
+	const char *pos = NULL;
+
+	last = last ? last + 1 : opt_str;
+	spec->names_len = strlen(opt_str);
+	spec->arg_type = cfuopt_arg_invalid;
+	spec->required = 0;
+
+	if ( (pos = strchr(last, '=')) ) {
+		spec->required = 1;
+		CFUOPT_SET_TYPE(pos[1], spec->arg_type);
+	} else if ( (pos = strchr(last, ':')) ) {
+		CFUOPT_SET_TYPE(pos[1], spec->arg_type);
+	} else if ( (pos = strchr(last, '!')) ) {
+		spec->arg_type = cfuopt_arg_bool;
+	}
+
+	if (pos) spec->names_len = pos - opt_str;
+}
+
+static int
+_static_name_matches(const char *names, size_t names_len, const char *name, size_t len) {
+	const char *end = names + names_len;
+	const char *name_end = NULL;
+
+	while (names < end) {
+		for (name_end = names; name_end < end && *name_end != '|'; name_end++);
+		if ((size_t)(name_end - names) == len && !memcmp(names, name, len)) return 1;
+		names = name_end + 1;
+	}
+
+	return 0;
+}
+
+static void
+_static_slot_insert(cfuopt_static_slot *slots, const char *name, size_t len,
+	const cfuopt_static_entry_t *entry) {
+	size_t i = cfuhash_one_at_a_time_hash(name, len) & (CFUOPT_STATIC_SLOTS - 1);
+
+	while (slots[i].name) {
+		/* the first entry with a name wins, as with a linear scan */
+		if (slots[i].len == len && !memcmp(slots[i].name, name, len)) return;
+		i = (i + 1) & (CFUOPT_STATIC_SLOTS - 1);
+	}
+	slots[i].name = name;
+	slots[i].len = len;
+	slots[i].entry = entry;
+}
+
+/* Returns the number of names in the table, or -1 if there are too
+   many for the slots to stay sparse.
+*/
+static long
+_static_fill_slots(const cfuopt_static_entry_t *table, cfuopt_static_slot *slots) {
+	const cfuopt_static_entry_t *entry = NULL;
+	cfuopt_static_spec spec;
+	const char *names = NULL;
+	const char *end = NULL;
+	const char *name_end = NULL;
+	long num_names = 0;
+
+	memset(slots, 0, CFUOPT_STATIC_SLOTS * sizeof(cfuopt_static_slot));
+
+	for (entry = table; entry->opt_str; entry++) {
+		_parse_static_spec(entry->opt_str, &spec);
+		names = entry->opt_str;
+		end = names + spec.names_len;
+		while (names < end) {
+			for (name_end = names; name_end < end && *name_end != '|'; name_end++);
+			if (++num_names > CFUOPT_STATIC_SLOTS / 2) return -1;
+			_static_slot_insert(slots, names, name_end - names, entry);
+			names = name_end + 1;
+		}
+	}
+
+	return num_names;
+}
 
+static const cfuopt_static_entry_t *
+_static_lookup(const cfuopt_static_entry_t *table, cfuopt_static_slot *slots, int use_slots,
+	const char *name, size_t len) {
+	const cfuopt_static_entry_t *entry = NULL;
+	cfuopt_static_spec spec;
+	size_t i = 0;
+
+	if (use_slots) {
+		i = cfuhash_one_at_a_time_hash(name, len) & (CFUOPT_STATIC_SLOTS - 1);
+		for (; slots[i].name; i = (i + 1) & (CFUOPT_STATIC_SLOTS - 1)) {
+			if (slots[i].len == len && !memcmp(slots[i].name, name, len)) {
+				return slots[i].entry;
+			}
+		}
+		return NULL;
 	}
 
-	extra_count = cfulist_num_entries(context->extra);
-	*argc = extra_count + 1;
-	{
-		_update_extra_ds ds;
-		size_t update_count = 0;
-		ds.count = 1;
-		ds.argv = args;
-		update_count = cfulist_foreach(context->extra, _update_extra, (void *)&ds);
-		assert(update_count + 1 == (unsigned)*argc);
+	for (entry = table; entry->opt_str; entry++) {
+		_parse_static_spec(entry->opt_str, &spec);
+		if (_static_name_matches(entry->opt_str, spec.names_len, name, len)) return entry;
 	}
+
+	return NULL;
+}
+
+static void
+_set_static_val(cfuopt_arg_t arg_type, void *arg_data, const char *value) {
+	if (!arg_data) return;
+
+	switch (arg_type) {
+	  case cfuopt_arg_bool:
+		  *((int *)arg_data) = 1;
+		  break;
+	  case cfuopt_arg_int:
+		  *((int *)arg_data) = atol(value);
+		  break;
+	  case cfuopt_arg_float:
+		  *((double *)arg_data) = atof(value);
+		  break;
+	  case cfuopt_arg_string:
+		  *((const char **)arg_data) = value;
+		  break;
+	  case cfuopt_arg_invalid:
+	  case cfuopt_arg_string_array:
+	  default:
+		  break;
+	}
+}
+
+int
+cfuopt_parse_static(const cfuopt_static_entry_t *table, int *argc, char ***argv,
+	char **error) {
+	cfuopt_static_slot slots[CFUOPT_STATIC_SLOTS];
+	const cfuopt_static_entry_t *entry = NULL;
+	cfuopt_static_spec spec;
+	char **args = *argv;
+	const char *name = NULL;
+	const char *value = NULL;
+	size_t len = 0;
+	int use_slots = 0;
+	int num_extra = 1;
+	int i = 0;
+
+	if (!table || *argc < 2) return 0;
+
+	use_slots = _static_fill_slots(table, slots) >= 0;
+
+	for (i = 1; i < *argc; i++) {
+		name = args[i];
+
+		/* data, including "-" on its own, is kept in place */
+		if (name[0] != '-' || name[1] == '\000') {
+			args[num_extra++] = args[i];
+			continue;
+		}
+		if (name[1] == '-' && name[2] == '\000') {
+			for (i++; i < *argc; i++) args[num_extra++] = args[i];
+			break;
+		}
+
+		value = NULL;
+		if (name[1] == '-') {
+			name += 2;
+			for (len = 0; name[len] && name[len] != '='; len++);
+			if (name[len] == '=') value = name + len + 1;
+		} else {
+			name++;
+			len = strlen(name);
+		}
+
+		if ( !(entry = _static_lookup(table, slots, use_slots, name, len)) ) {
+			if (error) *error = cfustring_sprintf_c_str("cfuopt: unknown option %s\n", args[i]);
+			return -1;
+		}
+
+		_parse_static_spec(entry->opt_str, &spec);
+		switch (spec.arg_type) {
+		  case cfuopt_arg_bool:
+			  _set_static_val(spec.arg_type, entry->arg_data, "1");
+			  break;
+		  case cfuopt_arg_string:
+		  case cfuopt_arg_int:
+		  case cfuopt_arg_float:
+			  if (!value && i + 1 < *argc
+				  && (args[i + 1][0] != '-' || args[i + 1][1] == '\000')) {
+				  value = args[++i];
+			  }
+			  if (value) {
+				  _set_static_val(spec.arg_type, entry->arg_data, value);
+			  } else if (spec.required) {
+				  if (error) {
+					  *error = cfustring_sprintf_c_str("cfuopt: option %s requires a value\n",
+						  args[i]);
+				  }
+				  return -1;
+			  }
+			  break;
+		  default:
+			  break;
+		}
+	}
+
+	*argc = num_extra;
+
+	return 0;
 }
 
 static void
@@ -425,8 +839,10 @@ cfuopt_destroy(cfuopt_t *context) {
 	if (!context) return;
 	cfulist_destroy_with_free_fn(context->option_list, _opt_list_free_fn);
 	cfuhash_destroy(context->option_map);
-	cfulist_destroy(context->extra);
 	free(context->progname);
+	free(context->name_buf);
+	free(context->args);
+	cfuarena_destroy(context->arena);
 	free(context);
 }
 
@@ -624,3 +1040,23 @@ cfuopt_get_help_str(cfuopt_t *context) {
 
 	return help_str;
 }
+
+char *
+cfuopt_get_help_str_static(const cfuopt_static_entry_t *table) {
+	const cfuopt_static_entry_t *entry = NULL;
+	cfuopt_t *context = NULL;
+	char *help_str = NULL;
+
+	/* help is not on a hot path, so the formatting is shared by
+	   going through a throwaway context
+	*/
+	context = cfuopt_new();
+	for (entry = table; entry->opt_str; entry++) {
+		cfuopt_add_entry(context, entry->opt_str, entry->arg_data, entry->description,
+			entry->arg_description);
+	}
+	help_str = cfuopt_get_help_str(context);
+	cfuopt_destroy(context);
+
+	return help_str;
+}
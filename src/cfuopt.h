@@ -56,6 +56,43 @@ void cfuopt_add_entry(cfuopt_t *context, const char *opt_str, void *arg_data,
  */
 void cfuopt_parse(cfuopt_t *context, int *argc, char ***argv, char **error);
 
+/* Valid flags for cfuopt_parse_with_flags() and cfuopt_parse_source() */
+#define CFUOPT_RESPONSE_FILES 1 /* expand @file arguments */
+
+/* Same as cfuopt_parse(), but with flags.  With CFUOPT_RESPONSE_FILES,
+ * an argument of the form @file is replaced by the arguments in file,
+ * which are separated by whitespace and may be quoted with single or
+ * double quotes; a backslash escapes the next character.  Response
+ * files may name other response files.  An @file that cannot be opened
+ * is kept as is, and no expansion happens after "--".  Since the
+ * arguments may then outnumber the original ones, argv is set to an
+ * array owned by the context, which stays valid until
+ * cfuopt_destroy().  Returns zero on success, less than zero on error.
+ */
+int cfuopt_parse_with_flags(cfuopt_t *context, unsigned int flags, int *argc, char ***argv,
+	char **error);
+
+/* Called by cfuopt_parse_source() for the next argument.  Returns
+ * NULL when there are no more.  The string must stay valid until the
+ * next call.
+ */
+typedef const char * (*cfuopt_source_fn_t)(void *arg);
+
+/* Called by cfuopt_parse_source() for each argument that is not an
+ * option, or the value of one.  The string is only valid for the
+ * duration of the call.  A non-zero return value stops the parse.
+ */
+typedef int (*cfuopt_extra_fn_t)(const char *value, void *arg);
+
+/* Same as cfuopt_parse_with_flags(), but read the arguments, not
+ * including the program name, one at a time from next_fn, and pass
+ * those left over to extra_fn as they are found instead of collecting
+ * them.  Any number of arguments can be processed this way in constant
+ * memory.
+ */
+int cfuopt_parse_source(cfuopt_t *context, unsigned int flags, cfuopt_source_fn_t next_fn,
+	void *next_arg, cfuopt_extra_fn_t extra_fn, void *extra_arg, char **error);
+
 /* Returns a help string built from the entries added with
  * cfuopt_add_entry().
  */
@@ -64,6 +101,41 @@ char * cfuopt_get_help_str(cfuopt_t *context);
 /* Frees up resources used by the option parser. */
 void cfuopt_destroy(cfuopt_t *context);
 
+/* An option declared at compile time, with the same fields as the
+ * arguments to cfuopt_add_entry().  A table of them, ended by
+ * CFUOPT_END, can be parsed without creating a context, e.g.,
+ *
+ *	static const cfuopt_static_entry_t options[] = {
+ *		CFUOPT_ENTRY("verbose|v!", &verbose, "Verbosity", ""),
+ *		CFUOPT_ENTRY("file|f:s", &file, "File to load", "FILE"),
+ *		CFUOPT_END
+ *	};
+ */
+typedef struct cfuopt_static_entry {
+	const char *opt_str;
+	void *arg_data;
+	const char *description;
+	const char *arg_description;
+} cfuopt_static_entry_t;
+
+#define CFUOPT_ENTRY(opt_str, arg_data, description, arg_description) \
+	{ (opt_str), (arg_data), (description), (arg_description) }
+#define CFUOPT_END { NULL, NULL, NULL, NULL }
+
+/* Same as cfuopt_parse(), but for a table of static entries, and
+ * without allocating any memory: the option names are looked up in
+ * place, and string values are set to point into argv instead of
+ * being copied.  Unlike cfuopt_parse(), an unknown option or a missing
+ * required value is an error.  Returns zero on success, less than zero
+ * on error, in which case error, if not NULL, is set to a message that
+ * must be free()'d by the caller.
+ */
+int cfuopt_parse_static(const cfuopt_static_entry_t *table, int *argc, char ***argv,
+	char **error);
+
+/* Same as cfuopt_get_help_str(), but for a table of static entries */
+char * cfuopt_get_help_str_static(const cfuopt_static_entry_t *table);
+
 CFU_END_DECLS
 
 #endif
@@ -0,0 +1,412 @@
+/*
+ * cfusettings.c - This file is part of the libcfu library
+ *
+ * Copyright (c) 2005 Don Owens. All rights reserved.
+ *
+ * This code is released under the BSD license:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   * Neither the name of the author nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "cfu.h"
+#include "cfusettings.h"
+#include "cfuhash.h"
+#include "cfustring.h"
+#include "cfuarena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+typedef struct cfusettings_entry {
+	/* declaration, copied into the arena */
+	const char *name;
+	unsigned int type;
+	const char *opt_names;
+	const char *env_var;
+	const char *conf_path;
+	const char *default_value;
+	const char *description;
+	const char *arg_description;
+
+	/* filled in by cfuopt */
+	char *opt_value;
+	int opt_flag;
+	int opt_off_flag; /* from the no- form of a bool option */
+
+	/* resolved value */
+	int source;
+	const char *value;
+	long int_value;
+	double float_value;
+} cfusettings_entry;
+
+struct cfusettings {
+	libcfu_type type;
+	cfusettings_entry *entries;
+	size_t num_entries;
+	size_t entries_alloc;
+	cfuhash_table_t *names; /* name -> handle + 1 */
+	cfuarena_t *arena;
+	int frozen; /* no more settings may be added */
+	int resolved;
+};
+
+cfusettings_t *
+cfusettings_new(void) {
+	cfusettings_t *settings = calloc(1, sizeof(cfusettings_t));
+
+	settings->arena = cfuarena_new(0);
+	settings->names = cfuhash_new_in_arena(settings->arena, 0);
+
+	return settings;
+}
+
+static const char *
+_arena_dup(cfuarena_t *arena, const char *str) {
+	if (!str) return NULL;
+	return cfuarena_strndup(arena, str, strlen(str));
+}
+
+long
+cfusettings_add(cfusettings_t *settings, const char *name, unsigned int type,
+	const char *opt_names, const char *env_var, const char *conf_path,
+	const char *default_value, const char *description, const char *arg_description) {
+	cfusettings_entry *entry = NULL;
+	long handle = 0;
+
+	if (!settings || !name || settings->frozen || type > CFUSETTINGS_BOOL) return -1;
+	if (cfuhash_exists(settings->names, name)) return -1;
+
+	if (settings->num_entries == settings->entries_alloc) {
+		settings->entries_alloc = settings->entries_alloc ? settings->entries_alloc * 2 : 16;
+		settings->entries = realloc(settings->entries,
+			settings->entries_alloc * sizeof(cfusettings_entry));
+	}
+
+	handle = (long)settings->num_entries++;
+	entry = &settings->entries[handle];
+	memset(entry, 0, sizeof(*entry));
+	entry->name = _arena_dup(settings->arena, name);
+	entry->type = type;
+	entry->opt_names = _arena_dup(settings->arena, opt_names);
+	entry->env_var = _arena_dup(settings->arena, env_var);
+	entry->conf_path = _arena_dup(settings->arena, conf_path);
+	entry->default_value = _arena_dup(settings->arena, default_value);
+	entry->description = _arena_dup(settings->arena, description);
+	entry->arg_description = _arena_dup(settings->arena, arg_description);
+
+	cfuhash_put(settings->names, name, (void *)(size_t)(handle + 1));
+
+	return handle;
+}
+
+/* Returns a malloc()'d copy of names followed by suffix */
+static char *
+_opt_str(const char *names, const char *suffix) {
+	size_t len = strlen(names);
+	size_t suffix_len = strlen(suffix);
+	char *str = malloc(len + suffix_len + 1);
+
+	memcpy(str, names, len);
+	memcpy(str + len, suffix, suffix_len + 1);
+
+	return str;
+}
+
+/* Returns a malloc()'d "no-" form of each long name in names, with
+   suffix, or NULL if there are only short names.
+*/
+static char *
+_negated_opt_str(const char *names, const char *suffix) {
+	size_t len = strlen(names);
+	size_t suffix_len = strlen(suffix);
+	const char *name = names;
+	const char *end = NULL;
+	char *str = malloc(len * 2 + suffix_len + 4);
+	size_t used = 0;
+
+	for (; *name; name = *end ? end + 1 : end) {
+		for (end = name; *end && *end != '|'; end++);
+		if (end - name < 2) continue;
+		if (used) str[used++] = '|';
+		memcpy(str + used, "no-", 3);
+		memcpy(str + used + 3, name, end - name);
+		used += 3 + (end - name);
+	}
+	if (!used) {
+		free(str);
+		return NULL;
+	}
+	memcpy(str + used, suffix, suffix_len + 1);
+
+	return str;
+}
+
+/* Returns a copy of a followed by b, allocated from arena */
+static const char *
+_arena_concat(cfuarena_t *arena, const char *a, const char *b) {
+	size_t a_len = strlen(a);
+	size_t b_len = strlen(b);
+	char *str = cfuarena_alloc(arena, a_len + b_len + 1);
+
+	memcpy(str, a, a_len);
+	memcpy(str + a_len, b, b_len + 1);
+
+	return str;
+}
+
+void
+cfusettings_add_options(cfusettings_t *settings, cfuopt_t *context) {
+	cfusettings_entry *entry = NULL;
+	char *opt_str = NULL;
+	size_t i = 0;
+
+	if (!settings || !context) return;
+
+	/* cfuopt keeps pointers into the entries, so they may not move */
+	settings->frozen = 1;
+
+	for (i = 0; i < settings->num_entries; i++) {
+		entry = &settings->entries[i];
+		if (!entry->opt_names) continue;
+
+		if (entry->type == CFUSETTINGS_BOOL) {
+			opt_str = _opt_str(entry->opt_names, "!");
+			cfuopt_add_entry(context, opt_str, &entry->opt_flag,
+				entry->description ? entry->description : "", "");
+			free(opt_str);
+
+			/* so that the command line can also turn off a setting
+			   that the environment or conf turned on
+			*/
+			if ( (opt_str = _negated_opt_str(entry->opt_names, "!")) ) {
+				cfuopt_add_entry(context, opt_str, &entry->opt_off_flag,
+					_arena_concat(settings->arena, "Turn off: ",
+						entry->description ? entry->description : entry->name), "");
+			}
+		} else {
+			opt_str = _opt_str(entry->opt_names, "=s");
+			cfuopt_add_entry(context, opt_str, &entry->opt_value,
+				entry->description ? entry->description : "",
+				entry->arg_description ? entry->arg_description : "");
+		}
+		free(opt_str);
+	}
+}
+
+/* Parses the value found for entry according to its type */
+static int
+_parse_value(cfusettings_entry *entry, const char *value) {
+	char *end = NULL;
+
+	switch (entry->type) {
+	case CFUSETTINGS_INT:
+		errno = 0;
+		entry->int_value = strtol(value, &end, 0);
+		if (end == value || *end || errno == ERANGE) return -1;
+		entry->float_value = (double)entry->int_value;
+		break;
+	case CFUSETTINGS_FLOAT:
+		errno = 0;
+		entry->float_value = strtod(value, &end);
+		if (end == value || *end || errno == ERANGE) return -1;
+		entry->int_value = (long)entry->float_value;
+		break;
+	case CFUSETTINGS_BOOL:
+		if (cfuconf_parse_bool(value, &entry->int_value) < 0) return -1;
+		entry->float_value = (double)entry->int_value;
+		break;
+	case CFUSETTINGS_STRING:
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static const char *
+_source_name(int source) {
+	switch (source) {
+	case CFUSETTINGS_FROM_OPT:
+		return "the command line";
+	case CFUSETTINGS_FROM_ENV:
+		return "the environment";
+	case CFUSETTINGS_FROM_CONF:
+		return "the configuration";
+	default:
+		return "the default";
+	}
+}
+
+int
+cfusettings_resolve(cfusettings_t *settings, cfuconf_t *conf, char **error) {
+	cfuconf_index_t *index = NULL;
+	cfusettings_entry *entry = NULL;
+	const char *value = NULL;
+	char *conf_value = NULL;
+	size_t i = 0;
+	int rv = 0;
+
+	if (!settings || settings->resolved) return -1;
+
+	settings->frozen = 1;
+	if (conf) index = cfuconf_index_new(conf);
+
+	for (i = 0; i < settings->num_entries; i++) {
+		entry = &settings->entries[i];
+		value = NULL;
+
+		if (entry->type == CFUSETTINGS_BOOL && entry->opt_off_flag) {
+			/* the no- form wins when both are given */
+			value = "0";
+			entry->source = CFUSETTINGS_FROM_OPT;
+		} else if (entry->type == CFUSETTINGS_BOOL && entry->opt_flag) {
+			value = "1";
+			entry->source = CFUSETTINGS_FROM_OPT;
+		} else if (entry->opt_value) {
+			value = entry->opt_value;
+			entry->source = CFUSETTINGS_FROM_OPT;
+		} else if (entry->env_var && (value = getenv(entry->env_var))) {
+			entry->source = CFUSETTINGS_FROM_ENV;
+		} else if (index && entry->conf_path
+			&& cfuconf_index_get_one_arg(index, entry->conf_path, &conf_value) == 0) {
+			value = conf_value;
+			entry->source = CFUSETTINGS_FROM_CONF;
+		} else if ( (value = entry->default_value) ) {
+			entry->source = CFUSETTINGS_FROM_DEFAULT;
+		}
+
+		if (!value) continue;
+
+		if (_parse_value(entry, value) < 0) {
+			if (error) {
+				*error = cfustring_sprintf_c_str("cfusettings: invalid value \"%s\" for %s "
+					"from %s\n", value, entry->name, _source_name(entry->source));
+			}
+			rv = -1;
+			break;
+		}
+		entry->value = value == entry->default_value ? value
+			: _arena_dup(settings->arena, value);
+	}
+
+	if (index) cfuconf_index_destroy(index);
+
+	/* the option values have been copied */
+	for (i = 0; i < settings->num_entries; i++) {
+		free(settings->entries[i].opt_value);
+		settings->entries[i].opt_value = NULL;
+	}
+
+	if (rv < 0) {
+		for (i = 0; i < settings->num_entries; i++) {
+			settings->entries[i].source = CFUSETTINGS_UNSET;
+			settings->entries[i].value = NULL;
+			settings->entries[i].int_value = 0;
+			settings->entries[i].float_value = 0;
+		}
+		return rv;
+	}
+
+	settings->resolved = 1;
+
+	return 0;
+}
+
+long
+cfusettings_lookup(cfusettings_t *settings, const char *name) {
+	size_t handle = 0;
+
+	if (!settings || !name) return -1;
+	handle = (size_t)cfuhash_get(settings->names, name);
+
+	return (long)handle - 1;
+}
+
+/* Returns the resolved entry for handle, or NULL */
+static cfusettings_entry *
+_get_entry(cfusettings_t *settings, long handle) {
+	if (!settings || !settings->resolved || handle < 0
+		|| (size_t)handle >= settings->num_entries) {
+		return NULL;
+	}
+	return &settings->entries[handle];
+}
+
+int
+cfusettings_source(cfusettings_t *settings, long handle) {
+	cfusettings_entry *entry = _get_entry(settings, handle);
+	return entry ? entry->source : CFUSETTINGS_UNSET;
+}
+
+const char *
+cfusettings_get_str(cfusettings_t *settings, long handle) {
+	cfusettings_entry *entry = _get_entry(settings, handle);
+	return entry ? entry->value : NULL;
+}
+
+long
+cfusettings_get_int(cfusettings_t *settings, long handle) {
+	cfusettings_entry *entry = _get_entry(settings, handle);
+	return entry ? entry->int_value : 0;
+}
+
+double
+cfusettings_get_float(cfusettings_t *settings, long handle) {
+	cfusettings_entry *entry = _get_entry(settings, handle);
+	return entry ? entry->float_value : 0;
+}
+
+int
+cfusettings_get_bool(cfusettings_t *settings, long handle) {
+	cfusettings_entry *entry = _get_entry(settings, handle);
+	return entry ? entry->int_value != 0 : 0;
+}
+
+void
+cfusettings_destroy(cfusettings_t *settings) {
+	size_t i = 0;
+
+	if (!settings) return;
+
+	for (i = 0; i < settings->num_entries; i++) {
+		free(settings->entries[i].opt_value);
+	}
+	free(settings->entries);
+	cfuhash_destroy(settings->names);
+	cfuarena_destroy(settings->arena);
+	free(settings);
+}
@@ -0,0 +1,137 @@
+/*
+ * cfusettings.h - This file is part of the libcfu library
+ *
+ * Copyright (c) 2005 Don Owens. All rights reserved.
+ *
+ * This code is released under the BSD license:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   * Neither the name of the author nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cfu.h>
+#include <cfuopt.h>
+#include <cfuconf.h>
+
+#ifndef CFU_SETTINGS_H_
+#define CFU_SETTINGS_H_
+
+CFU_BEGIN_DECLS
+
+/* Settings that may come from the command line, the environment, a
+ * conf tree or a default, in that order of precedence.  Each setting
+ * is declared once, then all of them are resolved once at startup
+ * into an immutable table.  Settings are referred to by the handle
+ * returned when they are declared, so looking one up afterwards is an
+ * array access instead of a string lookup, and may be done from
+ * several threads at once.
+ *
+ *	cfusettings_t *settings = cfusettings_new();
+ *	long port = cfusettings_add(settings, "port", CFUSETTINGS_INT, "port|p",
+ *		"MYAPP_PORT", "Server//Port", "8080", "Port to listen on", "PORT");
+ *	cfusettings_add_options(settings, opt);
+ *	cfuopt_parse(opt, &argc, &argv, &error);
+ *	if (cfusettings_resolve(settings, conf, &error) < 0) ...
+ *	listen_on(cfusettings_get_int(settings, port));
+ */
+typedef struct cfusettings cfusettings_t;
+
+/* Types of settings */
+#define CFUSETTINGS_STRING 0
+#define CFUSETTINGS_INT 1
+#define CFUSETTINGS_FLOAT 2
+#define CFUSETTINGS_BOOL 3 /* on/off, yes/no, true/false or 1/0 */
+
+/* Where a resolved setting came from */
+#define CFUSETTINGS_UNSET 0
+#define CFUSETTINGS_FROM_DEFAULT 1
+#define CFUSETTINGS_FROM_CONF 2
+#define CFUSETTINGS_FROM_ENV 3
+#define CFUSETTINGS_FROM_OPT 4
+
+/* Returns a new, empty set of settings */
+cfusettings_t * cfusettings_new(void);
+
+/* Declare a setting.  opt_names is the option name or names, as in
+ * cfuopt_add_entry() but without the type, e.g., "port|p"; env_var is
+ * the environment variable; conf_path is the directive path, as for
+ * cfuconf_index_t.  Any of these, and default_value, may be NULL.
+ * Boolean options are flags, each with a "no-" form of its long names
+ * to turn it off, e.g., --verbose and --no-verbose; if both are given,
+ * the "no-" form wins.  description and arg_description are
+ * passed on to cfuopt_add_entry().  Returns a handle for the setting,
+ * or -1 if the name is already taken or the settings can no longer be
+ * added to.
+ */
+long cfusettings_add(cfusettings_t *settings, const char *name, unsigned int type,
+	const char *opt_names, const char *env_var, const char *conf_path,
+	const char *default_value, const char *description, const char *arg_description);
+
+/* Add an option to context for each setting that has option names.
+ * No settings may be declared afterwards.  The context must be parsed
+ * before calling cfusettings_resolve().
+ */
+void cfusettings_add_options(cfusettings_t *settings, cfuopt_t *context);
+
+/* Resolve every setting from its sources, with conf, which may be
+ * NULL, as the conf tree.  Values are copied, so conf and the option
+ * context may be destroyed afterwards.  After this, the settings are
+ * read-only.  Returns zero on success, less than zero if a value
+ * cannot be parsed as the type of its setting, in which case error,
+ * if not NULL, is set to a message that must be free()'d by the
+ * caller.
+ */
+int cfusettings_resolve(cfusettings_t *settings, cfuconf_t *conf, char **error);
+
+/* Returns the handle of the setting with the given name, or -1 */
+long cfusettings_lookup(cfusettings_t *settings, const char *name);
+
+/* Returns the source of the value of a resolved setting */
+int cfusettings_source(cfusettings_t *settings, long handle);
+
+/* Returns the value of a resolved setting as a string, or NULL if it
+ * is unset.
+ */
+const char * cfusettings_get_str(cfusettings_t *settings, long handle);
+
+/* Returns the value of a resolved setting, or zero if it is unset */
+long cfusettings_get_int(cfusettings_t *settings, long handle);
+
+/* Returns the value of a resolved setting, or zero if it is unset */
+double cfusettings_get_float(cfusettings_t *settings, long handle);
+
+/* Returns the value of a resolved setting, or zero if it is unset */
+int cfusettings_get_bool(cfusettings_t *settings, long handle);
+
+/* Free all resources used by the settings */
+void cfusettings_destroy(cfusettings_t *settings);
+
+CFU_END_DECLS
+
+#endif
@@ -35,137 +35,2049 @@
  * OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+/* for CPU_SET() and sched_getcpu() */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE 1
+#endif
+
 #include "cfuthread_queue.h"
-#include "cfulist.h"
+#include "cfuatomic.h"
 
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(HAVE_SCHED_GETAFFINITY) \
+	&& defined(HAVE_SCHED_GETCPU)
+# include <sched.h>
+# include <dirent.h>
+# define CFUTHREAD_USE_AFFINITY 1
+#endif
+
+#if defined(HAVE_ATOMIC_BUILTINS) && defined(HAVE_LINUX_FUTEX_H) && defined(HAVE_SYS_SYSCALL_H)
+# include <linux/futex.h>
+# include <sys/syscall.h>
+# include <limits.h>
+# ifdef SYS_futex
+#  define CFUTHREAD_USE_FUTEX 1
+# endif
+#endif
+
+/* A request doubles as the future handed out by
+   cfuthread_queue_submit().  It is recycled when both the worker and
+   the submitter have released it.  Requests posted with
+   cfuthread_queue_post() have nobody waiting on them and are
+   released by the worker alone.
+
+   Completion is signaled through state: CFUTHREAD_ENTRY_PENDING,
+   then CFUTHREAD_ENTRY_DONE, or CFUTHREAD_ENTRY_CANCELED if the
+   queue was shut down before the request could run.  With futexes, a waiter about to sleep
+   first moves state to CFUTHREAD_ENTRY_SLEEPING so the worker knows
+   it has to make the wake-up system call.  Elsewhere state is
+   protected by the mutex/condition variable pair, which is only set
+   up the first time the entry gets a waiter.
+*/
+#define CFUTHREAD_ENTRY_PENDING 0
+#define CFUTHREAD_ENTRY_DONE 1
+#define CFUTHREAD_ENTRY_SLEEPING 2
+#define CFUTHREAD_ENTRY_CANCELED 3
+
+typedef struct cfuthread_queue_entry {
+	struct cfuthread_queue_entry *next;
+	int state;
+	int refs;
+#ifndef CFUTHREAD_USE_FUTEX
+	int sync_init;
+	pthread_mutex_t mutex;
+	pthread_cond_t cv;
+#endif
+	cfuthread_queue_t *tq;
+	int priority;
+	uint64_t queued_ns; /* with CFUTHREAD_QUEUE_STATS */
+	size_t depth;       /* requests ahead of this one when queued */
+	void *data_in;
+	void *data_out;
+	cfuthread_queue_callback_t callback;
+	void *callback_arg;
+} cfuthread_queue_entry;
+
+/* Released entries are kept in a small per-thread cache instead of
+   being freed, so a steady stream of requests does not go through
+   malloc() and, without futexes, pthread_mutex_init() each time.
+   Posted requests are released by the worker, not the thread that
+   made them, so once a worker's cache is full it hands entries back
+   through a freelist on the queue, which threads with an empty cache
+   take whole.  Taking the whole list with an exchange, rather than
+   popping single entries, keeps the lock-free list safe from ABA.
+*/
+#define CFUTHREAD_ENTRY_CACHE_SIZE 64
+#define CFUTHREAD_QUEUE_FREELIST_SIZE 1024
+
+typedef struct cfuthread_entry_cache {
+	cfuthread_queue_entry *head;
+	size_t num_entries;
+} cfuthread_entry_cache;
+
+/* Work-stealing deque (Chase and Lev, "Dynamic Circular Work-Stealing
+   Deque", using the memory orderings from Le et al., "Correct and
+   Efficient Work-Stealing for Weak Memory Models").  The owning
+   worker pushes and takes at the bottom, other workers steal from
+   the top.  Arrays replaced when the deque grows are kept on the
+   prev chain until the deque is freed, since a thief may still be
+   reading from them.
+*/
+typedef struct cfuthread_deque_array {
+	long size; /* always a power of 2 */
+	void **buf;
+	struct cfuthread_deque_array *prev;
+} cfuthread_deque_array;
+
+typedef struct cfuthread_deque {
+	long top;
+	long bottom;
+	cfuthread_deque_array *array;
+} cfuthread_deque;
+
+#define CFUTHREAD_DEQUE_INITIAL_SIZE 256
+
+/* Each worker keeps its own statistics.  Only the worker writes
+   them, so they are updated without a lock or read-modify-write
+   atomics; readers may see a request counted in some fields and not
+   yet in others.
+*/
+typedef struct cfuthread_worker_stats {
+	uint64_t num_requests;
+	uint64_t wait_ns;
+	uint64_t exec_ns;
+	uint64_t wait_hist[CFUTHREAD_QUEUE_STATS_BUCKETS];
+	uint64_t exec_hist[CFUTHREAD_QUEUE_STATS_BUCKETS];
+	uint64_t depth_hist[CFUTHREAD_QUEUE_STATS_BUCKETS];
+} cfuthread_worker_stats;
+
+/* Workers allocate their own state once they are running, so that
+   with pinned workers it ends up on the worker's NUMA node.
+*/
+typedef struct cfuthread_worker {
+	cfuthread_queue_t *tq;
+	size_t index;
+	int cpu;  /* -1 if not pinned */
+	int node;
+	unsigned int seed;
+	cfuthread_deque deque;
+	cfuthread_worker_stats stats;
+	uint64_t nested_ns; /* time spent in requests run inside the current one */
+} cfuthread_worker;
+
+/* FIFO of requests linked through their next pointers */
+typedef struct cfuthread_fifo {
+	cfuthread_queue_entry *head;
+	cfuthread_queue_entry *tail;
+	size_t num_entries;
+} cfuthread_fifo;
+
+/* With CFUTHREAD_QUEUE_NODE_ROUTING, requests from outside the
+   workers go to the inbox of the submitter's NUMA node, which that
+   node's workers check before stealing from other workers.
+*/
+typedef struct cfuthread_node {
+	pthread_mutex_t mutex;
+	cfuthread_fifo inbox;
+	long num_entries; /* inbox.num_entries, for reading without the mutex */
+} cfuthread_node;
+
+/* upper bound on NUMA node numbers read from sysfs */
+#define CFUTHREAD_MAX_NODES 1024
 
 struct cfuthread_queue {
 	pthread_mutex_t mutex;
 	pthread_cond_t cv;
-	cfulist_t *request_queue;
+	pthread_cond_t space_cv; /* submitters waiting for room in the lanes */
+	cfuthread_fifo lanes[CFUTHREAD_QUEUE_NUM_PRIORITIES]; /* shared queue, by priority */
+	size_t num_requests;     /* in all lanes */
+	long num_urgent;         /* in the high priority lane */
+	size_t capacity;         /* 0 if the shared queue is unbounded */
+	int overflow;
+	size_t num_blocked;      /* submitters waiting on space_cv */
+	size_t max_depth;        /* high-water mark of num_requests */
+	size_t num_rejected;
+	size_t num_dropped;
 	cfuthread_queue_fn_t fn;
-	pthread_t thread;
+	cfuthread_worker **workers;
+	pthread_t *threads;
+	size_t num_threads;
+	size_t num_ready;  /* workers that have set themselves up */
+	unsigned int flags;
+	int *cpus;         /* CPUs to pin the workers to, if any */
+	size_t num_cpus;
+	int *cpu_nodes;    /* NUMA node of each CPU, if known */
+	size_t num_cpu_nodes;
+	cfuthread_node *nodes; /* with CFUTHREAD_QUEUE_NODE_ROUTING */
+	size_t num_nodes;
+	long num_queued;   /* requests sitting in worker deques and node inboxes */
+	cfuthread_queue_entry *free_entries; /* released entries, for any thread to reuse */
+	long num_free;     /* approximate length of free_entries */
+	long num_sleeping; /* workers waiting on cv */
+	uint64_t started_ns; /* with CFUTHREAD_QUEUE_STATS */
+	int stopping;      /* no new requests from outside the workers */
+	int discarding;    /* cancel requests instead of running them */
 	cfuthread_queue_init_t init_fn;
 	void *init_arg;
 	cfuthread_queue_cleanup_t cleanup_fn;
 	void *cleanup_arg;
 };
 
-typedef struct cfuthread_queue_entry {
-	pthread_mutex_t mutex;
-	pthread_cond_t cv;
-	void *data_in;
-	void *data_out;
-} cfuthread_queue_entry;
+static pthread_key_t worker_key;
+static pthread_key_t entry_cache_key;
+static pthread_once_t worker_key_once = PTHREAD_ONCE_INIT;
+
+static void
+_destroy_cfuthread_entry(cfuthread_queue_entry *entry) {
+#ifndef CFUTHREAD_USE_FUTEX
+	if (entry->sync_init) {
+		pthread_mutex_destroy(&entry->mutex);
+		pthread_cond_destroy(&entry->cv);
+	}
+#endif
+	free(entry);
+}
+
+static void
+_free_entry_cache(void *arg) {
+	cfuthread_entry_cache *cache = (cfuthread_entry_cache *)arg;
+	cfuthread_queue_entry *entry = NULL;
+
+	while ( (entry = cache->head) ) {
+		cache->head = entry->next;
+		_destroy_cfuthread_entry(entry);
+	}
+	free(cache);
+}
+
+static void
+_make_worker_key(void) {
+	pthread_key_create(&worker_key, NULL);
+	pthread_key_create(&entry_cache_key, _free_entry_cache);
+}
+
+static cfuthread_entry_cache *
+_get_entry_cache(void) {
+	cfuthread_entry_cache *cache = pthread_getspecific(entry_cache_key);
+
+	if (!cache) {
+		cache = calloc(1, sizeof(cfuthread_entry_cache));
+		pthread_setspecific(entry_cache_key, cache);
+	}
+	return cache;
+}
+
+/* Moves all of tq's free entries into cache */
+static void
+_take_free_entries(cfuthread_queue_t *tq, cfuthread_entry_cache *cache) {
+#ifdef HAVE_ATOMIC_BUILTINS
+	cfuthread_queue_entry *entries = NULL;
+	cfuthread_queue_entry *tail = NULL;
+	long n = 1;
+
+	if (!CFU_ATOMIC_LOAD_RELAXED(&tq->free_entries)) return;
+	if ( !(entries = CFU_ATOMIC_EXCHANGE(&tq->free_entries, NULL)) ) return;
+
+	for (tail = entries; tail->next; tail = tail->next) n++;
+	CFU_ATOMIC_FETCH_SUB(&tq->num_free, n);
+
+	tail->next = cache->head;
+	cache->head = entries;
+	cache->num_entries += (size_t)n;
+#else
+	tq = tq;
+	cache = cache;
+#endif
+}
+
+/* Returns 0 if entry was added to tq's freelist, -1 if it is full */
+static int
+_put_free_entry(cfuthread_queue_t *tq, cfuthread_queue_entry *entry) {
+#ifdef HAVE_ATOMIC_BUILTINS
+	cfuthread_queue_entry *head = NULL;
+
+	if (CFU_ATOMIC_LOAD_RELAXED(&tq->num_free) >= CFUTHREAD_QUEUE_FREELIST_SIZE) return -1;
+	CFU_ATOMIC_FETCH_ADD(&tq->num_free, 1);
+
+	head = CFU_ATOMIC_LOAD_RELAXED(&tq->free_entries);
+	do {
+		entry->next = head;
+	} while (!CFU_ATOMIC_CAS(&tq->free_entries, &head, entry));
+
+	return 0;
+#else
+	tq = tq;
+	entry = entry;
+	return -1;
+#endif
+}
 
 static cfuthread_queue_entry *
-_new_cfuthread_entry(void *data) {
-	cfuthread_queue_entry *entry = calloc(1, sizeof(cfuthread_queue_entry));
-	pthread_mutex_init(&entry->mutex, NULL);
-	pthread_cond_init(&entry->cv, NULL);
+_new_cfuthread_entry(cfuthread_queue_t *tq, void *data, int has_waiter) {
+	cfuthread_entry_cache *cache = _get_entry_cache();
+	cfuthread_queue_entry *entry = NULL;
+
+	if (!cache->head) _take_free_entries(tq, cache);
+
+	if ( (entry = cache->head) ) {
+		cache->head = entry->next;
+		cache->num_entries--;
+		entry->next = NULL;
+		entry->data_out = NULL;
+		entry->callback = NULL;
+		entry->callback_arg = NULL;
+	} else {
+		entry = calloc(1, sizeof(cfuthread_queue_entry));
+	}
+
+	entry->tq = tq;
+	entry->state = CFUTHREAD_ENTRY_PENDING;
+	entry->refs = has_waiter ? 2 : 1;
+	entry->priority = CFUTHREAD_QUEUE_PRIORITY_NORMAL;
 	entry->data_in = data;
+
+#ifndef CFUTHREAD_USE_FUTEX
+	if (has_waiter && !entry->sync_init) {
+		pthread_mutex_init(&entry->mutex, NULL);
+		pthread_cond_init(&entry->cv, NULL);
+		entry->sync_init = 1;
+	}
+#endif
+
 	return entry;
 }
 
+/* tq is the queue to hand the entry back to once this thread's cache
+   is full, or NULL if the queue may already be gone.
+*/
 static void
-_destroy_cfuthread_entry(cfuthread_queue_entry *entry) {
-	pthread_mutex_destroy(&entry->mutex);
-	pthread_cond_destroy(&entry->cv);
-	free(entry);
+_recycle_cfuthread_entry(cfuthread_queue_entry *entry, cfuthread_queue_t *tq) {
+	cfuthread_entry_cache *cache = _get_entry_cache();
+
+	if (cache->num_entries >= CFUTHREAD_ENTRY_CACHE_SIZE) {
+		if (!tq || _put_free_entry(tq, entry) < 0) _destroy_cfuthread_entry(entry);
+		return;
+	}
+	entry->next = cache->head;
+	cache->head = entry;
+	cache->num_entries++;
 }
 
-static void *
-_run_queue(void *arg) {
-	cfuthread_queue_t *tq = (cfuthread_queue_t *)arg;
-	cfuthread_queue_entry *request = NULL;
+#ifdef CFUTHREAD_USE_FUTEX
 
-	if (tq->init_fn) {
-		tq->init_fn(tq->init_arg);
+static CFU_INLINE int
+_futex_wait(int *addr, int val, const struct timespec *timeout) {
+	return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static CFU_INLINE void
+_futex_wake_all(int *addr) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static void
+_release_cfuthread_entry(cfuthread_queue_entry *entry, cfuthread_queue_t *tq) {
+	if (CFU_ATOMIC_FETCH_SUB(&entry->refs, 1) == 1) {
+		_recycle_cfuthread_entry(entry, tq);
+	}
+}
+
+static CFU_INLINE int
+_entry_state(cfuthread_queue_entry *entry) {
+	return CFU_ATOMIC_LOAD_ACQUIRE(&entry->state);
+}
+
+/* True once the entry is done or canceled */
+static CFU_INLINE int
+_entry_is_done(cfuthread_queue_entry *entry) {
+	int state = _entry_state(entry);
+	return state == CFUTHREAD_ENTRY_DONE || state == CFUTHREAD_ENTRY_CANCELED;
+}
+
+static void
+_entry_complete(cfuthread_queue_entry *entry, void *data_out, int state) {
+	entry->data_out = data_out;
+	if (CFU_ATOMIC_EXCHANGE(&entry->state, state) == CFUTHREAD_ENTRY_SLEEPING) {
+		_futex_wake_all(&entry->state);
+	}
+}
+
+/* Sleeps until the entry is done or the relative timeout (if not
+   NULL) expires.  Returns true if the entry is done.
+*/
+static int
+_entry_sleep(cfuthread_queue_entry *entry, const struct timespec *timeout) {
+	int state = CFU_ATOMIC_LOAD_ACQUIRE(&entry->state);
+
+	if (state == CFUTHREAD_ENTRY_DONE || state == CFUTHREAD_ENTRY_CANCELED) return 1;
+	if (state == CFUTHREAD_ENTRY_PENDING) {
+		if (!CFU_ATOMIC_CAS(&entry->state, &state, CFUTHREAD_ENTRY_SLEEPING)) {
+			return state == CFUTHREAD_ENTRY_DONE || state == CFUTHREAD_ENTRY_CANCELED;
+		}
+	}
+	_futex_wait(&entry->state, CFUTHREAD_ENTRY_SLEEPING, timeout);
+
+	return _entry_is_done(entry);
+}
+
+/* Most requests are short, so spin briefly before going to sleep. */
+#define CFUTHREAD_ENTRY_SPIN 100
+
+static void
+_entry_wait(cfuthread_queue_entry *entry) {
+	int i = 0;
+
+	for (i = 0; i < CFUTHREAD_ENTRY_SPIN; i++) {
+		if (_entry_is_done(entry)) return;
 	}
+	while (!_entry_sleep(entry, NULL));
+}
+
+static int
+_entry_timed_wait(cfuthread_queue_entry *entry, double timeout) {
+	struct timespec now;
+	struct timespec end;
+	struct timespec left;
 
-	pthread_cleanup_push(tq->cleanup_fn, tq->cleanup_arg);
+	if (_entry_is_done(entry)) return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += (time_t)timeout;
+	end.tv_nsec += (long)((timeout - (double)(time_t)timeout) * 1000000000.0);
+	if (end.tv_nsec >= 1000000000L) {
+		end.tv_sec++;
+		end.tv_nsec -= 1000000000L;
+	}
 
 	while (1) {
-		pthread_mutex_lock(&tq->mutex);
-		while (cfulist_num_entries(tq->request_queue) == 0) {
-			pthread_cond_wait(&tq->cv, &tq->mutex);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left.tv_sec = end.tv_sec - now.tv_sec;
+		left.tv_nsec = end.tv_nsec - now.tv_nsec;
+		if (left.tv_nsec < 0) {
+			left.tv_sec--;
+			left.tv_nsec += 1000000000L;
 		}
+		if (left.tv_sec < 0) break;
+		if (_entry_sleep(entry, &left)) return 1;
+	}
 
-		request = (cfuthread_queue_entry *)cfulist_dequeue(tq->request_queue);
-		pthread_mutex_unlock(&tq->mutex);
-		if (!request) continue;
+	return _entry_is_done(entry);
+}
+
+#else /* !CFUTHREAD_USE_FUTEX */
 
-		pthread_mutex_lock(&request->mutex);
-		request->data_out = tq->fn(request->data_in);
-		pthread_cond_signal(&request->cv);
-		pthread_mutex_unlock(&request->mutex);
+static void
+_release_cfuthread_entry(cfuthread_queue_entry *entry, cfuthread_queue_t *tq) {
+	int refs = 0;
+
+	if (!entry->sync_init) {
+		/* posted request, the worker holds the only reference */
+		_recycle_cfuthread_entry(entry, tq);
+		return;
 	}
-	pthread_exit((void *)0);
 
-	pthread_cleanup_pop(0);
+	pthread_mutex_lock(&entry->mutex);
+	refs = --entry->refs;
+	pthread_mutex_unlock(&entry->mutex);
 
+	if (refs == 0) _recycle_cfuthread_entry(entry, tq);
 }
 
-cfuthread_queue_t *
-cfuthread_queue_new_with_cleanup(cfuthread_queue_fn_t fn, cfuthread_queue_init_t init_fn,
-	void *init_arg, cfuthread_queue_cleanup_t cleanup_fn,
-	void *cleanup_arg) {
-	cfuthread_queue_t *tq = calloc(1, sizeof(cfuthread_queue_t));
-	pthread_mutex_init(&tq->mutex, NULL);
-	pthread_cond_init(&tq->cv, NULL);
-	tq->fn = fn;
-	tq->request_queue = cfulist_new();
-	tq->init_fn = init_fn;
-	tq->init_arg = init_arg;
-	tq->cleanup_fn = cleanup_fn;
-	tq->cleanup_arg = cleanup_arg;
+static int
+_entry_state(cfuthread_queue_entry *entry) {
+	int state = 0;
 
-	/* FIXME: do pthread_create() here to run a function that waits on
-	   an entry to be put into the queue, then call fn().
-	*/
-	if ( (0 != pthread_create(&tq->thread, NULL, _run_queue, (void *)tq)) ) {
-		return NULL;
+	if (!entry->sync_init) return entry->state;
+	pthread_mutex_lock(&entry->mutex);
+	state = entry->state;
+	pthread_mutex_unlock(&entry->mutex);
+
+	return state;
+}
+
+/* True once the entry is done or canceled */
+static int
+_entry_is_done(cfuthread_queue_entry *entry) {
+	return _entry_state(entry) != CFUTHREAD_ENTRY_PENDING;
+}
+
+static void
+_entry_complete(cfuthread_queue_entry *entry, void *data_out, int state) {
+	if (!entry->sync_init) {
+		entry->data_out = data_out;
+		entry->state = state;
+		return;
 	}
+	pthread_mutex_lock(&entry->mutex);
+	entry->data_out = data_out;
+	entry->state = state;
+	pthread_cond_broadcast(&entry->cv);
+	pthread_mutex_unlock(&entry->mutex);
+}
 
-	return tq;
+static void
+_entry_wait(cfuthread_queue_entry *entry) {
+	pthread_mutex_lock(&entry->mutex);
+	while (entry->state == CFUTHREAD_ENTRY_PENDING) {
+		pthread_cond_wait(&entry->cv, &entry->mutex);
+	}
+	pthread_mutex_unlock(&entry->mutex);
 }
 
-cfuthread_queue_t *
-cfuthread_queue_new(cfuthread_queue_fn_t fn) {
-	return cfuthread_queue_new_with_cleanup(fn, NULL, NULL, NULL, NULL);
+static void
+_deadline_after(double timeout, struct timespec *deadline) {
+	long sec = (long)timeout;
+	long nsec = (long)((timeout - (double)sec) * 1000000000.0);
+
+#if defined(HAVE_CLOCK_GETTIME)
+	clock_gettime(CLOCK_REALTIME, deadline);
+#elif defined(HAVE_GETTIMEOFDAY)
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	deadline->tv_sec = tv.tv_sec;
+	deadline->tv_nsec = tv.tv_usec * 1000;
+#else
+	deadline->tv_sec = time(NULL);
+	deadline->tv_nsec = 0;
+#endif
+
+	deadline->tv_sec += sec;
+	deadline->tv_nsec += nsec;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
 }
 
-void *
-cfuthread_queue_make_request(cfuthread_queue_t * tq, void *data) {
-	cfuthread_queue_entry *request = _new_cfuthread_entry(data);
+static int
+_entry_timed_wait(cfuthread_queue_entry *entry, double timeout) {
+	struct timespec deadline;
+	int done = 0;
 
-	pthread_mutex_lock(&tq->mutex);
-	pthread_mutex_lock(&request->mutex);
-	cfulist_enqueue(tq->request_queue, (void *)request);
-	pthread_cond_signal(&tq->cv);
-	pthread_mutex_unlock(&tq->mutex);
+	_deadline_after(timeout, &deadline);
+
+	pthread_mutex_lock(&entry->mutex);
+	while (entry->state == CFUTHREAD_ENTRY_PENDING) {
+		if (pthread_cond_timedwait(&entry->cv, &entry->mutex, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	done = (entry->state != CFUTHREAD_ENTRY_PENDING);
+	pthread_mutex_unlock(&entry->mutex);
 
-	pthread_cond_wait(&request->cv, &request->mutex);
-	pthread_mutex_unlock(&request->mutex);
+	return done;
+}
 
-	data = request->data_out;
-	_destroy_cfuthread_entry(request);
+#endif /* CFUTHREAD_USE_FUTEX */
 
-	return data;
+static uint64_t
+_now_ns(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#elif defined(HAVE_GETTIMEOFDAY)
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+#else
+	return (uint64_t)time(NULL) * 1000000000;
+#endif
 }
 
-void
-cfuthread_queue_destroy(cfuthread_queue_t *tq) {
-	void *rv = NULL;
+static CFU_INLINE void
+_stat_add(uint64_t *counter, uint64_t n) {
+#ifdef HAVE_ATOMIC_BUILTINS
+	CFU_ATOMIC_STORE_RELAXED(counter, *counter + n);
+#else
+	*counter += n;
+#endif
+}
 
-	pthread_cancel(tq->thread);
-	pthread_join(tq->thread, &rv);
-	pthread_mutex_destroy(&tq->mutex);
-	pthread_cond_destroy(&tq->cv);
-	cfulist_destroy(tq->request_queue);
-	free(tq);
+static CFU_INLINE uint64_t
+_stat_load(uint64_t *counter) {
+#ifdef HAVE_ATOMIC_BUILTINS
+	return CFU_ATOMIC_LOAD_RELAXED(counter);
+#else
+	return *counter;
+#endif
+}
+
+/* Bucket 0 is for zero, bucket i for [2^(i-1), 2^i). */
+static CFU_INLINE size_t
+_stat_bucket(uint64_t value) {
+	size_t bucket = 0;
+
+	while (value && bucket < CFUTHREAD_QUEUE_STATS_BUCKETS - 1) {
+		value >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/* nested is the time spent running other requests while this one
+   waited on its own nested requests; they are recorded separately, so
+   it does not count towards this request's execution time.
+*/
+static void
+_record_request(cfuthread_worker *w, cfuthread_queue_entry *request, uint64_t start,
+	uint64_t end, uint64_t nested) {
+	cfuthread_worker_stats *stats = &w->stats;
+	uint64_t wait = start > request->queued_ns ? start - request->queued_ns : 0;
+	uint64_t exec = end > start + nested ? end - start - nested : 0;
+
+	_stat_add(&stats->num_requests, 1);
+	_stat_add(&stats->wait_ns, wait);
+	_stat_add(&stats->exec_ns, exec);
+	_stat_add(&stats->wait_hist[_stat_bucket(wait)], 1);
+	_stat_add(&stats->exec_hist[_stat_bucket(exec)], 1);
+	_stat_add(&stats->depth_hist[_stat_bucket(request->depth)], 1);
+}
+
+static CFU_INLINE void
+_fifo_push(cfuthread_fifo *fifo, cfuthread_queue_entry *entry) {
+	entry->next = NULL;
+	if (fifo->tail) {
+		fifo->tail->next = entry;
+	} else {
+		fifo->head = entry;
+	}
+	fifo->tail = entry;
+	fifo->num_entries++;
+}
+
+static CFU_INLINE cfuthread_queue_entry *
+_fifo_shift(cfuthread_fifo *fifo) {
+	cfuthread_queue_entry *entry = fifo->head;
+
+	if (!entry) return NULL;
+	fifo->head = entry->next;
+	if (!fifo->head) fifo->tail = NULL;
+	fifo->num_entries--;
+	entry->next = NULL;
+
+	return entry;
+}
+
+#ifdef HAVE_ATOMIC_BUILTINS
+
+static cfuthread_deque_array *
+_deque_array_new(long size) {
+	cfuthread_deque_array *a = calloc(1, sizeof(cfuthread_deque_array));
+	a->size = size;
+	a->buf = calloc(size, sizeof(void *));
+	return a;
+}
+
+static void
+_deque_init(cfuthread_deque *q) {
+	q->top = 0;
+	q->bottom = 0;
+	q->array = _deque_array_new(CFUTHREAD_DEQUE_INITIAL_SIZE);
+}
+
+static void
+_deque_free(cfuthread_deque *q) {
+	cfuthread_deque_array *a = q->array;
+	cfuthread_deque_array *prev = NULL;
+
+	while (a) {
+		prev = a->prev;
+		free(a->buf);
+		free(a);
+		a = prev;
+	}
+	q->array = NULL;
+}
+
+/* Only called by the owner, with t..b being the live entries. */
+static cfuthread_deque_array *
+_deque_grow(cfuthread_deque *q, cfuthread_deque_array *a, long t, long b) {
+	cfuthread_deque_array *na = _deque_array_new(a->size * 2);
+	long i = 0;
+
+	for (i = t; i < b; i++) {
+		na->buf[i & (na->size - 1)] = CFU_ATOMIC_LOAD_RELAXED(&a->buf[i & (a->size - 1)]);
+	}
+	na->prev = a;
+	CFU_ATOMIC_STORE_RELEASE(&q->array, na);
+
+	return na;
+}
+
+static void
+_deque_push(cfuthread_deque *q, void *x) {
+	long b = CFU_ATOMIC_LOAD_RELAXED(&q->bottom);
+	long t = CFU_ATOMIC_LOAD_ACQUIRE(&q->top);
+	cfuthread_deque_array *a = CFU_ATOMIC_LOAD_RELAXED(&q->array);
+
+	if (b - t > a->size - 1) {
+		a = _deque_grow(q, a, t, b);
+	}
+	CFU_ATOMIC_STORE_RELAXED(&a->buf[b & (a->size - 1)], x);
+	CFU_ATOMIC_STORE_RELEASE(&q->bottom, b + 1);
+}
+
+/* Pops the most recently pushed entry.  Owner only. */
+static void *
+_deque_take(cfuthread_deque *q) {
+	long b = CFU_ATOMIC_LOAD_RELAXED(&q->bottom) - 1;
+	cfuthread_deque_array *a = CFU_ATOMIC_LOAD_RELAXED(&q->array);
+	long t = 0;
+	void *x = NULL;
+
+	CFU_ATOMIC_STORE_RELAXED(&q->bottom, b);
+	CFU_ATOMIC_FENCE();
+	t = CFU_ATOMIC_LOAD_RELAXED(&q->top);
+
+	if (t <= b) {
+		x = CFU_ATOMIC_LOAD_RELAXED(&a->buf[b & (a->size - 1)]);
+		if (t == b) {
+			/* last entry, race against thieves for it */
+			if (!CFU_ATOMIC_CAS(&q->top, &t, t + 1)) {
+				x = NULL;
+			}
+			CFU_ATOMIC_STORE_RELAXED(&q->bottom, b + 1);
+		}
+	} else {
+		CFU_ATOMIC_STORE_RELAXED(&q->bottom, b + 1);
+	}
+
+	return x;
+}
+
+/* Removes the oldest entry.  Sets *lost if another thread won the
+   race for it, in which case the deque may still have entries.
+*/
+static void *
+_deque_steal(cfuthread_deque *q, int *lost) {
+	long t = CFU_ATOMIC_LOAD_ACQUIRE(&q->top);
+	long b = 0;
+	cfuthread_deque_array *a = NULL;
+	void *x = NULL;
+
+	CFU_ATOMIC_FENCE();
+	b = CFU_ATOMIC_LOAD_ACQUIRE(&q->bottom);
+
+	if (t < b) {
+		a = CFU_ATOMIC_LOAD_ACQUIRE(&q->array);
+		x = CFU_ATOMIC_LOAD_RELAXED(&a->buf[t & (a->size - 1)]);
+		if (!CFU_ATOMIC_CAS(&q->top, &t, t + 1)) {
+			*lost = 1;
+			return NULL;
+		}
+	}
+
+	return x;
+}
+
+/* Returns the calling thread's worker if it belongs to a
+   work-stealing tq.
+*/
+static cfuthread_worker *
+_current_worker(cfuthread_queue_t *tq) {
+	cfuthread_worker *w = NULL;
+
+	if (!(tq->flags & CFUTHREAD_QUEUE_WORK_STEALING)) return NULL;
+	w = (cfuthread_worker *)pthread_getspecific(worker_key);
+	if (w && w->tq == tq) return w;
+	return NULL;
+}
+
+static unsigned int
+_next_victim(cfuthread_worker *w) {
+	/* xorshift32 */
+	unsigned int x = w->seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	w->seed = x;
+	return x;
+}
+
+/* Own deque first (newest work, still warm in cache), then the
+   oldest work of the other workers, starting at a random victim.
+*/
+static cfuthread_queue_entry *
+_take_routed(cfuthread_queue_t *tq, size_t node_index) {
+	cfuthread_node *node = &tq->nodes[node_index];
+	cfuthread_queue_entry *request = NULL;
+
+	if (CFU_ATOMIC_LOAD_RELAXED(&node->num_entries) == 0) return NULL;
+
+	pthread_mutex_lock(&node->mutex);
+	if ( (request = _fifo_shift(&node->inbox)) ) {
+		CFU_ATOMIC_STORE_RELAXED(&node->num_entries, (long)node->inbox.num_entries);
+	}
+	pthread_mutex_unlock(&node->mutex);
+
+	if (request) CFU_ATOMIC_FETCH_SUB(&tq->num_queued, 1);
+	return request;
+}
+
+static cfuthread_queue_entry *
+_find_local_work(cfuthread_worker *w) {
+	cfuthread_queue_t *tq = w->tq;
+	cfuthread_queue_entry *request = NULL;
+	size_t start = 0;
+	size_t i = 0;
+	int lost = 0;
+
+	if (!(tq->flags & CFUTHREAD_QUEUE_WORK_STEALING)) return NULL;
+
+	if ( (request = _deque_take(&w->deque)) ) {
+		CFU_ATOMIC_FETCH_SUB(&tq->num_queued, 1);
+		return request;
+	}
+
+	if (tq->nodes && (request = _take_routed(tq, (size_t)w->node))) {
+		return request;
+	}
+
+	if (tq->num_threads > 1) {
+		do {
+			lost = 0;
+			start = _next_victim(w) % tq->num_threads;
+			for (i = 0; i < tq->num_threads; i++) {
+				cfuthread_worker *victim = tq->workers[(start + i) % tq->num_threads];
+				/* NULL only if the queue failed to start */
+				if (!victim || victim == w) continue;
+				if ( (request = _deque_steal(&victim->deque, &lost)) ) {
+					CFU_ATOMIC_FETCH_SUB(&tq->num_queued, 1);
+					return request;
+				}
+			}
+		} while (lost);
+	}
+
+	/* nodes without workers of their own */
+	for (i = 0; tq->nodes && i < tq->num_nodes; i++) {
+		if ((int)i == w->node) continue;
+		if ( (request = _take_routed(tq, i)) ) return request;
+	}
+
+	return NULL;
+}
+
+#else /* !HAVE_ATOMIC_BUILTINS: fall back to the shared queue */
+
+static void
+_deque_init(cfuthread_deque *q) {
+	q->array = NULL;
+}
+
+static void
+_deque_free(cfuthread_deque *q) {
+	q->array = NULL;
+}
+
+static cfuthread_worker *
+_current_worker(cfuthread_queue_t *tq) {
+	tq = tq;
+	return NULL;
+}
+
+static cfuthread_queue_entry *
+_find_local_work(cfuthread_worker *w) {
+	w = w;
+	return NULL;
+}
+
+#endif /* HAVE_ATOMIC_BUILTINS */
+
+#ifdef CFUTHREAD_USE_AFFINITY
+
+/* Sets map[cpu] to value for each CPU in a sysfs CPU list such as
+   "0-3,8-11".
+*/
+static void
+_parse_cpulist(const char *list, int *map, size_t map_size, int value) {
+	char *end = NULL;
+	long lo = 0;
+	long hi = 0;
+
+	while (*list) {
+		lo = hi = strtol(list, &end, 10);
+		if (end == list) break;
+		if (*end == '-') {
+			list = end + 1;
+			hi = strtol(list, &end, 10);
+		}
+		for (; lo <= hi; lo++) {
+			if (lo >= 0 && (size_t)lo < map_size) map[lo] = value;
+		}
+		if (*end != ',') break;
+		list = end + 1;
+	}
+}
+
+/* Reads which NUMA node each CPU is on.  CPUs not found are taken
+   to be on node 0.
+*/
+static void
+_init_cpu_nodes(cfuthread_queue_t *tq) {
+	DIR *dir = NULL;
+	struct dirent *entry = NULL;
+	FILE *fp = NULL;
+	char path[64];
+	char list[4096];
+	int node = 0;
+
+	tq->num_cpu_nodes = CPU_SETSIZE;
+	tq->cpu_nodes = calloc(tq->num_cpu_nodes, sizeof(int));
+	tq->num_nodes = 1;
+
+	if (!(dir = opendir("/sys/devices/system/node"))) return;
+	while ( (entry = readdir(dir)) ) {
+		if (sscanf(entry->d_name, "node%d", &node) != 1) continue;
+		if (node < 0 || node >= CFUTHREAD_MAX_NODES) continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		if (!(fp = fopen(path, "r"))) continue;
+		if (fgets(list, sizeof(list), fp)) {
+			_parse_cpulist(list, tq->cpu_nodes, tq->num_cpu_nodes, node);
+			if ((size_t)node >= tq->num_nodes) tq->num_nodes = (size_t)node + 1;
+		}
+		fclose(fp);
+	}
+	closedir(dir);
+}
+
+/* Pins the calling worker thread to the CPU for worker index.
+   Returns the CPU, or -1 if the worker is not pinned.
+*/
+static int
+_pin_worker(cfuthread_queue_t *tq, size_t index) {
+	cpu_set_t set;
+	int cpu = 0;
+
+	if (tq->num_cpus == 0) return -1;
+
+	cpu = tq->cpus[index % tq->num_cpus];
+	if (cpu < 0 || cpu >= CPU_SETSIZE) return -1;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (0 != pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) return -1;
+
+	return cpu;
+}
+
+/* Uses every CPU the process may run on if no CPUs were given. */
+static void
+_init_cpus(cfuthread_queue_t *tq) {
+	cpu_set_t set;
+	int cpu = 0;
+
+	if (tq->cpus || sched_getaffinity(0, sizeof(set), &set) != 0) return;
+
+	tq->cpus = calloc((size_t)CPU_COUNT(&set), sizeof(int));
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &set)) tq->cpus[tq->num_cpus++] = cpu;
+	}
+}
+
+#endif /* CFUTHREAD_USE_AFFINITY */
+
+static int
+_cpu_node(cfuthread_queue_t *tq, int cpu) {
+	if (!tq->cpu_nodes || cpu < 0 || (size_t)cpu >= tq->num_cpu_nodes) return 0;
+	return tq->cpu_nodes[cpu];
+}
+
+/* Wakes up enough workers for count new requests.  Called with
+   tq->mutex held.
+*/
+static void
+_wake_workers(cfuthread_queue_t *tq, size_t count) {
+	if (count == 1) {
+		pthread_cond_signal(&tq->cv);
+	} else if (count > 1) {
+		pthread_cond_broadcast(&tq->cv);
+	}
+}
+
+static void
+_cancel_request(cfuthread_queue_entry *request) {
+	_entry_complete(request, NULL, CFUTHREAD_ENTRY_CANCELED);
+	_release_cfuthread_entry(request, request->tq);
+}
+
+static void
+_cancel_requests(cfuthread_queue_entry *requests) {
+	cfuthread_queue_entry *next = NULL;
+
+	for (; requests; requests = next) {
+		next = requests->next;
+		requests->next = NULL;
+		_cancel_request(requests);
+	}
+}
+
+/* Whether the calling thread is one of tq's workers, whatever the
+   flags.
+*/
+static int
+_is_worker(cfuthread_queue_t *tq) {
+	cfuthread_worker *w = (cfuthread_worker *)pthread_getspecific(worker_key);
+	return w && w->tq == tq;
+}
+
+/* The shared queue is one FIFO lane per priority.  These are called
+   with tq->mutex held.
+*/
+static void
+_push_request(cfuthread_queue_t *tq, cfuthread_queue_entry *request) {
+	_fifo_push(&tq->lanes[request->priority], request);
+	tq->num_requests++;
+#ifdef HAVE_ATOMIC_BUILTINS
+	if (request->priority == CFUTHREAD_QUEUE_PRIORITY_HIGH) {
+		CFU_ATOMIC_FETCH_ADD(&tq->num_urgent, 1);
+	}
+#endif
+}
+
+static cfuthread_queue_entry *
+_shift_lane(cfuthread_queue_t *tq, int priority) {
+	cfuthread_queue_entry *request = _fifo_shift(&tq->lanes[priority]);
+
+	if (!request) return NULL;
+	tq->num_requests--;
+#ifdef HAVE_ATOMIC_BUILTINS
+	if (priority == CFUTHREAD_QUEUE_PRIORITY_HIGH) {
+		CFU_ATOMIC_FETCH_SUB(&tq->num_urgent, 1);
+	}
+#endif
+	return request;
+}
+
+/* Takes the oldest request of the highest priority, down to
+   lowest_priority, making room for a blocked submitter.
+*/
+static cfuthread_queue_entry *
+_take_request_upto(cfuthread_queue_t *tq, int lowest_priority) {
+	cfuthread_queue_entry *request = NULL;
+	int i = 0;
+
+	for (i = 0; i <= lowest_priority && !request; i++) {
+		request = _shift_lane(tq, i);
+	}
+	if (request && tq->num_blocked > 0) pthread_cond_signal(&tq->space_cv);
+	return request;
+}
+
+static cfuthread_queue_entry *
+_take_request(cfuthread_queue_t *tq) {
+	return _take_request_upto(tq, CFUTHREAD_QUEUE_NUM_PRIORITIES - 1);
+}
+
+/* Like _find_local_work(), but high priority requests in the shared
+   queue go ahead of the worker's own deque.
+*/
+static cfuthread_queue_entry *
+_find_work(cfuthread_worker *w) {
+#ifdef HAVE_ATOMIC_BUILTINS
+	cfuthread_queue_t *tq = w->tq;
+	cfuthread_queue_entry *request = NULL;
+
+	if ((tq->flags & CFUTHREAD_QUEUE_WORK_STEALING)
+		&& CFU_ATOMIC_LOAD_RELAXED(&tq->num_urgent) > 0) {
+		pthread_mutex_lock(&tq->mutex);
+		request = _take_request_upto(tq, CFUTHREAD_QUEUE_PRIORITY_HIGH);
+		pthread_mutex_unlock(&tq->mutex);
+		if (request) return request;
+	}
+#endif
+	return _find_local_work(w);
+}
+
+/* Takes the oldest request of the lowest priority, if that is not
+   higher than priority, to make room for a new request.
+*/
+static cfuthread_queue_entry *
+_take_drop_victim(cfuthread_queue_t *tq, int priority) {
+	cfuthread_queue_entry *request = NULL;
+	int i = 0;
+
+	for (i = CFUTHREAD_QUEUE_NUM_PRIORITIES - 1; i >= priority && !request; i--) {
+		request = _shift_lane(tq, i);
+	}
+	return request;
+}
+
+/* Detaches every request in the shared queue as one linked list. */
+static cfuthread_queue_entry *
+_take_all_requests(cfuthread_queue_t *tq) {
+	cfuthread_queue_entry *head = NULL;
+	cfuthread_queue_entry *tail = NULL;
+	int i = 0;
+
+	for (i = 0; i < CFUTHREAD_QUEUE_NUM_PRIORITIES; i++) {
+		cfuthread_fifo *lane = &tq->lanes[i];
+		if (!lane->head) continue;
+		if (tail) {
+			tail->next = lane->head;
+		} else {
+			head = lane->head;
+		}
+		tail = lane->tail;
+		lane->head = lane->tail = NULL;
+		lane->num_entries = 0;
+	}
+	tq->num_requests = 0;
+#ifdef HAVE_ATOMIC_BUILTINS
+	CFU_ATOMIC_STORE(&tq->num_urgent, 0);
+#endif
+	return head;
+}
+
+static CFU_INLINE int
+_queue_full(cfuthread_queue_t *tq) {
+	return tq->capacity > 0 && tq->num_requests >= tq->capacity;
+}
+
+#ifdef HAVE_ATOMIC_BUILTINS
+/* NUMA node of the CPU the calling thread is running on */
+static int
+_current_node(cfuthread_queue_t *tq) {
+#ifdef CFUTHREAD_USE_AFFINITY
+	return _cpu_node(tq, sched_getcpu());
+#else
+	tq = tq;
+	return 0;
+#endif
+}
+
+/* Queues requests from outside the workers in the inbox of the
+   submitter's NUMA node.  Wakes sleeping workers the same way as
+   requests pushed onto a worker's deque.  Stopping is checked again
+   under the node mutex, which _cancel_routed() takes after it is
+   set, so a request is either canceled here or seen there.  Returns
+   -1 if the requests were canceled.
+*/
+static int
+_route_requests(cfuthread_queue_t *tq, cfuthread_queue_entry *requests, size_t count,
+	uint64_t now) {
+	cfuthread_node *node = &tq->nodes[_current_node(tq)];
+	cfuthread_queue_entry *next = NULL;
+	size_t depth = (size_t)CFU_ATOMIC_LOAD_RELAXED(&tq->num_queued);
+
+	pthread_mutex_lock(&node->mutex);
+	if (CFU_ATOMIC_LOAD(&tq->stopping)) {
+		pthread_mutex_unlock(&node->mutex);
+		_cancel_requests(requests);
+		return -1;
+	}
+	for (; requests; requests = next) {
+		next = requests->next;
+		requests->queued_ns = now;
+		requests->depth = depth++;
+		_fifo_push(&node->inbox, requests);
+	}
+	CFU_ATOMIC_STORE_RELAXED(&node->num_entries, (long)node->inbox.num_entries);
+	pthread_mutex_unlock(&node->mutex);
+
+	CFU_ATOMIC_FETCH_ADD(&tq->num_queued, (long)count);
+	if (CFU_ATOMIC_LOAD(&tq->num_sleeping) > 0) {
+		pthread_mutex_lock(&tq->mutex);
+		_wake_workers(tq, count);
+		pthread_mutex_unlock(&tq->mutex);
+	}
+
+	return 0;
+}
+#endif
+
+/* Queues count requests linked through their next pointers, all of
+   the same priority.  Once the queue is shutting down, requests from
+   outside the workers are canceled and -1 is returned.  Requests that do not fit in a
+   bounded queue are handled according to its overflow policy,
+   except that workers never block or get rejected, since they may
+   be the ones that have to make room.
+*/
+static int
+_enqueue_requests(cfuthread_queue_t *tq, cfuthread_queue_entry *requests, size_t count) {
+	cfuthread_worker *w = _current_worker(tq);
+	cfuthread_queue_entry *next = NULL;
+	cfuthread_queue_entry *dropped = NULL;
+	size_t num_pushed = 0;
+	int stats = tq->flags & CFUTHREAD_QUEUE_STATS;
+	uint64_t now = stats ? _now_ns() : 0;
+	int worker = 0;
+	int rv = 0;
+
+#ifdef HAVE_ATOMIC_BUILTINS
+	if (w && requests->priority == CFUTHREAD_QUEUE_PRIORITY_NORMAL) {
+		size_t depth = stats ? (size_t)CFU_ATOMIC_LOAD_RELAXED(&tq->num_queued) : 0;
+
+		/* While draining, workers may still add requests, since the
+		   ones they are running may depend on them.
+		*/
+		if (CFU_ATOMIC_LOAD(&tq->discarding)) {
+			_cancel_requests(requests);
+			return -1;
+		}
+
+		/* Requests made from inside a worker stay on that worker's
+		   deque, unless they have to be ordered against the shared
+		   queue by priority.  Sleeping workers check num_queued after
+		   announcing themselves in num_sleeping, so one of the two
+		   sides always sees the other.
+		*/
+		for (; requests; requests = next) {
+			next = requests->next;
+			requests->next = NULL;
+			requests->queued_ns = now;
+			requests->depth = depth++;
+			_deque_push(&w->deque, requests);
+		}
+		CFU_ATOMIC_FETCH_ADD(&tq->num_queued, (long)count);
+		if (CFU_ATOMIC_LOAD(&tq->num_sleeping) > 0) {
+			pthread_mutex_lock(&tq->mutex);
+			_wake_workers(tq, count);
+			pthread_mutex_unlock(&tq->mutex);
+		}
+		return 0;
+	}
+
+	/* Bounded queues keep using the shared lanes, where the limit is
+	   enforced.  Once the queue is stopping, requests go on to the
+	   shared lanes below and are canceled there.
+	*/
+	if (tq->nodes && !w && requests->priority == CFUTHREAD_QUEUE_PRIORITY_NORMAL
+		&& CFU_ATOMIC_LOAD_RELAXED(&tq->capacity) == 0 && !CFU_ATOMIC_LOAD(&tq->stopping)) {
+		return _route_requests(tq, requests, count, now);
+	}
+#else
+	w = w;
+#endif
+
+	worker = _is_worker(tq);
+
+	pthread_mutex_lock(&tq->mutex);
+	if (tq->capacity > 0 && tq->overflow == CFUTHREAD_QUEUE_FAIL && !worker
+		&& tq->num_requests + count > tq->capacity) {
+		/* all or nothing */
+		tq->num_rejected += count;
+		pthread_mutex_unlock(&tq->mutex);
+		_cancel_requests(requests);
+		return -1;
+	}
+	for (; requests; requests = next) {
+		while (!tq->stopping && !worker && tq->overflow == CFUTHREAD_QUEUE_BLOCK
+			&& _queue_full(tq)) {
+			/* let the workers start on what is queued so far */
+			_wake_workers(tq, num_pushed);
+			num_pushed = 0;
+			tq->num_blocked++;
+			pthread_cond_wait(&tq->space_cv, &tq->mutex);
+			tq->num_blocked--;
+			if (stats) now = _now_ns();
+		}
+		if (tq->stopping && (!worker || tq->discarding)) {
+			rv = -1;
+			break;
+		}
+		next = requests->next;
+		if (!worker && tq->overflow == CFUTHREAD_QUEUE_DROP_OLDEST && _queue_full(tq)) {
+			/* a request never makes room for one of lower priority */
+			cfuthread_queue_entry *victim = _take_drop_victim(tq, requests->priority);
+			if (!victim) victim = requests;
+			victim->next = dropped;
+			dropped = victim;
+			tq->num_dropped++;
+			if (victim == requests) continue;
+		}
+		requests->queued_ns = now;
+		requests->depth = tq->num_requests;
+		_push_request(tq, requests);
+		num_pushed++;
+	}
+	if (tq->num_requests > tq->max_depth) {
+		tq->max_depth = tq->num_requests;
+	}
+	_wake_workers(tq, num_pushed);
+	pthread_mutex_unlock(&tq->mutex);
+
+	_cancel_requests(dropped);
+	_cancel_requests(requests);
+
+	return rv;
+}
+
+static int
+_enqueue_request(cfuthread_queue_t *tq, cfuthread_queue_entry *request) {
+	request->next = NULL;
+	return _enqueue_requests(tq, request, 1);
+}
+
+static void
+_run_request(cfuthread_worker *w, cfuthread_queue_entry *request) {
+	cfuthread_queue_t *tq = w->tq;
+	int stats = tq->flags & CFUTHREAD_QUEUE_STATS;
+	uint64_t outer_nested = w->nested_ns;
+	uint64_t start = 0;
+	uint64_t end = 0;
+	void *data_out = NULL;
+
+	if (stats) {
+		w->nested_ns = 0;
+		start = _now_ns();
+	}
+
+	data_out = tq->fn(request->data_in);
+	if (request->callback) {
+		request->callback(request->data_in, data_out, request->callback_arg);
+	}
+
+	if (stats) {
+		end = _now_ns();
+		_record_request(w, request, start, end, w->nested_ns);
+		/* to a request this one ran inside of, all of it is nested time */
+		w->nested_ns = outer_nested + (end > start ? end - start : 0);
+	}
+
+	_entry_complete(request, data_out, CFUTHREAD_ENTRY_DONE);
+	_release_cfuthread_entry(request, tq);
+}
+
+static void
+_process_request(cfuthread_worker *w, cfuthread_queue_entry *request) {
+#ifdef HAVE_ATOMIC_BUILTINS
+	/* only deques can still hold requests once discarding starts */
+	if (CFU_ATOMIC_LOAD(&w->tq->discarding)) {
+		_cancel_request(request);
+		return;
+	}
+#endif
+	_run_request(w, request);
+}
+
+/* pthread_cleanup_push() needs a real function even when the caller
+   did not supply a cleanup function.
+*/
+static void
+_run_cleanup(void *arg) {
+	cfuthread_queue_t *tq = (cfuthread_queue_t *)arg;
+	if (tq->cleanup_fn) {
+		tq->cleanup_fn(tq->cleanup_arg);
+	}
+}
+
+/* Blocks until there is a request for w.  Returns NULL with *stop
+   set once the queue is shutting down and there is nothing left to
+   do.  Called with tq->mutex held.
+*/
+static cfuthread_queue_entry *
+_wait_for_request(cfuthread_worker *w, int *stop) {
+	cfuthread_queue_t *tq = w->tq;
+	cfuthread_queue_entry *request = NULL;
+
+	if (!(tq->flags & CFUTHREAD_QUEUE_WORK_STEALING)) {
+		while (tq->num_requests == 0) {
+			if (tq->stopping) {
+				*stop = 1;
+				return NULL;
+			}
+			pthread_cond_wait(&tq->cv, &tq->mutex);
+		}
+		return _take_request(tq);
+	}
+
+#ifdef HAVE_ATOMIC_BUILTINS
+	if ( (request = _take_request(tq)) ) {
+		return request;
+	}
+	CFU_ATOMIC_FETCH_ADD(&tq->num_sleeping, 1);
+	if (CFU_ATOMIC_LOAD(&tq->num_queued) == 0) {
+		if (tq->stopping) {
+			/* Anything a busy worker adds from now on goes to its
+			   own deque, which it empties before stopping.
+			*/
+			CFU_ATOMIC_FETCH_SUB(&tq->num_sleeping, 1);
+			*stop = 1;
+			return NULL;
+		}
+		pthread_cond_wait(&tq->cv, &tq->mutex);
+	}
+	CFU_ATOMIC_FETCH_SUB(&tq->num_sleeping, 1);
+#else
+	request = request;
+#endif
+
+	/* woken up: go back to stealing */
+	return _take_request(tq);
+}
+
+static cfuthread_queue_entry *
+_next_request(cfuthread_worker *w, int *stop) {
+	cfuthread_queue_t *tq = w->tq;
+	cfuthread_queue_entry *request = NULL;
+
+	if ( (request = _find_work(w)) ) return request;
+
+	pthread_mutex_lock(&tq->mutex);
+	request = _wait_for_request(w, stop);
+	pthread_mutex_unlock(&tq->mutex);
+
+	return request;
+}
+
+/* Processes requests until the queue is shut down. */
+static void
+_process_requests(cfuthread_worker *w) {
+	cfuthread_queue_entry *request = NULL;
+	int stop = 0;
+
+	while (!stop) {
+		if (!(request = _next_request(w, &stop))) continue;
+
+		_process_request(w, request);
+	}
+}
+
+static cfuthread_worker *
+_new_worker(cfuthread_queue_t *tq, size_t index, int cpu) {
+	cfuthread_worker *w = calloc(1, sizeof(cfuthread_worker));
+
+	w->tq = tq;
+	w->index = index;
+	w->cpu = cpu;
+	w->node = _cpu_node(tq, cpu);
+	w->seed = 2463534242U + (unsigned int)index * 2654435761U;
+	_deque_init(&w->deque);
+
+	return w;
+}
+
+/* Passed to a new worker thread, which sets up its own state */
+typedef struct cfuthread_worker_start {
+	cfuthread_queue_t *tq;
+	size_t index;
+} cfuthread_worker_start;
+
+/* Sets up the calling thread as a worker and waits for the others,
+   since looking for work means looking in their deques.
+*/
+static cfuthread_worker *
+_start_worker(cfuthread_worker_start *start) {
+	cfuthread_queue_t *tq = start->tq;
+	size_t index = start->index;
+	cfuthread_worker *w = NULL;
+	int cpu = -1;
+
+	free(start);
+
+#ifdef CFUTHREAD_USE_AFFINITY
+	/* pin first, so the worker's memory is allocated on its node */
+	cpu = _pin_worker(tq, index);
+#endif
+	w = _new_worker(tq, index, cpu);
+	pthread_setspecific(worker_key, w);
+
+	pthread_mutex_lock(&tq->mutex);
+	tq->workers[index] = w;
+	tq->num_ready++;
+	pthread_cond_broadcast(&tq->cv);
+	while (tq->num_ready < tq->num_threads && !tq->stopping) {
+		pthread_cond_wait(&tq->cv, &tq->mutex);
+	}
+	pthread_mutex_unlock(&tq->mutex);
+
+	return w;
+}
+
+static void
+_run_worker(cfuthread_worker *w) {
+	cfuthread_queue_t *tq = w->tq;
+
+	if (tq->init_fn) {
+		tq->init_fn(tq->init_arg);
+	}
+
+	pthread_cleanup_push(_run_cleanup, tq);
+	_process_requests(w);
+	pthread_cleanup_pop(1);
+}
+
+static void *
+_run_queue(void *arg) {
+	_run_worker(_start_worker((cfuthread_worker_start *)arg));
+	return NULL;
+}
+
+static size_t
+_num_cpus(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0) return (size_t)n;
+#endif
+	return 1;
+}
+
+/* Called with tq->mutex held */
+static void
+_set_stopping(cfuthread_queue_t *tq) {
+#ifdef HAVE_ATOMIC_BUILTINS
+	/* also read without the mutex when routing requests */
+	CFU_ATOMIC_STORE(&tq->stopping, 1);
+#else
+	tq->stopping = 1;
+#endif
+	pthread_cond_broadcast(&tq->cv);
+	pthread_cond_broadcast(&tq->space_cv);
+}
+
+static void
+_join_threads(cfuthread_queue_t *tq, size_t count) {
+	size_t i = 0;
+	void *rv = NULL;
+
+	for (i = 0; i < count; i++) {
+		pthread_join(tq->threads[i], &rv);
+	}
+}
+
+/* Stops the first count workers when the queue fails to start */
+static void
+_stop_threads(cfuthread_queue_t *tq, size_t count) {
+	pthread_mutex_lock(&tq->mutex);
+	_set_stopping(tq);
+	pthread_mutex_unlock(&tq->mutex);
+
+	_join_threads(tq, count);
+}
+
+/* Cancels requests left in the node inboxes once the workers are
+   gone.  Called after stopping is set, so nothing is routed to an
+   inbox once its mutex has been taken here.
+*/
+static void
+_cancel_routed(cfuthread_queue_t *tq) {
+	cfuthread_queue_entry *requests = NULL;
+	size_t i = 0;
+
+	for (i = 0; tq->nodes && i < tq->num_nodes; i++) {
+		pthread_mutex_lock(&tq->nodes[i].mutex);
+		requests = tq->nodes[i].inbox.head;
+		tq->nodes[i].inbox.head = tq->nodes[i].inbox.tail = NULL;
+		tq->nodes[i].inbox.num_entries = 0;
+		tq->nodes[i].num_entries = 0;
+		pthread_mutex_unlock(&tq->nodes[i].mutex);
+		_cancel_requests(requests);
+	}
+}
+
+static void
+_free_queue(cfuthread_queue_t *tq) {
+	cfuthread_queue_entry *entry = NULL;
+	size_t i = 0;
+
+	while ( (entry = tq->free_entries) ) {
+		tq->free_entries = entry->next;
+		_destroy_cfuthread_entry(entry);
+	}
+
+	for (i = 0; i < tq->num_threads; i++) {
+		if (!tq->workers[i]) continue;
+		_deque_free(&tq->workers[i]->deque);
+		free(tq->workers[i]);
+	}
+	for (i = 0; tq->nodes && i < tq->num_nodes; i++) {
+		pthread_mutex_destroy(&tq->nodes[i].mutex);
+	}
+	pthread_mutex_destroy(&tq->mutex);
+	pthread_cond_destroy(&tq->cv);
+	pthread_cond_destroy(&tq->space_cv);
+	free(tq->nodes);
+	free(tq->cpu_nodes);
+	free(tq->cpus);
+	free(tq->threads);
+	free(tq->workers);
+	free(tq);
+}
+
+static cfuthread_queue_t *
+_new_queue(cfuthread_queue_fn_t fn, size_t num_threads, unsigned int flags,
+	const int *cpus, size_t num_cpus, cfuthread_queue_init_t init_fn, void *init_arg,
+	cfuthread_queue_cleanup_t cleanup_fn, void *cleanup_arg) {
+	cfuthread_queue_t *tq = NULL;
+	size_t i = 0;
+
+	pthread_once(&worker_key_once, _make_worker_key);
+
+	if (num_threads == 0) num_threads = _num_cpus();
+
+#ifndef HAVE_ATOMIC_BUILTINS
+	flags &= ~CFUTHREAD_QUEUE_WORK_STEALING;
+#endif
+	/* node inboxes are emptied by the work-stealing loop */
+	if (!(flags & CFUTHREAD_QUEUE_WORK_STEALING)) flags &= ~CFUTHREAD_QUEUE_NODE_ROUTING;
+	if (flags & CFUTHREAD_QUEUE_NODE_ROUTING) flags |= CFUTHREAD_QUEUE_PIN_WORKERS;
+#ifndef CFUTHREAD_USE_AFFINITY
+	flags &= ~(CFUTHREAD_QUEUE_PIN_WORKERS | CFUTHREAD_QUEUE_NODE_ROUTING);
+#endif
+
+	tq = calloc(1, sizeof(cfuthread_queue_t));
+	pthread_mutex_init(&tq->mutex, NULL);
+	pthread_cond_init(&tq->cv, NULL);
+	pthread_cond_init(&tq->space_cv, NULL);
+	tq->fn = fn;
+	tq->flags = flags;
+	tq->init_fn = init_fn;
+	tq->init_arg = init_arg;
+	tq->cleanup_fn = cleanup_fn;
+	tq->cleanup_arg = cleanup_arg;
+	tq->num_threads = num_threads;
+	if (flags & CFUTHREAD_QUEUE_STATS) tq->started_ns = _now_ns();
+
+	if (cpus && num_cpus > 0) {
+		tq->cpus = malloc(num_cpus * sizeof(int));
+		memcpy(tq->cpus, cpus, num_cpus * sizeof(int));
+		tq->num_cpus = num_cpus;
+	}
+#ifdef CFUTHREAD_USE_AFFINITY
+	if (flags & CFUTHREAD_QUEUE_PIN_WORKERS) _init_cpus(tq);
+	if (tq->num_cpus > 0) _init_cpu_nodes(tq);
+#endif
+	/* without any CPUs to map, every request goes to node 0 */
+	if (tq->num_nodes == 0) tq->num_nodes = 1;
+	if (flags & CFUTHREAD_QUEUE_NODE_ROUTING) {
+		tq->nodes = calloc(tq->num_nodes, sizeof(cfuthread_node));
+		for (i = 0; i < tq->num_nodes; i++) {
+			pthread_mutex_init(&tq->nodes[i].mutex, NULL);
+		}
+	}
+
+	tq->workers = calloc(num_threads, sizeof(cfuthread_worker *));
+	tq->threads = calloc(num_threads, sizeof(pthread_t));
+	for (i = 0; i < num_threads; i++) {
+		cfuthread_worker_start *start = malloc(sizeof(cfuthread_worker_start));
+		start->tq = tq;
+		start->index = i;
+		if ( (0 != pthread_create(&tq->threads[i], NULL, _run_queue, (void *)start)) ) {
+			free(start);
+			_stop_threads(tq, i);
+			_free_queue(tq);
+			return NULL;
+		}
+	}
+
+	/* the workers' state is read from other threads once they are ready */
+	pthread_mutex_lock(&tq->mutex);
+	while (tq->num_ready < num_threads) {
+		pthread_cond_wait(&tq->cv, &tq->mutex);
+	}
+	pthread_mutex_unlock(&tq->mutex);
+
+	return tq;
+}
+
+cfuthread_queue_t *
+cfuthread_queue_new_with_flags(cfuthread_queue_fn_t fn, size_t num_threads,
+	unsigned int flags, cfuthread_queue_init_t init_fn, void *init_arg,
+	cfuthread_queue_cleanup_t cleanup_fn, void *cleanup_arg) {
+	return _new_queue(fn, num_threads, flags, NULL, 0, init_fn, init_arg, cleanup_fn,
+		cleanup_arg);
+}
+
+cfuthread_queue_t *
+cfuthread_queue_new_with_cpus(cfuthread_queue_fn_t fn, const int *cpus, size_t num_cpus,
+	unsigned int flags, cfuthread_queue_init_t init_fn, void *init_arg,
+	cfuthread_queue_cleanup_t cleanup_fn, void *cleanup_arg) {
+	return _new_queue(fn, num_cpus, flags, cpus, num_cpus, init_fn, init_arg, cleanup_fn,
+		cleanup_arg);
+}
+
+cfuthread_queue_t *
+cfuthread_queue_new_with_threads(cfuthread_queue_fn_t fn, size_t num_threads,
+	cfuthread_queue_init_t init_fn, void *init_arg, cfuthread_queue_cleanup_t cleanup_fn,
+	void *cleanup_arg) {
+	return cfuthread_queue_new_with_flags(fn, num_threads, 0, init_fn, init_arg,
+		cleanup_fn, cleanup_arg);
+}
+
+cfuthread_queue_t *
+cfuthread_queue_new_with_cleanup(cfuthread_queue_fn_t fn, cfuthread_queue_init_t init_fn,
+	void *init_arg, cfuthread_queue_cleanup_t cleanup_fn,
+	void *cleanup_arg) {
+	return cfuthread_queue_new_with_threads(fn, 1, init_fn, init_arg, cleanup_fn,
+		cleanup_arg);
+}
+
+cfuthread_queue_t *
+cfuthread_queue_new(cfuthread_queue_fn_t fn) {
+	return cfuthread_queue_new_with_cleanup(fn, NULL, NULL, NULL, NULL);
+}
+
+size_t
+cfuthread_queue_num_threads(cfuthread_queue_t *tq) {
+	return tq->num_threads;
+}
+
+int
+cfuthread_queue_worker_cpu(cfuthread_queue_t *tq, size_t worker) {
+	if (worker >= tq->num_threads) return -1;
+	return tq->workers[worker]->cpu;
+}
+
+int
+cfuthread_queue_worker_node(cfuthread_queue_t *tq, size_t worker) {
+	if (worker >= tq->num_threads) return -1;
+	return tq->workers[worker]->node;
+}
+
+unsigned int
+cfuthread_queue_get_flags(cfuthread_queue_t *tq) {
+	return tq->flags;
+}
+
+/* While a worker waits on a request it made itself, it keeps running
+   other requests so that recursive requests cannot starve the pool.
+*/
+static void
+_help_until_done(cfuthread_worker *w, cfuthread_queue_entry *request) {
+#ifdef HAVE_ATOMIC_BUILTINS
+	cfuthread_queue_t *tq = w->tq;
+	cfuthread_queue_entry *other = NULL;
+
+	while (!_entry_is_done(request)) {
+		if (!(other = _find_work(w))) {
+			pthread_mutex_lock(&tq->mutex);
+			other = _take_request(tq);
+			pthread_mutex_unlock(&tq->mutex);
+		}
+		if (!other) break;
+		_process_request(w, other);
+	}
+#else
+	w = w;
+	request = request;
+#endif
+}
+
+static int
+_valid_priority(int priority) {
+	if (priority < 0 || priority >= CFUTHREAD_QUEUE_NUM_PRIORITIES) {
+		return CFUTHREAD_QUEUE_PRIORITY_LOW;
+	}
+	return priority;
+}
+
+static cfuthread_queue_future_t *
+_submit(cfuthread_queue_t *tq, void *data, int priority,
+	cfuthread_queue_callback_t callback, void *callback_arg) {
+	cfuthread_queue_entry *request = _new_cfuthread_entry(tq, data, 1);
+
+	request->priority = _valid_priority(priority);
+	request->callback = callback;
+	request->callback_arg = callback_arg;
+	_enqueue_request(tq, request);
+
+	return request;
+}
+
+cfuthread_queue_future_t *
+cfuthread_queue_submit_with_callback(cfuthread_queue_t *tq, void *data,
+	cfuthread_queue_callback_t callback, void *callback_arg) {
+	return _submit(tq, data, CFUTHREAD_QUEUE_PRIORITY_NORMAL, callback, callback_arg);
+}
+
+cfuthread_queue_future_t *
+cfuthread_queue_submit(cfuthread_queue_t *tq, void *data) {
+	return _submit(tq, data, CFUTHREAD_QUEUE_PRIORITY_NORMAL, NULL, NULL);
+}
+
+cfuthread_queue_future_t *
+cfuthread_queue_submit_with_priority(cfuthread_queue_t *tq, void *data, int priority) {
+	return _submit(tq, data, priority, NULL, NULL);
+}
+
+int
+cfuthread_queue_future_status(cfuthread_queue_future_t *future) {
+	switch (_entry_state(future)) {
+	  case CFUTHREAD_ENTRY_DONE:
+		  return CFUTHREAD_QUEUE_DONE;
+	  case CFUTHREAD_ENTRY_CANCELED:
+		  return CFUTHREAD_QUEUE_CANCELED;
+	  default:
+		  return CFUTHREAD_QUEUE_PENDING;
+	}
+}
+
+int
+cfuthread_queue_future_try_get(cfuthread_queue_future_t *future, void **data_out) {
+	if (!_entry_is_done(future)) return 0;
+	if (data_out) *data_out = future->data_out;
+	return 1;
+}
+
+void *
+cfuthread_queue_future_wait(cfuthread_queue_future_t *future) {
+	cfuthread_worker *w = NULL;
+
+	if ( (w = _current_worker(future->tq)) ) {
+		_help_until_done(w, future);
+	}
+	_entry_wait(future);
+
+	return future->data_out;
+}
+
+int
+cfuthread_queue_future_timed_wait(cfuthread_queue_future_t *future, double timeout,
+	void **data_out) {
+	if (timeout < 0) timeout = 0;
+	if (!_entry_timed_wait(future, timeout)) return 0;
+	if (data_out) *data_out = future->data_out;
+	return 1;
+}
+
+void
+cfuthread_queue_future_destroy(cfuthread_queue_future_t *future) {
+	if (!future) return;
+	/* the queue may be gone by now */
+	_release_cfuthread_entry(future, NULL);
+}
+
+int
+cfuthread_queue_post_with_priority(cfuthread_queue_t *tq, void *data, int priority) {
+	cfuthread_queue_entry *request = _new_cfuthread_entry(tq, data, 0);
+
+	request->priority = _valid_priority(priority);
+	return _enqueue_request(tq, request);
+}
+
+int
+cfuthread_queue_post(cfuthread_queue_t *tq, void *data) {
+	return cfuthread_queue_post_with_priority(tq, data, CFUTHREAD_QUEUE_PRIORITY_NORMAL);
+}
+
+int
+cfuthread_queue_post_batch(cfuthread_queue_t *tq, void **data, size_t count) {
+	cfuthread_queue_entry *head = NULL;
+	cfuthread_queue_entry *tail = NULL;
+	cfuthread_queue_entry *request = NULL;
+	size_t i = 0;
+
+	if (count == 0) return 0;
+	if (!data) return -1;
+
+	/* link the whole batch so it can be queued under a single lock */
+	for (i = 0; i < count; i++) {
+		request = _new_cfuthread_entry(tq, data[i], 0);
+		if (tail) {
+			tail->next = request;
+		} else {
+			head = request;
+		}
+		tail = request;
+	}
+	return _enqueue_requests(tq, head, count);
+}
+
+void *
+cfuthread_queue_make_request(cfuthread_queue_t * tq, void *data) {
+	cfuthread_queue_future_t *request = cfuthread_queue_submit(tq, data);
+
+	data = cfuthread_queue_future_wait(request);
+	cfuthread_queue_future_destroy(request);
+
+	return data;
+}
+
+int
+cfuthread_queue_set_capacity(cfuthread_queue_t *tq, size_t capacity, int overflow) {
+	if (overflow != CFUTHREAD_QUEUE_BLOCK && overflow != CFUTHREAD_QUEUE_FAIL
+		&& overflow != CFUTHREAD_QUEUE_DROP_OLDEST) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&tq->mutex);
+#ifdef HAVE_ATOMIC_BUILTINS
+	/* also read without the mutex when routing requests */
+	CFU_ATOMIC_STORE(&tq->capacity, capacity);
+#else
+	tq->capacity = capacity;
+#endif
+	tq->overflow = overflow;
+	/* the new limit or policy may let blocked submitters through */
+	pthread_cond_broadcast(&tq->space_cv);
+	pthread_mutex_unlock(&tq->mutex);
+
+	return 0;
+}
+
+size_t
+cfuthread_queue_get_capacity(cfuthread_queue_t *tq) {
+	size_t capacity = 0;
+
+	pthread_mutex_lock(&tq->mutex);
+	capacity = tq->capacity;
+	pthread_mutex_unlock(&tq->mutex);
+
+	return capacity;
+}
+
+size_t
+cfuthread_queue_depth(cfuthread_queue_t *tq) {
+	size_t depth = 0;
+
+	pthread_mutex_lock(&tq->mutex);
+	depth = tq->num_requests;
+#ifdef HAVE_ATOMIC_BUILTINS
+	depth += (size_t)CFU_ATOMIC_LOAD(&tq->num_queued);
+#endif
+	pthread_mutex_unlock(&tq->mutex);
+
+	return depth;
+}
+
+size_t
+cfuthread_queue_max_depth(cfuthread_queue_t *tq) {
+	size_t max_depth = 0;
+
+	pthread_mutex_lock(&tq->mutex);
+	max_depth = tq->max_depth;
+	pthread_mutex_unlock(&tq->mutex);
+
+	return max_depth;
+}
+
+size_t
+cfuthread_queue_num_blocked(cfuthread_queue_t *tq) {
+	size_t num_blocked = 0;
+
+	pthread_mutex_lock(&tq->mutex);
+	num_blocked = tq->num_blocked;
+	pthread_mutex_unlock(&tq->mutex);
+
+	return num_blocked;
+}
+
+size_t
+cfuthread_queue_num_rejected(cfuthread_queue_t *tq) {
+	size_t num_rejected = 0;
+
+	pthread_mutex_lock(&tq->mutex);
+	num_rejected = tq->num_rejected;
+	pthread_mutex_unlock(&tq->mutex);
+
+	return num_rejected;
+}
+
+size_t
+cfuthread_queue_num_dropped(cfuthread_queue_t *tq) {
+	size_t num_dropped = 0;
+
+	pthread_mutex_lock(&tq->mutex);
+	num_dropped = tq->num_dropped;
+	pthread_mutex_unlock(&tq->mutex);
+
+	return num_dropped;
+}
+
+static void
+_add_worker_stats(cfuthread_worker *w, cfuthread_queue_stats_t *stats) {
+	size_t i = 0;
+
+	stats->num_requests += _stat_load(&w->stats.num_requests);
+	stats->wait_ns += _stat_load(&w->stats.wait_ns);
+	stats->exec_ns += _stat_load(&w->stats.exec_ns);
+	for (i = 0; i < CFUTHREAD_QUEUE_STATS_BUCKETS; i++) {
+		stats->wait_hist[i] += _stat_load(&w->stats.wait_hist[i]);
+		stats->exec_hist[i] += _stat_load(&w->stats.exec_hist[i]);
+		stats->depth_hist[i] += _stat_load(&w->stats.depth_hist[i]);
+	}
+}
+
+static void
+_finish_stats(cfuthread_queue_t *tq, cfuthread_queue_stats_t *stats, size_t num_workers) {
+	stats->elapsed_ns = (_now_ns() - tq->started_ns) * num_workers;
+	stats->utilization = stats->elapsed_ns ?
+		(double)stats->exec_ns / (double)stats->elapsed_ns : 0.0;
+	/* clock granularity can still push it slightly over */
+	if (stats->utilization > 1.0) stats->utilization = 1.0;
+}
+
+int
+cfuthread_queue_get_stats(cfuthread_queue_t *tq, cfuthread_queue_stats_t *stats) {
+	size_t i = 0;
+
+	if (!(tq->flags & CFUTHREAD_QUEUE_STATS)) return -1;
+
+	memset(stats, 0, sizeof(cfuthread_queue_stats_t));
+	for (i = 0; i < tq->num_threads; i++) {
+		_add_worker_stats(tq->workers[i], stats);
+	}
+	_finish_stats(tq, stats, tq->num_threads);
+
+	return 0;
+}
+
+int
+cfuthread_queue_get_worker_stats(cfuthread_queue_t *tq, size_t worker,
+	cfuthread_queue_stats_t *stats) {
+	if (!(tq->flags & CFUTHREAD_QUEUE_STATS) || worker >= tq->num_threads) return -1;
+
+	memset(stats, 0, sizeof(cfuthread_queue_stats_t));
+	_add_worker_stats(tq->workers[worker], stats);
+	_finish_stats(tq, stats, 1);
+
+	return 0;
+}
+
+int
+cfuthread_queue_shutdown(cfuthread_queue_t *tq, int how, size_t *num_drained) {
+	cfuthread_queue_entry *discarded = NULL;
+	size_t pending = 0;
+
+	pthread_mutex_lock(&tq->mutex);
+	if (tq->stopping) {
+		pthread_mutex_unlock(&tq->mutex);
+		return -1;
+	}
+	_set_stopping(tq);
+	pending = tq->num_requests;
+#ifdef HAVE_ATOMIC_BUILTINS
+	pending += (size_t)CFU_ATOMIC_LOAD(&tq->num_queued);
+#endif
+	if (how == CFUTHREAD_QUEUE_DISCARD) {
+#ifdef HAVE_ATOMIC_BUILTINS
+		CFU_ATOMIC_STORE(&tq->discarding, 1);
+#else
+		tq->discarding = 1;
+#endif
+		discarded = _take_all_requests(tq);
+	}
+	pthread_mutex_unlock(&tq->mutex);
+
+	_cancel_requests(discarded);
+
+	_join_threads(tq, tq->num_threads);
+	_cancel_routed(tq);
+
+	if (num_drained) *num_drained = (how == CFUTHREAD_QUEUE_DISCARD) ? 0 : pending;
+
+	return 0;
+}
+
+void
+cfuthread_queue_destroy(cfuthread_queue_t *tq) {
+	cfuthread_queue_shutdown(tq, CFUTHREAD_QUEUE_DRAIN, NULL);
+	_free_queue(tq);
 }
@@ -39,6 +39,8 @@
 #define CFUTHREAD_QUEUE_H
 
 #include <cfu.h>
+#include <stddef.h>
+#include <stdint.h>
 
 CFU_BEGIN_DECLS
 
@@ -51,6 +53,10 @@ CFU_BEGIN_DECLS
  * Once something is added, the thread will process the data by
  * calling the function you pass as an argument to the
  * cfuthread_queue_new() function.
+ *
+ * If the resource can be used from several threads at once,
+ * cfuthread_queue_new_with_threads() starts a pool of worker
+ * threads that all take requests from the same queue.
  */
 
 typedef struct cfuthread_queue cfuthread_queue_t;
@@ -59,6 +65,37 @@ typedef void * (*cfuthread_queue_fn_t)(void *arg);
 typedef void (*cfuthread_queue_init_t)(void *arg);
 typedef void (*cfuthread_queue_cleanup_t)(void *arg);
 
+/* Handle for a request made with cfuthread_queue_submit(). */
+typedef struct cfuthread_queue_entry cfuthread_queue_future_t;
+
+/* Prototype for a function called in the worker thread once a
+ * request submitted with cfuthread_queue_submit_with_callback() has
+ * been processed.  data_out is the return value of fn.
+ */
+typedef void (*cfuthread_queue_callback_t)(void *data_in, void *data_out, void *arg);
+
+/* Number of buckets in the histograms below.  Bucket 0 counts
+ * zero values and bucket i counts values from 2^(i-1) to 2^i - 1.
+ * The last bucket also counts anything larger.
+ */
+#define CFUTHREAD_QUEUE_STATS_BUCKETS 40
+
+/* Statistics kept for queues created with CFUTHREAD_QUEUE_STATS.
+ * Times are in nanoseconds.
+ */
+typedef struct cfuthread_queue_stats {
+	uint64_t num_requests; /* requests processed */
+	uint64_t wait_ns;      /* total time from being queued to starting */
+	uint64_t exec_ns;      /* total time spent in fn and callbacks, not counting
+	                          other requests run while waiting on nested ones */
+	uint64_t elapsed_ns;   /* time since the queue was created, per worker */
+	double utilization;    /* exec_ns / elapsed_ns, at most 1.0 */
+	uint64_t wait_hist[CFUTHREAD_QUEUE_STATS_BUCKETS];
+	uint64_t exec_hist[CFUTHREAD_QUEUE_STATS_BUCKETS];
+	/* number of requests already queued when each one was made */
+	uint64_t depth_hist[CFUTHREAD_QUEUE_STATS_BUCKETS];
+} cfuthread_queue_stats_t;
+
 /* Creates a new thread queue structure that will run the given
  * function when a request is received.
 */
@@ -74,17 +111,251 @@ cfuthread_queue_t * cfuthread_queue_new_with_cleanup(cfuthread_queue_fn_t fn,
 	cfuthread_queue_init_t init_fn, void *init_arg, cfuthread_queue_cleanup_t cleanup_fn,
 	void *cleanup_arg);
 
+/* Same as cfuthread_queue_new_with_cleanup(), but starts num_threads
+ * worker threads sharing the same request queue.  init_fn and
+ * cleanup_fn are called once in each worker.  If num_threads is
+ * zero, one worker is started per online CPU.
+ */
+cfuthread_queue_t * cfuthread_queue_new_with_threads(cfuthread_queue_fn_t fn,
+	size_t num_threads, cfuthread_queue_init_t init_fn, void *init_arg,
+	cfuthread_queue_cleanup_t cleanup_fn, void *cleanup_arg);
+
+/* Same as cfuthread_queue_new_with_threads(), with the specified
+ * flags.  Pass zero for flags if you want the defaults.  See below
+ * for flag definitions.
+ */
+cfuthread_queue_t * cfuthread_queue_new_with_flags(cfuthread_queue_fn_t fn,
+	size_t num_threads, unsigned int flags, cfuthread_queue_init_t init_fn,
+	void *init_arg, cfuthread_queue_cleanup_t cleanup_fn, void *cleanup_arg);
+
+/* Same as cfuthread_queue_new_with_flags(), but starts one worker
+ * for each of the num_cpus CPUs in cpus, pinned to that CPU where
+ * the platform supports it.
+ */
+cfuthread_queue_t * cfuthread_queue_new_with_cpus(cfuthread_queue_fn_t fn,
+	const int *cpus, size_t num_cpus, unsigned int flags, cfuthread_queue_init_t init_fn,
+	void *init_arg, cfuthread_queue_cleanup_t cleanup_fn, void *cleanup_arg);
+
+/* Returns the number of worker threads serving the queue. */
+size_t cfuthread_queue_num_threads(cfuthread_queue_t *tq);
+
+/* Returns the CPU the worker numbered worker (starting from zero)
+ * is pinned to, or -1 if it is not pinned.
+ */
+int cfuthread_queue_worker_cpu(cfuthread_queue_t *tq, size_t worker);
+
+/* Returns the NUMA node of the worker numbered worker.  Workers that
+ * are not pinned are reported on node 0.
+ */
+int cfuthread_queue_worker_node(cfuthread_queue_t *tq, size_t worker);
+
+/* Returns the queue's flags.  Flags the platform cannot support
+ * are cleared when the queue is created.
+ */
+unsigned int cfuthread_queue_get_flags(cfuthread_queue_t *tq);
+
+/* Limits the shared request queue to capacity requests, or lifts
+ * the limit if capacity is zero (the default).  overflow says what
+ * happens to a request made while the queue is full:
+ * CFUTHREAD_QUEUE_BLOCK waits for room, CFUTHREAD_QUEUE_FAIL
+ * cancels it and makes cfuthread_queue_post() fail, and
+ * CFUTHREAD_QUEUE_DROP_OLDEST cancels the oldest request of the
+ * lowest priority to make room, or the new request if everything
+ * queued has a higher priority.  Requests made by the workers themselves are always
+ * queued.  Returns zero on success, less than zero if overflow is
+ * not valid.
+ */
+int cfuthread_queue_set_capacity(cfuthread_queue_t *tq, size_t capacity, int overflow);
+
+/* Returns the capacity of the queue, zero if it is unbounded. */
+size_t cfuthread_queue_get_capacity(cfuthread_queue_t *tq);
+
+/* Returns the number of requests waiting to be processed. */
+size_t cfuthread_queue_depth(cfuthread_queue_t *tq);
+
+/* Returns the largest number of requests the shared queue has held. */
+size_t cfuthread_queue_max_depth(cfuthread_queue_t *tq);
+
+/* Returns the number of threads currently waiting for room in the
+ * queue.
+ */
+size_t cfuthread_queue_num_blocked(cfuthread_queue_t *tq);
+
+/* Returns the number of requests canceled because the queue was
+ * full, with CFUTHREAD_QUEUE_FAIL and CFUTHREAD_QUEUE_DROP_OLDEST
+ * respectively.
+ */
+size_t cfuthread_queue_num_rejected(cfuthread_queue_t *tq);
+size_t cfuthread_queue_num_dropped(cfuthread_queue_t *tq);
+
 /* Add a request to the queue.  data will get passed to the
  * function fn given to cfuthread_queue_new when it reaches the
  * front of the queue.
  */
 void * cfuthread_queue_make_request(cfuthread_queue_t * tq, void *data);
 
-/* Free up resources used by the queue, in addition to canceling
- * the thread.
+/* Add a request to the queue without waiting for it to be
+ * processed.  Returns a future that can be used to get the return
+ * value of fn.  The future must be released with
+ * cfuthread_queue_future_destroy().
+ */
+cfuthread_queue_future_t * cfuthread_queue_submit(cfuthread_queue_t *tq, void *data);
+
+/* Same as cfuthread_queue_submit(), but also calls callback with
+ * callback_arg in the worker thread after fn returns, before any
+ * waiters on the future are woken up.
+ */
+cfuthread_queue_future_t * cfuthread_queue_submit_with_callback(cfuthread_queue_t *tq,
+	void *data, cfuthread_queue_callback_t callback, void *callback_arg);
+
+/* Same as cfuthread_queue_submit(), but the request is queued with
+ * the given priority, one of the CFUTHREAD_QUEUE_PRIORITY_* values
+ * below.  Requests are taken highest priority first, and in the
+ * order they were made within a priority.
+ */
+cfuthread_queue_future_t * cfuthread_queue_submit_with_priority(cfuthread_queue_t *tq,
+	void *data, int priority);
+
+/* Add a request to the queue without waiting for it to be
+ * processed and without any way to get its result.  This is
+ * cheaper than cfuthread_queue_submit() since nothing needs to be
+ * set up for a waiter.  Returns zero on success, less than zero on
+ * error.
+ */
+int cfuthread_queue_post(cfuthread_queue_t *tq, void *data);
+
+/* Same as cfuthread_queue_post(), with the given priority. */
+int cfuthread_queue_post_with_priority(cfuthread_queue_t *tq, void *data, int priority);
+
+/* Same as cfuthread_queue_post() for each of the count elements of
+ * data, taking the queue lock and waking the workers only once for
+ * the whole batch.  Returns less than zero if any of them was not
+ * queued.  With CFUTHREAD_QUEUE_FAIL, either the whole batch fits
+ * or none of it is queued.
+ */
+int cfuthread_queue_post_batch(cfuthread_queue_t *tq, void **data, size_t count);
+
+/* Returns CFUTHREAD_QUEUE_PENDING, CFUTHREAD_QUEUE_DONE, or
+ * CFUTHREAD_QUEUE_CANCELED if the request was dropped by
+ * cfuthread_queue_shutdown() or made after it, or did not fit in a
+ * bounded queue.
+ */
+int cfuthread_queue_future_status(cfuthread_queue_future_t *future);
+
+/* Waits for the request to be processed and returns the return
+ * value of fn, or NULL if the request was canceled.
+ */
+void * cfuthread_queue_future_wait(cfuthread_queue_future_t *future);
+
+/* Waits at most timeout seconds for the request to be processed.
+ * Returns true (1) and stores the return value of fn in data_out if
+ * it is not NULL, or false (0) if the request is still pending.  A
+ * canceled request counts as processed, with a NULL return value.
+ */
+int cfuthread_queue_future_timed_wait(cfuthread_queue_future_t *future, double timeout,
+	void **data_out);
+
+/* Same as cfuthread_queue_future_timed_wait(), but does not wait. */
+int cfuthread_queue_future_try_get(cfuthread_queue_future_t *future, void **data_out);
+
+/* Releases the future.  This may be called before the request has
+ * been processed, in which case the result is discarded.
+ */
+void cfuthread_queue_future_destroy(cfuthread_queue_future_t *future);
+
+/* Fills in stats with the totals over all workers.  Each worker
+ * keeps its own statistics without locking, so they can be read at
+ * any time but may be slightly behind.  Returns zero on success,
+ * less than zero if the queue was not created with
+ * CFUTHREAD_QUEUE_STATS.
+ */
+int cfuthread_queue_get_stats(cfuthread_queue_t *tq, cfuthread_queue_stats_t *stats);
+
+/* Same as cfuthread_queue_get_stats(), for the worker numbered
+ * worker, starting from zero.
+ */
+int cfuthread_queue_get_worker_stats(cfuthread_queue_t *tq, size_t worker,
+	cfuthread_queue_stats_t *stats);
+
+/* Stops the queue.  Requests made after this from outside the
+ * workers are canceled: cfuthread_queue_post() fails and futures
+ * are returned already canceled.  If how is CFUTHREAD_QUEUE_DRAIN,
+ * the requests already queued are processed first, along with any
+ * made by the workers while doing so.  If how is
+ * CFUTHREAD_QUEUE_DISCARD, queued requests are canceled instead;
+ * their callbacks are not called.  Waits for every worker to run
+ * its cleanup function and exit.  If num_drained is not NULL, it is
+ * set to the number of requests that were queued when draining
+ * started.  Returns zero on success, less than zero if the queue
+ * was already shut down.
+ */
+int cfuthread_queue_shutdown(cfuthread_queue_t *tq, int how, size_t *num_drained);
+
+/* Free up resources used by the queue.  If the queue has not been
+ * shut down, the queued requests are drained and the worker threads
+ * joined first.
  */
 void cfuthread_queue_destroy(cfuthread_queue_t *);
 
+/* request priorities, highest first; the default is
+ * CFUTHREAD_QUEUE_PRIORITY_NORMAL.  Values out of range are taken as
+ * CFUTHREAD_QUEUE_PRIORITY_LOW.
+ */
+#define CFUTHREAD_QUEUE_PRIORITY_HIGH 0
+#define CFUTHREAD_QUEUE_PRIORITY_NORMAL 1
+#define CFUTHREAD_QUEUE_PRIORITY_LOW 2
+#define CFUTHREAD_QUEUE_NUM_PRIORITIES 3
+
+/* values for overflow in cfuthread_queue_set_capacity() */
+#define CFUTHREAD_QUEUE_BLOCK 0
+#define CFUTHREAD_QUEUE_FAIL 1
+#define CFUTHREAD_QUEUE_DROP_OLDEST 2
+
+/* values for how in cfuthread_queue_shutdown() */
+#define CFUTHREAD_QUEUE_DRAIN 0
+#define CFUTHREAD_QUEUE_DISCARD 1
+
+/* values returned by cfuthread_queue_future_status() */
+#define CFUTHREAD_QUEUE_PENDING 0
+#define CFUTHREAD_QUEUE_DONE 1
+#define CFUTHREAD_QUEUE_CANCELED 2
+
+/* thread queue flags */
+
+/* Give each worker its own deque.  Requests made from inside a
+ * worker are pushed onto that worker's deque and taken back newest
+ * first; idle workers steal the oldest requests from the others.
+ * Requests from other threads, and those made with a priority other
+ * than CFUTHREAD_QUEUE_PRIORITY_NORMAL, still go through the shared
+ * queue.  High priority requests there are taken before a worker's
+ * own.
+ * A worker waiting on its own request keeps running other requests
+ * meanwhile, so requests may be made recursively from fn.
+ */
+#define CFUTHREAD_QUEUE_WORK_STEALING 1
+
+/* Keep the statistics returned by cfuthread_queue_get_stats().  This
+ * costs two or three clock readings per request.
+ */
+#define CFUTHREAD_QUEUE_STATS 2
+
+/* Pin worker i to the i-th CPU the process is allowed to run on,
+ * wrapping around if there are more workers than CPUs.  Each worker
+ * allocates its own state after being pinned, so that it is local
+ * to the worker's NUMA node.
+ */
+#define CFUTHREAD_QUEUE_PIN_WORKERS 4
+
+/* Route requests made from outside the workers to the workers on
+ * the submitter's NUMA node.  Each node gets an inbox that its
+ * workers check before stealing from other workers; workers on
+ * other nodes only take from it when they run out of work.  Only
+ * applies to requests of CFUTHREAD_QUEUE_PRIORITY_NORMAL on queues
+ * without a capacity limit.  Requires CFUTHREAD_QUEUE_WORK_STEALING
+ * and implies CFUTHREAD_QUEUE_PIN_WORKERS.
+ */
+#define CFUTHREAD_QUEUE_NODE_ROUTING 8
+
 CFU_END_DECLS
 
 #endif
@@ -14,11 +14,13 @@
 
 #include "cfu.h"
 #include "cfutimer.h"
+#include "cfuatomic.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <time.h>
+#include <math.h>
 
 #ifdef HAVE_SYS_TIME_H
 # include <sys/time.h>
@@ -34,6 +36,7 @@
 # define TIMEVALUE_TYPE    FILETIME
 # define TIMEVALUE_NOW(tv) GetSystemTimeAsFileTime(&(tv))
 # define TIMEVALUE_SEC(tv) ((double)(((uint64_t)(tv).dwHighDataTime << 32) + (tv).dwLowDateTime) * 10000000.0)
+# define TIMEVALUE_NSEC(tv) ((((uint64_t)(tv).dwHighDateTime << 32) + (tv).dwLowDateTime) * 100)
 /* another option for windows, also untested
 #define TIMEVALUE_TYPE LARGE_INTEGER
 // future: set thread afinity mask
@@ -52,16 +55,19 @@ static INLINE double timevalue_sec_(TIMEVALUE_TYPE *tv) {
 #  define TIMEVALUE_TYPE    struct timespec
 #  define TIMEVALUE_NOW(tv) clock_gettime(CLOCK_MONOTONIC, &(tv))
 #  define TIMEVALUE_SEC(tv) ((double)(tv).tv_sec + ((double) (tv).tv_nsec / 1000000000.0))
+#  define TIMEVALUE_NSEC(tv) ((uint64_t)(tv).tv_sec * 1000000000 + (uint64_t)(tv).tv_nsec)
 /* For non-Windows systems that don't have the more accurate clock_gettime()
  * then use the gettimeofday() function from POSIX if available. */
 # elif defined(HAVE_GETTIMEOFDAY)
 #  define TIMEVALUE_TYPE    struct timeval
 #  define TIMEVALUE_NOW(tv) gettimeofday(&(tv), NULL)
 #  define TIMEVALUE_SEC(tv) ((double)(tv).tv_sec + ((double) (tv).tv_usec / 1000000.0))
+#  define TIMEVALUE_NSEC(tv) ((uint64_t)(tv).tv_sec * 1000000000 + (uint64_t)(tv).tv_usec * 1000)
 # else /* Fall-back to time() from stdlib */
 #  define TIMEVALUE_TYPE    time_t
 #  define TIMEVALUE_NOW(tv) time(&(tv))
 #  define TIMEVALUE_SEC(tv) ((double)(tv))
+#  define TIMEVALUE_NSEC(tv) ((uint64_t)(tv) * 1000000000)
 # endif
 #endif
 
@@ -99,3 +105,266 @@ void cfutimer_free(cfutimer_t *timer)
 {
 	free(timer);
 }
+
+uint64_t cfutimer_monotonic_ns(void)
+{
+	TIMEVALUE_TYPE tv;
+	TIMEVALUE_NOW(tv);
+	return TIMEVALUE_NSEC(tv);
+}
+
+/* How long to count cycles for when calibrating, in nanoseconds. */
+#define CYCLES_CALIBRATE_NS 10000000
+
+/* Nanoseconds per cycle as a 32.32 fixed-point number, or 0 until the
+ * counter has been calibrated. Racing calibrations store nearly the
+ * same value, so no locking is needed. */
+static uint64_t cycles_mult = 0;
+
+#ifdef HAVE_ATOMIC_BUILTINS
+# define CYCLES_MULT_LOAD() CFU_ATOMIC_LOAD_RELAXED(&cycles_mult)
+# define CYCLES_MULT_STORE(val) CFU_ATOMIC_STORE_RELAXED(&cycles_mult, (val))
+#else
+# define CYCLES_MULT_LOAD() (cycles_mult)
+# define CYCLES_MULT_STORE(val) (cycles_mult = (val))
+#endif
+
+void cfutimer_cycles_calibrate(void)
+{
+	uint64_t mult = (uint64_t)1 << 32;
+#if CFUTIMER_HAVE_CYCLE_COUNTER && defined(__aarch64__)
+	/* The generic timer reports its own frequency. */
+	uint64_t freq;
+	__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+	if (freq)
+		mult = ((uint64_t)1000000000 << 32) / freq;
+#elif CFUTIMER_HAVE_CYCLE_COUNTER
+	uint64_t ns0, ns1, c0, c1;
+
+	/* Sample the counter between two clock reads on either end, so that
+	 * it is taken at about the middle of each. */
+	ns0 = cfutimer_monotonic_ns();
+	c0 = cfutimer_cycles_now();
+	ns0 = (ns0 + cfutimer_monotonic_ns()) / 2;
+	do {
+		ns1 = cfutimer_monotonic_ns();
+		c1 = cfutimer_cycles_now();
+		ns1 = (ns1 + cfutimer_monotonic_ns()) / 2;
+	} while (ns1 - ns0 < CYCLES_CALIBRATE_NS);
+
+	if (c1 > c0)
+		mult = ((ns1 - ns0) << 32) / (c1 - c0);
+#endif
+	CYCLES_MULT_STORE(mult);
+}
+
+uint64_t cfutimer_cycles_to_ns(uint64_t cycles)
+{
+	uint64_t mult = CYCLES_MULT_LOAD();
+	if (!mult) {
+		cfutimer_cycles_calibrate();
+		mult = CYCLES_MULT_LOAD();
+	}
+	/* Split the multiplication so that it cannot overflow before the
+	 * shift, without needing 128-bit integers. */
+	return (cycles >> 32) * mult + (((cycles & 0xffffffff) * mult) >> 32);
+}
+
+uint64_t cfutimer_cycles_elapsed_ns(const cfutimer_cycles_t *timer)
+{
+	return cfutimer_cycles_to_ns(timer->t2 - timer->t1);
+}
+
+/* Histogram buckets are log-linear, as in HDR histograms: values below
+ * STATS_SUB_BUCKETS each get their own bucket, and above that each
+ * power of two is split into STATS_SUB_BUCKETS equal buckets. */
+#define STATS_SUB_BITS 5
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_NUM_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+struct cfutimer_stats
+{
+	libcfu_type type;
+	uint64_t start;
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	double mean;
+	double m2; /* sum of squared differences from the mean */
+	uint64_t buckets[STATS_NUM_BUCKETS];
+};
+
+static int stats_msb(uint64_t v)
+{
+#ifdef __GNUC__
+	return 63 - __builtin_clzll(v);
+#else
+	int bit = 0;
+	while (v >>= 1)
+		bit++;
+	return bit;
+#endif
+}
+
+static size_t stats_bucket(uint64_t ns)
+{
+	int shift;
+	if (ns < STATS_SUB_BUCKETS)
+		return (size_t)ns;
+	shift = stats_msb(ns) - STATS_SUB_BITS;
+	return ((size_t)(shift + 1) << STATS_SUB_BITS) + (size_t)((ns >> shift) - STATS_SUB_BUCKETS);
+}
+
+/* Return the largest value that falls in the given bucket. */
+static uint64_t stats_bucket_max(size_t bucket)
+{
+	int shift;
+	uint64_t top;
+	if (bucket < STATS_SUB_BUCKETS)
+		return (uint64_t)bucket;
+	shift = (int)(bucket >> STATS_SUB_BITS) - 1;
+	top = STATS_SUB_BUCKETS + (bucket & (STATS_SUB_BUCKETS - 1));
+	return (top << shift) + (((uint64_t)1 << shift) - 1);
+}
+
+cfutimer_stats_t *cfutimer_stats_new(void)
+{
+	cfutimer_stats_t *stats = calloc(1, sizeof(cfutimer_stats_t));
+	stats->type = libcfu_t_timer;
+	return stats;
+}
+
+void cfutimer_stats_add(cfutimer_stats_t *stats, uint64_t ns)
+{
+	double delta;
+
+	if (!stats->count || ns < stats->min)
+		stats->min = ns;
+	if (ns > stats->max)
+		stats->max = ns;
+
+	/* Welford's method, which does not lose precision over many values. */
+	stats->count++;
+	delta = (double)ns - stats->mean;
+	stats->mean += delta / (double)stats->count;
+	stats->m2 += delta * ((double)ns - stats->mean);
+
+	stats->buckets[stats_bucket(ns)]++;
+}
+
+void cfutimer_stats_start(cfutimer_stats_t *stats)
+{
+	stats->start = cfutimer_cycles_now();
+}
+
+void cfutimer_stats_stop(cfutimer_stats_t *stats)
+{
+	uint64_t now = cfutimer_cycles_now();
+	cfutimer_stats_add(stats, cfutimer_cycles_to_ns(now - stats->start));
+}
+
+void cfutimer_stats_lap(cfutimer_stats_t *stats)
+{
+	uint64_t now = cfutimer_cycles_now();
+	cfutimer_stats_add(stats, cfutimer_cycles_to_ns(now - stats->start));
+	stats->start = now;
+}
+
+void cfutimer_stats_merge(cfutimer_stats_t *dst, const cfutimer_stats_t *src)
+{
+	double delta;
+	double count;
+	size_t i;
+
+	if (!src->count)
+		return;
+
+	if (!dst->count || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+
+	/* Combine the means and squared differences of both sets, as in
+	 * Chan et al.'s parallel variance algorithm. */
+	count = (double)dst->count + (double)src->count;
+	delta = src->mean - dst->mean;
+	dst->mean += delta * (double)src->count / count;
+	dst->m2 += src->m2 + delta * delta * (double)dst->count * (double)src->count / count;
+	dst->count += src->count;
+
+	for (i = 0; i < STATS_NUM_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+void cfutimer_stats_reset(cfutimer_stats_t *stats)
+{
+	libcfu_type type = stats->type;
+	memset(stats, 0, sizeof(cfutimer_stats_t));
+	stats->type = type;
+}
+
+uint64_t cfutimer_stats_count(const cfutimer_stats_t *stats)
+{
+	return stats->count;
+}
+
+uint64_t cfutimer_stats_min(const cfutimer_stats_t *stats)
+{
+	return stats->min;
+}
+
+uint64_t cfutimer_stats_max(const cfutimer_stats_t *stats)
+{
+	return stats->max;
+}
+
+double cfutimer_stats_mean(const cfutimer_stats_t *stats)
+{
+	return stats->mean;
+}
+
+double cfutimer_stats_stddev(const cfutimer_stats_t *stats)
+{
+	if (stats->count < 2)
+		return 0.0;
+	return sqrt(stats->m2 / (double)(stats->count - 1));
+}
+
+uint64_t cfutimer_stats_percentile(const cfutimer_stats_t *stats, double percentile)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	uint64_t value;
+	size_t i;
+
+	if (!stats->count)
+		return 0;
+	if (percentile < 0.0)
+		percentile = 0.0;
+	if (percentile > 100.0)
+		percentile = 100.0;
+
+	target = (uint64_t)ceil(percentile / 100.0 * (double)stats->count);
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < STATS_NUM_BUCKETS; i++) {
+		seen += stats->buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	/* The bucket only bounds the value, but it is never outside the
+	 * range that was actually recorded. */
+	value = stats_bucket_max(i);
+	if (value > stats->max)
+		value = stats->max;
+	if (value < stats->min)
+		value = stats->min;
+	return value;
+}
+
+void cfutimer_stats_free(cfutimer_stats_t *stats)
+{
+	free(stats);
+}